@@ -15,6 +15,7 @@
 #include "inc/common.h"
 #include "inc/fbhandlers.h"
 #include "inc/usbhandlers.h"
+#include "inc/stathandlers.h"
 #include <linux/version.h>
 
 
@@ -24,33 +25,101 @@
     #define FB_DEFIO_LIST pagelist 
 #endif
 
-static struct fb_info * _default_fb;
+// since 5.19 the deferred io reports the written pages as fb_deferred_io_pageref
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    #define RPUSBDISP_DEFIO_PAGEREF
+#endif
+
+#define RPUSBDISP_MAX_DIRTY_RECTS         8
+
+// what an extra bitblt command costs besides its pixels (header, packet padding and the ticket round trip), in pixels
+#define RPUSBDISP_DIRTY_RECT_MERGE_COST   128
 
+// bytes compared at once when looking for the changed columns
+#define RPUSBDISP_SHADOW_WORD_SIZE        sizeof(unsigned long)
+
+// drawing operations recorded for the update worker, the later ones are only recorded as damage
+#define RPUSBDISP_MAX_PENDING_OPS         32
+
+// the edges are included
 struct dirty_rect {
     int  left;
     int  top;
     int  right;
     int  bottom;
-    atomic_t dirty_flag;
 };  
 
+// up to RPUSBDISP_MAX_DIRTY_RECTS rects, which may overlap each other
+struct dirty_region {
+    struct dirty_rect rects[RPUSBDISP_MAX_DIRTY_RECTS];
+    int  count;
+    atomic_t dirty_flag;
+};
+
 enum {
     DISPLAY_UPDATE_HINT_NONE       = 0,
     DISPLAY_UPDATE_HINT_BITBLT     = 1,
     DISPLAY_UPDATE_HINT_FILLRECT   = 2,
     DISPLAY_UPDATE_HINT_COPYAREA   = 3,
+    DISPLAY_UPDATE_HINT_REGION     = 4,  // rows written through mmap, shrunk to the pixels differing from the shadow
+    DISPLAY_UPDATE_HINT_MONO       = 5,  // a 1bpp image (console text), sent from the mono plane of the pending operations
+
+};
 
+// a drawing operation waiting for the update worker
+struct display_op {
+    int               hint;
+    struct dirty_rect rect;     // the area changed, the edges are included
+    int               sx, sy;   // the source of a copyarea
+    int               has_stale;
+    struct dirty_rect stale;    // the part of the copyarea source sent after the copy was drawn
+    _u32              color;    // the color of a fillrect or the foreground of a mono image, in the pixel format of the framebuffer
+    _u32              bg_color; // the background of a mono image
+    int               rop;
+};
+
+// the operations in the order they were drawn, the damage recorded once ops is full comes after all of them
+struct display_pending {
+    struct display_op   ops[RPUSBDISP_MAX_PENDING_OPS];
+    int                 count;
+    struct dirty_region overflow;
+    _u8               * mono;   // the bits of the mono images at their screen position, NULL if it cannot be allocated
 };
 
 struct rpusbdisp_fb_private {
     _u32 pseudo_palette [16];
-    struct dirty_rect dirty_rect;
-    struct mutex      operation_lock;
+    struct fb_info       * info;
+    struct dirty_region dirty_region;
+    struct mutex      operation_lock;   // held by the update worker
     struct rpusbdisp_dev * binded_usbdev;
+    _u8                  * shadow;  // the image last submitted to the display, NULL if it cannot be allocated
+
+    // the fb operations draw and record under pending_lock, so the framebuffer always matches the recorded operations
+    struct mutex             pending_lock;
+    struct display_pending   pending;
+    struct display_pending   running;   // taken by the update worker
+    wait_queue_head_t        pending_wait;  // the copies waiting for room in pending
+    int                      mono_line_length;
+    struct workqueue_struct * update_wq;
+    struct work_struct       update_work;
+
+    // FBIO_WAITFORVSYNC, the sequence numbers count the recorded operations
+    _u32                     record_seq;    // under pending_lock
+    atomic_t                 sent_seq;      // everything recorded up to it has been submitted
+    atomic_t                 done_seq;      // everything recorded up to it has been transferred
+    wait_queue_head_t        frame_wait;
+
+    // adaptive pacing, the refresh period follows the time a frame takes to get through the usb
+    spinlock_t               pacing_lock;
+    ktime_t                  frame_start;
+    size_t                   frame_pixels;  // sent since frame_start, 0 if no frame is in flight
+    unsigned int             pixel_rate;    // pixels transferred per ms, moving average
+    unsigned int             frame_size;    // pixels of a frame, moving average
 
 
 //lock free area
     atomic_t               unsync_flag;
+    atomic_t               defio_calls;     // added to the counters of the device by the update worker
 };
 
 static struct fb_fix_screeninfo _vfb_fix = {
@@ -58,159 +127,850 @@ static struct fb_fix_screeninfo _vfb_fix = {
 	.type =		FB_TYPE_PACKED_PIXELS,
 	.visual =	FB_VISUAL_TRUECOLOR,
 	.accel =	FB_ACCEL_NONE,
-    .line_length = RP_DISP_DEFAULT_WIDTH * RP_DISP_DEFAULT_PIXEL_BITS/8,
 
 };
 
+// the resolution and the pixel format are filled by _setup_fb_format
 static  struct fb_var_screeninfo _var_info = {
-    .xres = RP_DISP_DEFAULT_WIDTH,
-    .yres = RP_DISP_DEFAULT_HEIGHT,
-    .xres_virtual = RP_DISP_DEFAULT_WIDTH,
-    .yres_virtual = RP_DISP_DEFAULT_HEIGHT,
-    .width = RP_DISP_DEFAULT_WIDTH,
-    .height = RP_DISP_DEFAULT_HEIGHT,
-    .bits_per_pixel =        RP_DISP_DEFAULT_PIXEL_BITS ,
-    .red = { 0 , 5 , 0 } ,
-    .green = { 5 , 6 , 0 } ,
-    .blue = { 11 , 5 , 0 } ,
     .activate = FB_ACTIVATE_NOW,
     .vmode = FB_VMODE_NONINTERLACED,
 };
 
-static DEFINE_MUTEX(_mutex_devreg);
+static const struct fb_bitfield _rgb565_bitfields[] = {
+    { 0 , 5 , 0 } ,
+    { 5 , 6 , 0 } ,
+    { 11 , 5 , 0 } ,
+};
+
+static const struct fb_bitfield _xrgb8888_bitfields[] = {
+    { 16 , 8 , 0 } ,
+    { 8 , 8 , 0 } ,
+    { 0 , 8 , 0 } ,
+};
 
 static inline struct rpusbdisp_fb_private * _get_fb_private(struct fb_info * info)
 {
     return (struct rpusbdisp_fb_private *)info->par;
 }
 
-static void _clear_dirty_rect(struct dirty_rect * rect) {
-    rect->left = RP_DISP_DEFAULT_WIDTH;
-    rect->right = -1;
-    rect->top = RP_DISP_DEFAULT_HEIGHT;
-    rect->bottom = -1;
-    atomic_set(&rect->dirty_flag,0);
+static void _clear_dirty_region(struct dirty_region * region) {
+    region->count = 0;
+    atomic_set(&region->dirty_flag,0);
+}
+
+static inline int _dirty_rect_area(const struct dirty_rect * rect) {
+    return (rect->right - rect->left + 1) * (rect->bottom - rect->top + 1);
+}
+
+static inline void _dirty_rect_union(struct dirty_rect * dest, const struct dirty_rect * rect) {
+    if (dest->left > rect->left) dest->left = rect->left;
+    if (dest->top > rect->top) dest->top = rect->top;
+    if (dest->right < rect->right) dest->right = rect->right;
+    if (dest->bottom < rect->bottom) dest->bottom = rect->bottom;
+}
+
+static inline int _dirty_rect_contains(const struct dirty_rect * outer, const struct dirty_rect * inner) {
+    return outer->left <= inner->left && outer->top <= inner->top && outer->right >= inner->right && outer->bottom >= inner->bottom;
+}
+
+static inline int _dirty_rect_intersects(const struct dirty_rect * a, const struct dirty_rect * b) {
+    return a->left <= b->right && b->left <= a->right && a->top <= b->bottom && b->top <= a->bottom;
+}
+
+// shrink rect to its intersection with clip, returns 0 if they do not intersect
+static inline int _dirty_rect_clip(struct dirty_rect * rect, const struct dirty_rect * clip) {
+    if (!_dirty_rect_intersects(rect, clip)) return 0;
+
+    if (rect->left < clip->left) rect->left = clip->left;
+    if (rect->top < clip->top) rect->top = clip->top;
+    if (rect->right > clip->right) rect->right = clip->right;
+    if (rect->bottom > clip->bottom) rect->bottom = clip->bottom;
+    return 1;
+}
+
+static void _dirty_region_remove(struct dirty_region * region, int pos) {
+    // the order of the rects does not matter
+    region->rects[pos] = region->rects[--region->count];
+}
+
+static void _dirty_region_add(struct dirty_region * region, int left, int top, int right, int bottom) {
+    struct dirty_rect rect = { left, top, right, bottom };
+    struct dirty_rect merged;
+    int pos, best_pos, growth, best_growth;
+
+    if (left > right || top > bottom) return;
+
+    // absorb the rects which are cheaper to send together with the new one than on their own
+    pos = 0;
+    while (pos < region->count) {
+        merged = rect;
+        _dirty_rect_union(&merged, &region->rects[pos]);
+
+        if (_dirty_rect_area(&merged) <= _dirty_rect_area(&rect) + _dirty_rect_area(&region->rects[pos]) + RPUSBDISP_DIRTY_RECT_MERGE_COST) {
+            rect = merged;
+            _dirty_region_remove(region, pos);
+            // the grown rect may absorb the rects checked before
+            pos = 0;
+        } else {
+            ++pos;
+        }
+    }
+
+    if (region->count == RPUSBDISP_MAX_DIRTY_RECTS) {
+        // the region is full, merge the new rect into the one growing least
+        best_pos = 0;
+        best_growth = INT_MAX;
+        for (pos = 0; pos < region->count; ++pos) {
+            merged = rect;
+            _dirty_rect_union(&merged, &region->rects[pos]);
+            growth = _dirty_rect_area(&merged) - _dirty_rect_area(&region->rects[pos]);
+
+            if (growth < best_growth) {
+                best_growth = growth;
+                best_pos = pos;
+            }
+        }
+
+        _dirty_rect_union(&rect, &region->rects[best_pos]);
+        _dirty_region_remove(region, best_pos);
+    }
+
+    region->rects[region->count++] = rect;
+}
+
+// the display has been updated by a command covering rect, the dirty rects inside it are clean now
+static void _dirty_region_remove_covered(struct dirty_region * region, const struct dirty_rect * rect) {
+    int pos = 0;
+
+    while (pos < region->count) {
+        if (_dirty_rect_contains(rect, &region->rects[pos])) {
+            _dirty_region_remove(region, pos);
+        } else {
+            ++pos;
+        }
+    }
+}
+
+static int _dirty_region_intersects(const struct dirty_region * region, const struct dirty_rect * rect) {
+    int pos;
+
+    for (pos = 0; pos < region->count; ++pos) {
+        if (_dirty_rect_intersects(&region->rects[pos], rect)) return 1;
+    }
+    return 0;
+}
+
+static void _clear_display_pending(struct display_pending * pending) {
+    pending->count = 0;
+    _clear_dirty_region(&pending->overflow);
 }
 
 static void _reset_fb_private(struct rpusbdisp_fb_private * pa) {
     mutex_init(&pa->operation_lock);
-    _clear_dirty_rect(&pa->dirty_rect);
+    mutex_init(&pa->pending_lock);
+    _clear_dirty_region(&pa->dirty_region);
+    _clear_display_pending(&pa->pending);
+    _clear_display_pending(&pa->running);
+    pa->record_seq = 0;
+    atomic_set(&pa->sent_seq, 0);
+    atomic_set(&pa->done_seq, 0);
+    init_waitqueue_head(&pa->frame_wait);
+    init_waitqueue_head(&pa->pending_wait);
+    spin_lock_init(&pa->pacing_lock);
+    pa->frame_pixels = 0;
+    pa->pixel_rate = 0;
+    pa->frame_size = 0;
     pa->binded_usbdev = NULL;
+    pa->shadow = NULL;
+    pa->pending.mono = NULL;
+    pa->running.mono = NULL;
     atomic_set(&pa->unsync_flag, 1);
+    atomic_set(&pa->defio_calls, 0);
+}
+
+static inline _u8 * _fb_row(struct fb_info *p, _u8 * base, int y) {
+    return base + y * p->fix.line_length;
 }
 
-static  void _display_update( struct fb_info *p, int x, int y, int width, int height, int hint, const void * hint_data)
+static inline int _shadow_word_equal(const _u8 * a, const _u8 * b) {
+    return get_unaligned((const unsigned long *)a) == get_unaligned((const unsigned long *)b);
+}
+
+// the first byte in [from, to) differing between the two rows, to if they are the same
+static size_t _shadow_first_diff(const _u8 * a, const _u8 * b, size_t from, size_t to) {
+    while (from + RPUSBDISP_SHADOW_WORD_SIZE <= to && _shadow_word_equal(a + from, b + from)) {
+        from += RPUSBDISP_SHADOW_WORD_SIZE;
+    }
+    while (from < to && a[from] == b[from]) ++from;
+    return from;
+}
+
+// the end of the last byte in [from, to) differing between the two rows, from if they are the same
+static size_t _shadow_last_diff(const _u8 * a, const _u8 * b, size_t from, size_t to) {
+    while (to >= from + RPUSBDISP_SHADOW_WORD_SIZE && _shadow_word_equal(a + to - RPUSBDISP_SHADOW_WORD_SIZE, b + to - RPUSBDISP_SHADOW_WORD_SIZE)) {
+        to -= RPUSBDISP_SHADOW_WORD_SIZE;
+    }
+    while (to > from && a[to - 1] == b[to - 1]) --to;
+    return to;
+}
+
+// shrink a rect to the pixels differing from the shadow, returns 0 if none of them has changed
+static int _shadow_trim_rect(struct fb_info *p, struct rpusbdisp_fb_private * pa, struct dirty_rect * rect)
 {
+    const size_t pixel_size = p->var.bits_per_pixel / 8;
+    const size_t row_start = rect->left * pixel_size, row_end = (rect->right + 1) * pixel_size;
+    size_t left = row_end, right = row_start, first, last;
+    int top = -1, bottom = -1;
+    int y;
 
-    struct rpusbdisp_fb_private * pa = _get_fb_private(p);
+    for (y = rect->top; y <= rect->bottom; ++y) {
+        const _u8 * fb_row = _fb_row(p, (_u8 *)p->screen_base, y);
+        const _u8 * shadow_row = _fb_row(p, pa->shadow, y);
 
-    int clear_dirty = 0;
-    mutex_lock(&pa->operation_lock);
+        first = _shadow_first_diff(fb_row, shadow_row, row_start, row_end);
+        if (first == row_end) continue;
 
-    if (!pa->binded_usbdev) goto final;
-    // 1. update the dirty rect
-    
-    if (atomic_dec_and_test(&pa->unsync_flag)) {
-        // force the dirty rect to cover the full display area if the display is not synced.
-        pa->dirty_rect.left = 0;
-        pa->dirty_rect.right = p->var.width-1;
-        pa->dirty_rect.top = 0;
-        pa->dirty_rect.bottom = p->var.height-1;
+        last = _shadow_last_diff(fb_row, shadow_row, first, row_end);
 
-        clear_dirty = 1;
-    } else {
-        
-        if (pa->dirty_rect.top > y) pa->dirty_rect.top = y;
-        if (pa->dirty_rect.bottom < height+y-1) pa->dirty_rect.bottom = height+y-1;
-        if (pa->dirty_rect.left > x) pa->dirty_rect.left = x;
-        if (pa->dirty_rect.right < width+x-1) pa->dirty_rect.right = width + x - 1;
+        if (left > first) left = first;
+        if (right < last) right = last;
+        if (top < 0) top = y;
+        bottom = y;
+    }
+
+    if (top < 0) return 0;
 
+    rect->left = left / pixel_size;
+    rect->right = (right - 1) / pixel_size;
+    rect->top = top;
+    rect->bottom = bottom;
+    return 1;
+}
+
+// copy the current image of a rect to the shadow
+static void _shadow_update(struct fb_info *p, struct rpusbdisp_fb_private * pa, const struct dirty_rect * rect)
+{
+    const size_t pixel_size = p->var.bits_per_pixel / 8;
+    int y;
+
+    if (!pa->shadow) return;
+
+    for (y = rect->top; y <= rect->bottom; ++y) {
+        memcpy(_fb_row(p, pa->shadow, y) + rect->left * pixel_size, _fb_row(p, (_u8 *)p->screen_base, y) + rect->left * pixel_size, 
+            (rect->right - rect->left + 1) * pixel_size);
     }
+}
+
+// the display has done a fillrect, do the same to the shadow
+static void _shadow_fill(struct fb_info *p, struct rpusbdisp_fb_private * pa, const struct display_op * op)
+{
+    int x, y;
 
-    if (pa->dirty_rect.top > pa->dirty_rect.bottom || pa->dirty_rect.left > pa->dirty_rect.right) {
-        goto final;
+    if (!pa->shadow) return;
+
+    for (y = op->rect.top; y <= op->rect.bottom; ++y) {
+        _u8 * row = _fb_row(p, pa->shadow, y);
+
+        for (x = op->rect.left; x <= op->rect.right; ++x) {
+            if (p->var.bits_per_pixel == RP_DISP_PIXEL_BITS_XRGB8888) {
+                _u32 * pixel = (_u32 *)row + x;
+                *pixel = (op->rop == ROP_XOR) ? (*pixel ^ op->color) : op->color;
+            } else {
+                u16 * pixel = (u16 *)row + x;
+                *pixel = (op->rop == ROP_XOR) ? (*pixel ^ (u16)op->color) : (u16)op->color;
+            }
+        }
     }
-    atomic_set(&pa->dirty_rect.dirty_flag, 1);
+}
 
-    // 2. try to send it
-    if (pa->binded_usbdev) {
+// the display has done a copyarea, do the same to the shadow
+static void _shadow_copy(struct fb_info *p, struct rpusbdisp_fb_private * pa, const struct display_op * op)
+{
+    const size_t pixel_size = p->var.bits_per_pixel / 8;
+    const size_t row_size = (op->rect.right - op->rect.left + 1) * pixel_size;
+    const int height = op->rect.bottom - op->rect.top + 1;
+    int row;
+
+    if (!pa->shadow) return;
+
+    // same as sys_copyarea, copy from the bottom when the destination is below the source
+    for (row = 0; row < height; ++row) {
+        const int pos = (op->rect.top > op->sy) ? (height - 1 - row) : row;
+
+        memmove(_fb_row(p, pa->shadow, op->rect.top + pos) + op->rect.left * pixel_size,
+            _fb_row(p, pa->shadow, op->sy + pos) + op->sx * pixel_size, row_size);
+    }
+}
+
+// the display has drawn a mono image, do the same to the shadow
+static void _shadow_mono(struct fb_info *p, struct rpusbdisp_fb_private * pa, const struct display_op * op, const _u8 * mono)
+{
+    int x, y;
+
+    if (!pa->shadow) return;
+
+    for (y = op->rect.top; y <= op->rect.bottom; ++y) {
+        const _u8 * bits = mono + y * pa->mono_line_length;
+        _u8 * row = _fb_row(p, pa->shadow, y);
+
+        for (x = op->rect.left; x <= op->rect.right; ++x) {
+            const _u32 color = rpusbdisp_mono_bit(bits, x) ? op->color : op->bg_color;
+
+            if (p->var.bits_per_pixel == RP_DISP_PIXEL_BITS_XRGB8888) {
+                ((_u32 *)row)[x] = color;
+            } else {
+                ((u16 *)row)[x] = (u16)color;
+            }
+        }
+    }
+}
+
+// the area of the display an operation depends on, returns 0 if the result does not depend on the display
+static int _display_op_source(const struct display_op * op, struct dirty_rect * source)
+{
+    switch (op->hint) {
+        case DISPLAY_UPDATE_HINT_COPYAREA:
+            source->left = op->sx;
+            source->top = op->sy;
+            source->right = op->sx + op->rect.right - op->rect.left;
+            source->bottom = op->sy + op->rect.bottom - op->rect.top;
+            return 1;
+        case DISPLAY_UPDATE_HINT_FILLRECT:
+            *source = op->rect;
+            return op->rop == ROP_XOR;
+    }
+    return 0;
+}
 
-        switch (hint) {
-            case DISPLAY_UPDATE_HINT_FILLRECT:
+// the pending operations reading rect would see pixels drawn after them once rect is sent. A copy goes on
+// and sends the pixels it has read too early again at the destination, the others send their results as images
+static void _display_pending_sent(struct rpusbdisp_fb_private * pa, const struct dirty_rect * rect)
+{
+    struct display_op * op;
+    struct dirty_rect source;
+    int pos;
+
+    for (pos = 0; pos < pa->pending.count; ++pos) {
+        op = &pa->pending.ops[pos];
+        if (!_display_op_source(op, &source) || !_dirty_rect_clip(&source, rect)) continue;
+
+        if (op->hint == DISPLAY_UPDATE_HINT_COPYAREA) {
+            if (op->has_stale) {
+                _dirty_rect_union(&op->stale, &source);
+            } else {
+                op->stale = source;
+                op->has_stale = 1;
+            }
+        } else {
+            op->hint = DISPLAY_UPDATE_HINT_NONE;
+        }
+    }
+}
+
+// the dirty pixels of a copy source have been copied as they were on the display, move their damage to the destination
+static void _display_copy_damage(struct dirty_region * moved, const struct display_op * op, const struct dirty_rect * damage)
+{
+    struct dirty_rect source;
+    const int dx = op->rect.left - op->sx;
+    const int dy = op->rect.top - op->sy;
+    struct dirty_rect rect = *damage;
+
+    _display_op_source(op, &source);
+    if (!_dirty_rect_clip(&rect, &source)) return;
+    _dirty_region_add(moved, rect.left + dx, rect.top + dy, rect.right + dx, rect.bottom + dy);
+}
+
+// pixels are about to be submitted, the first ones of a frame start its clock. Counted before the submission,
+// as the transfer may have completed by the time it returns
+static void _display_pacing_sent(struct rpusbdisp_fb_private * pa, size_t pixels)
+{
+    spin_lock(&pa->pacing_lock);
+    if (!pa->frame_pixels) pa->frame_start = ktime_get();
+    pa->frame_pixels += pixels;
+    spin_unlock(&pa->pacing_lock);
+}
+
+// the pixels counted by _display_pacing_sent failed to be submitted
+static void _display_pacing_unsent(struct rpusbdisp_fb_private * pa, size_t pixels)
+{
+    spin_lock(&pa->pacing_lock);
+    pa->frame_pixels -= min(pa->frame_pixels, pixels);
+    spin_unlock(&pa->pacing_lock);
+}
+
+// send each dirty rect as its own bitblt, the rects not sent are left for the next time
+static void _display_send_dirty_region(struct fb_info *p, struct rpusbdisp_fb_private * pa, int clear_dirty)
+{
+    struct dirty_region * region = &pa->dirty_region;
+
+    while (region->count) {
+        struct dirty_rect * rect = &region->rects[region->count - 1];
+        const void * image = (const void *)p->fix.smem_start;
+
+        mutex_lock(&pa->pending_lock);
+        if (pa->shadow) {
+            // send a snapshot taken into the shadow, so the shadow holds exactly what the display gets even if
+            // the framebuffer is being written through mmap meanwhile. A rect failed to be sent stays dirty
+            _shadow_update(p, pa, rect);
+            image = pa->shadow;
+        }
+        _display_pending_sent(pa, rect);
+        mutex_unlock(&pa->pending_lock);
+
+        _display_pacing_sent(pa, _dirty_rect_area(rect));
+
+        if (!rpusbdisp_usb_try_send_image(pa->binded_usbdev, image,
+             rect->left, rect->top, rect->right, rect->bottom, p->fix.line_length, p->var.bits_per_pixel,
+             clear_dirty)) {
+            // tickets are inadequate, the full screen update with clear_dirty should be retried as well
+            _display_pacing_unsent(pa, _dirty_rect_area(rect));
+            if (clear_dirty) atomic_set(&pa->unsync_flag, 1);
+            break;
+        }
+
+        clear_dirty = 0;
+        --region->count;
+    }
+}
+
+// the color of a fillrect or a mono image in the pixel format of the framebuffer
+static _u32 _palette_color(struct fb_info *p, _u32 color)
+{
+    // same as sys_fillrect and sys_imageblit, the color is an index to the pseudo palette with true color visuals
+    if (p->fix.visual == FB_VISUAL_TRUECOLOR || p->fix.visual == FB_VISUAL_DIRECTCOLOR) {
+        color = ((_u32 *)p->pseudo_palette)[color];
+    }
+    return color;
+}
+
+// the color of a fillrect in the pixel format of the display
+static pixel_type_t _display_color(struct fb_info *p, _u32 color)
+{
+    if (p->var.bits_per_pixel == RP_DISP_PIXEL_BITS_XRGB8888) {
+        return rp_disp_xrgb8888_to_pixel(color);
+    }
+    return (pixel_type_t)color;
+}
+
+// replay a recorded fillrect or copyarea on the display, or leave its area to be sent as an image
+static void _display_run_op(struct fb_info *p, struct rpusbdisp_fb_private * pa, const struct display_op * op)
+{
+    const struct dirty_rect * rect = &op->rect;
+    struct dirty_rect source;
+
+    switch (op->hint) {
+        case DISPLAY_UPDATE_HINT_FILLRECT:
+            // a xor fill needs the display to be up to date below it
+            if (!(_display_op_source(op, &source) && _dirty_region_intersects(&pa->dirty_region, &source)) &&
+                rpusbdisp_usb_try_draw_rect(pa->binded_usbdev, rect->left, rect->top, rect->right, rect->bottom, 
+                _display_color(p, op->color), op->rop==ROP_XOR?RPUSBDISP_OPERATION_XOR:RPUSBDISP_OPERATION_COPY))
             {
-                const struct fb_fillrect * fillrt = (struct fb_fillrect *)hint_data;
-                if (rpusbdisp_usb_try_draw_rect(pa->binded_usbdev, fillrt->dx, fillrt->dy, fillrt->dx + fillrt->width-1, 
-                    fillrt->dy + fillrt->height-1, fillrt->color, fillrt->rop==ROP_XOR?RPUSBDISP_OPERATION_XOR:RPUSBDISP_OPERATION_COPY))
-                {
-                    // data sent, rect the dirty rect
-                    _clear_dirty_rect(&pa->dirty_rect);
-                  
-                        
-                }
+                // data sent, the dirty rects under the filled area are clean
+                _dirty_region_remove_covered(&pa->dirty_region, rect);
+                _shadow_fill(p, pa, op);
+                return;
             }
             break;
 
-            case DISPLAY_UPDATE_HINT_COPYAREA:
+        case DISPLAY_UPDATE_HINT_COPYAREA:
+            // the display copies what it shows, the source pixels not up to date there are sent again at the destination
+            if (rpusbdisp_usb_try_copy_area(pa->binded_usbdev, op->sx, op->sy, rect->left, rect->top, 
+                rect->right - rect->left + 1, rect->bottom - rect->top + 1))
             {
-                const  struct fb_copyarea * copyarea = (struct fb_copyarea *)hint_data;
-                if (rpusbdisp_usb_try_copy_area(pa->binded_usbdev, copyarea->sx, copyarea->sy, copyarea->dx,  copyarea->dy, 
-                    copyarea->width, copyarea->height))
-                {
-                    // data sent, rect the dirty rect
-                    _clear_dirty_rect(&pa->dirty_rect);
-                       
+                struct dirty_region moved;
+                int pos;
+
+                _clear_dirty_region(&moved);
+                for (pos = 0; pos < pa->dirty_region.count; ++pos) {
+                    _display_copy_damage(&moved, op, &pa->dirty_region.rects[pos]);
+                }
+                if (op->has_stale) _display_copy_damage(&moved, op, &op->stale);
+
+                // data sent, the dirty rects under the destination area are clean
+                _dirty_region_remove_covered(&pa->dirty_region, rect);
+                for (pos = 0; pos < moved.count; ++pos) {
+                    _dirty_region_add(&pa->dirty_region, moved.rects[pos].left, moved.rects[pos].top, moved.rects[pos].right, moved.rects[pos].bottom);
                 }
 
+                _shadow_copy(p, pa, op);
+                return;
+            }
+            break;
+
+        case DISPLAY_UPDATE_HINT_MONO:
+            // built from the bits of the image, the framebuffer is neither read nor converted
+            if (rpusbdisp_usb_try_send_mono(pa->binded_usbdev, pa->running.mono, rect->left, rect->top, rect->right, rect->bottom,
+                pa->mono_line_length, _display_color(p, op->color), _display_color(p, op->bg_color)))
+            {
+                _dirty_region_remove_covered(&pa->dirty_region, rect);
+                _shadow_mono(p, pa, op, pa->running.mono);
+                return;
             }
             break;
-            default:
-                if (rpusbdisp_usb_try_send_image(pa->binded_usbdev, (const pixel_type_t *)p->fix.smem_start,
-                     pa->dirty_rect.left, pa->dirty_rect.top, pa->dirty_rect.right, pa->dirty_rect.bottom, p->fix.line_length/(RP_DISP_DEFAULT_PIXEL_BITS/8),
-                     clear_dirty)) {
-                    // data sent, rect the dirty rect
-                    _clear_dirty_rect(&pa->dirty_rect);
-
-                } 
+
+        case DISPLAY_UPDATE_HINT_REGION:
+            // the pages only tell the rows, find the columns actually changed
+            source = *rect;
+            if (pa->shadow && !_shadow_trim_rect(p, pa, &source)) return;
+
+            _dirty_region_add(&pa->dirty_region, source.left, source.top, source.right, source.bottom);
+            return;
+    }
+
+    // send it as an image
+    _dirty_region_add(&pa->dirty_region, rect->left, rect->top, rect->right, rect->bottom);
+}
+
+// everything submitted up to sent_seq has been transferred, wake up the FBIO_WAITFORVSYNC callers
+static void _display_frame_done(struct rpusbdisp_fb_private * pa)
+{
+    atomic_set(&pa->done_seq, atomic_read(&pa->sent_seq));
+    wake_up_all(&pa->frame_wait);
+}
+
+static inline int _display_frame_done_since(struct rpusbdisp_fb_private * pa, _u32 seq)
+{
+    return (int)(atomic_read(&pa->done_seq) - seq) >= 0;
+}
+
+// a frame has got through, measure the throughput and set the refresh period of the deferred io
+static void _display_pacing_update(struct fb_info * p, struct rpusbdisp_fb_private * pa)
+{
+    unsigned long period = HZ/fps;
+    unsigned int period_ms;
+    unsigned int rate;
+    s64 elapsed_us;
+
+    spin_lock(&pa->pacing_lock);
+    if (pa->frame_pixels) {
+        elapsed_us = max_t(s64, ktime_us_delta(ktime_get(), pa->frame_start), 1);
+        rate = max_t(unsigned int, div64_u64((u64)pa->frame_pixels * 1000, elapsed_us), 1);
+
+        pa->pixel_rate = pa->pixel_rate ? (pa->pixel_rate * 3 + rate) / 4 : rate;
+        pa->frame_size = pa->frame_size ? (pa->frame_size * 3 + (unsigned int)pa->frame_pixels) / 4 : (unsigned int)pa->frame_pixels;
+        pa->frame_pixels = 0;
+    }
+
+    if (adaptive_fps && pa->pixel_rate) {
+        // collect the pages written through mmap as often as the usb can take the frames made of them
+        period_ms = clamp(pa->frame_size / pa->pixel_rate, 1000U / RPUSBDISP_ADAPTIVE_MAX_FPS, 1000U / RPUSBDISP_ADAPTIVE_MIN_FPS);
+        period = max_t(unsigned long, msecs_to_jiffies(period_ms), 1);
+    }
+    spin_unlock(&pa->pacing_lock);
+
+    p->fbdefio->delay = period;
+}
+
+// block until the damage recorded before the call has been transferred to the display
+static int _display_wait_for_frame(struct fb_info * p)
+{
+    struct rpusbdisp_fb_private * pa = _get_fb_private(p);
+    _u32 seq;
+    long ret;
+
+    // the pages written through mmap are only recorded once the deferred io has collected them
+    flush_delayed_work(&p->deferred_work);
+
+    mutex_lock(&pa->pending_lock);
+    seq = pa->record_seq;
+    mutex_unlock(&pa->pending_lock);
+
+    // the worker reports a frame done even if it has nothing to send
+    queue_work(pa->update_wq, &pa->update_work);
+
+    ret = wait_event_interruptible_timeout(pa->frame_wait, _display_frame_done_since(pa, seq) || !pa->binded_usbdev,
+        msecs_to_jiffies(RPUSBDISP_FRAME_WAIT_TIMEOUT_MS));
+
+    if (ret < 0) return ret;
+    if (!pa->binded_usbdev) return -ENODEV;
+    if (!ret) return -ETIMEDOUT;
+    return 0;
+}
+
+static int _display_ioctl(struct fb_info *p, unsigned int cmd, unsigned long arg)
+{
+    _u32 crtc;
+
+    switch (cmd) {
+        case FBIO_WAITFORVSYNC:
+            if (get_user(crtc, (_u32 __user *)arg)) return -EFAULT;
+            if (crtc != 0) return -ENODEV;
+
+            return _display_wait_for_frame(p);
+    }
+    return -ENOTTY;
+}
+
+// the update worker of a display, it owns the encoding and the transfers
+static void _display_update_work(struct work_struct * work)
+{
+    struct rpusbdisp_fb_private * pa = container_of(work, struct rpusbdisp_fb_private, update_work);
+    struct fb_info * p = pa->info;
+    struct display_pending * running = &pa->running;
+    struct rpusbdisp_dev * usbdev;
+    _u8 * mono;
+    int clear_dirty = 0;
+    _u32 seq;
+    int pos;
+
+    mutex_lock(&pa->operation_lock);
+
+    // wakes the display up if it has been autosuspended
+    usbdev = pa->binded_usbdev;
+    if (usbdev && rpusbdisp_usb_autopm_get(usbdev)) {
+        // suspended for system sleep, what has been recorded is sent once the resume queues the worker again
+        atomic_set(&pa->dirty_region.dirty_flag, 1);
+        mutex_unlock(&pa->operation_lock);
+        return;
+    }
+
+    // take everything recorded so far, the fb operations go on recording while the worker is sending
+    mutex_lock(&pa->pending_lock);
+    mono = running->mono;
+    *running = pa->pending;
+    pa->pending.mono = mono;
+    _clear_display_pending(&pa->pending);
+    seq = pa->record_seq;
+    mutex_unlock(&pa->pending_lock);
+
+    wake_up_all(&pa->pending_wait);
+
+    if (!pa->binded_usbdev) goto final;
+
+    // the deferred io cannot reach the counters safely, the device may be going away meanwhile
+    rpusbdisp_stat_add(rpusbdisp_usb_get_stats(usbdev), RPUSBDISP_STAT_DEFIO_CALLBACKS, atomic_xchg(&pa->defio_calls, 0));
+    
+    if (atomic_dec_and_test(&pa->unsync_flag)) {
+        // force the dirty region to cover the full display area if the display is not synced.
+        // The recorded operations are already in the framebuffer, which is sent as a whole
+        _clear_dirty_region(&pa->dirty_region);
+        _dirty_region_add(&pa->dirty_region, 0, 0, p->var.width-1, p->var.height-1);
+
+        clear_dirty = 1;
+    } else {
+        // in the order they were drawn, so each operation only cleans up the damage older than itself
+        for (pos = 0; pos < running->count; ++pos) {
+            _display_run_op(p, pa, &running->ops[pos]);
         }
 
+        for (pos = 0; pos < running->overflow.count; ++pos) {
+            const struct dirty_rect * rect = &running->overflow.rects[pos];
+            _dirty_region_add(&pa->dirty_region, rect->left, rect->top, rect->right, rect->bottom);
+        }
+    }
+
+    if (running->count || pa->dirty_region.count) {
+        rpusbdisp_stat_inc(rpusbdisp_usb_get_stats(usbdev), RPUSBDISP_STAT_FRAMES);
+    }
+
+    _display_send_dirty_region(p, pa, clear_dirty);
+
+    atomic_set(&pa->dirty_region.dirty_flag, pa->dirty_region.count != 0);
+
+    if (!pa->dirty_region.count && atomic_read(&pa->unsync_flag) != 1) {
+        // everything taken is on its way, the frame is done once the tickets have all come back
+        rpusbdisp_usb_flush(pa->binded_usbdev);
+        atomic_set(&pa->sent_seq, seq);
+        smp_mb();
+        if (rpusbdisp_usb_is_idle(pa->binded_usbdev)) _display_frame_done(pa);
     }
 final:
+    if (usbdev) rpusbdisp_usb_autopm_put(usbdev);
     mutex_unlock(&pa->operation_lock);
 }
 
+// record an operation for the update worker, the caller holds pending_lock
+static void _display_record(struct rpusbdisp_fb_private * pa, const struct display_op * op)
+{
+    struct display_pending * pending = &pa->pending;
+    struct display_op * last = pending->count ? &pending->ops[pending->count - 1] : NULL;
+    struct dirty_rect merged;
+
+    ++pa->record_seq;
+
+    if (pending->overflow.count || pending->count == RPUSBDISP_MAX_PENDING_OPS) {
+        // too many operations, the rest is sent as images after them
+        _dirty_region_add(&pending->overflow, op->rect.left, op->rect.top, op->rect.right, op->rect.bottom);
+        return;
+    }
+
+    // mono images side by side in the same colors, the plane has their bits so only the exact union is taken
+    if (last && last->hint == DISPLAY_UPDATE_HINT_MONO && op->hint == DISPLAY_UPDATE_HINT_MONO &&
+        last->color == op->color && last->bg_color == op->bg_color)
+    {
+        merged = last->rect;
+        _dirty_rect_union(&merged, &op->rect);
+
+        if (_dirty_rect_area(&merged) == _dirty_rect_area(&last->rect) + _dirty_rect_area(&op->rect)) {
+            last->rect = merged;
+            return;
+        }
+    }
+
+    // coalesce the damage drawn one after another, e.g. the glyphs of a line of text
+    if (last && last->hint == op->hint && op->hint != DISPLAY_UPDATE_HINT_FILLRECT && op->hint != DISPLAY_UPDATE_HINT_COPYAREA &&
+        op->hint != DISPLAY_UPDATE_HINT_MONO) {
+        merged = last->rect;
+        _dirty_rect_union(&merged, &op->rect);
+
+        if (_dirty_rect_area(&merged) <= _dirty_rect_area(&last->rect) + _dirty_rect_area(&op->rect) + RPUSBDISP_DIRTY_RECT_MERGE_COST) {
+            last->rect = merged;
+            return;
+        }
+    }
+
+    pending->ops[pending->count++] = *op;
+}
+
+static void _display_record_damage(struct rpusbdisp_fb_private * pa, int hint, int x, int y, int width, int height)
+{
+    struct display_op op = { .hint = hint, .rect = { x, y, x + width - 1, y + height - 1 } };
+
+    if (width <= 0 || height <= 0) return;
+    _display_record(pa, &op);
+}
+
+static inline void _display_kick(struct rpusbdisp_fb_private * pa)
+{
+    queue_work(pa->update_wq, &pa->update_work);
+}
+
+static inline int _display_pending_full(struct rpusbdisp_fb_private * pa)
+{
+    return pa->pending.overflow.count || pa->pending.count == RPUSBDISP_MAX_PENDING_OPS;
+}
+
+// wait for the worker to take the pending operations, the caller holds pending_lock
+static void _display_wait_pending_room(struct rpusbdisp_fb_private * pa)
+{
+    if (!_display_pending_full(pa) || !pa->binded_usbdev) return;
+
+    mutex_unlock(&pa->pending_lock);
+    _display_kick(pa);
+    wait_event_timeout(pa->pending_wait, !_display_pending_full(pa) || !pa->binded_usbdev,
+        msecs_to_jiffies(RPUSBDISP_PENDING_WAIT_TIMEOUT_MS));
+    mutex_lock(&pa->pending_lock);
+}
+
 static  void _display_fillrect( struct fb_info * p, const  struct fb_fillrect * rect)
 {
+    struct rpusbdisp_fb_private * pa = _get_fb_private(p);
+    struct display_op op = {
+        .hint = DISPLAY_UPDATE_HINT_FILLRECT,
+        .rect = { rect->dx, rect->dy, rect->dx + rect->width - 1, rect->dy + rect->height - 1 },
+        .color = _palette_color(p, rect->color),
+        .rop = rect->rop,
+    };
+
+    if (!rect->width || !rect->height) return;
+
+    mutex_lock(&pa->pending_lock);
     sys_fillrect (p, rect);
-    _display_update(p, rect->dx, rect->dy, rect->width, rect->height, DISPLAY_UPDATE_HINT_FILLRECT, rect);
+    _display_record(pa, &op);
+    mutex_unlock(&pa->pending_lock);
+
+    _display_kick(pa);
+}
+
+// record a 1bpp image with its bits, the caller holds pending_lock
+static void _display_record_mono(struct fb_info * p, struct rpusbdisp_fb_private * pa, const struct fb_image * image)
+{
+    struct display_pending * pending = &pa->pending;
+    const int src_line_length = (image->width + 7) / 8;
+    struct display_op op = {
+        .hint = DISPLAY_UPDATE_HINT_MONO,
+        .rect = { image->dx, image->dy, image->dx + image->width - 1, image->dy + image->height - 1 },
+        .color = _palette_color(p, image->fg_color),
+        .bg_color = _palette_color(p, image->bg_color),
+    };
+    int x, y, pos;
+
+    // the plane keeps only the last bits drawn at each pixel, the pending mono images below this one are sent from the framebuffer
+    for (pos = 0; pos < pending->count; ++pos) {
+        if (pending->ops[pos].hint == DISPLAY_UPDATE_HINT_MONO && _dirty_rect_intersects(&pending->ops[pos].rect, &op.rect)) {
+            pending->ops[pos].hint = DISPLAY_UPDATE_HINT_BITBLT;
+        }
+    }
+
+    for (y = 0; y < image->height; ++y) {
+        const _u8 * src = (const _u8 *)image->data + y * src_line_length;
+        _u8 * dest = pending->mono + (image->dy + y) * pa->mono_line_length;
+
+        for (x = 0; x < image->width; ++x) {
+            const int dx = image->dx + x;
+            const _u8 mask = 0x80 >> (dx & 7);
+
+            if (rpusbdisp_mono_bit(src, x)) {
+                dest[dx >> 3] |= mask;
+            } else {
+                dest[dx >> 3] &= ~mask;
+            }
+        }
+    }
+
+    _display_record(pa, &op);
 }
 
 static  void _display_imageblit( struct fb_info * p, const  struct fb_image * image)
 {
+    struct rpusbdisp_fb_private * pa = _get_fb_private(p);
 
+    mutex_lock(&pa->pending_lock);
     sys_imageblit (p, image);
-    _display_update(p, image->dx, image->dy, image->width, image->height, DISPLAY_UPDATE_HINT_BITBLT, image);
+
+    if (image->depth == 1 && pa->pending.mono && image->width && image->height &&
+        image->dx + image->width <= p->var.xres && image->dy + image->height <= p->var.yres) {
+        // console text, sent as runs of the two colors built from the bitmap
+        _display_record_mono(p, pa, image);
+    } else {
+        _display_record_damage(pa, DISPLAY_UPDATE_HINT_BITBLT, image->dx, image->dy, image->width, image->height);
+    }
+    mutex_unlock(&pa->pending_lock);
+
+    _display_kick(pa);
 }
 
 // Copy a rectangular area within the framebuffer
 static void _display_copyarea(struct fb_info *p, const struct fb_copyarea *area)
 {
+    struct rpusbdisp_fb_private * pa = _get_fb_private(p);
+    struct display_op op = {
+        .hint = DISPLAY_UPDATE_HINT_COPYAREA,
+        .rect = { area->dx, area->dy, area->dx + area->width - 1, area->dy + area->height - 1 },
+        .sx = area->sx,
+        .sy = area->sy,
+    };
+
+    if (!area->width || !area->height) return;
+
+    mutex_lock(&pa->pending_lock);
+    // a copy recorded as damage would send the whole destination as pixels, wait for room instead
+    _display_wait_pending_room(pa);
+
     // Perform the copy operation
     sys_copyarea(p, area);
+    _display_record(pa, &op);
+    mutex_unlock(&pa->pending_lock);
 
-    // Update the display with the copied area
-    _display_update(p, area->dx, area->dy, area->width, area->height, DISPLAY_UPDATE_HINT_COPYAREA, area);
+    // Let the worker update the display with the copied area
+    _display_kick(pa);
 }
 
 // Write data to the framebuffer
 static ssize_t _display_write(struct fb_info *p, const char *buf __user, size_t count, loff_t *ppos)
 {       
+    struct rpusbdisp_fb_private * pa = _get_fb_private(p);
     int retval;
 
+    mutex_lock(&pa->pending_lock);
     // Write to the framebuffer using the system's framebuffer write function
     retval = fb_sys_write(p, buf, count, ppos);
 
     // Update the entire display after writing
-    _display_update(p, 0, 0, p->var.width, p->var.height, DISPLAY_UPDATE_HINT_NONE, NULL);
+    _display_record_damage(pa, DISPLAY_UPDATE_HINT_NONE, 0, 0, p->var.width, p->var.height);
+    mutex_unlock(&pa->pending_lock);
+
+    _display_kick(pa);
     return retval;
 }
 
@@ -255,50 +1015,67 @@ static int _display_setcolreg(u_int regno, u_int red, u_int green, u_int blue, u
     return ret;
 }
 
+// add the rows touched by the page at offset in the framebuffer
+static void _defio_page_damage(struct fb_info *info, struct dirty_region *damage, unsigned long offset)
+{
+    int top, bottom;
+
+    if (offset >= info->fix.smem_len) return;
+
+    // The rows touched by the page
+    top = offset / info->fix.line_length;
+    bottom = (offset + PAGE_SIZE - 1) / info->fix.line_length;
+
+    if (top >= info->var.height)
+        return;
+
+    // Prevent overflow on the last page
+    if (bottom >= info->var.height) 
+        bottom = info->var.height - 1;
+
+    // The spans of neighbouring pages overlap and are joined, the spans far apart stay separated
+    _dirty_region_add(damage, 0, top, info->var.width - 1, bottom);
+}
+
 // Deferred I/O handler to update the framebuffer
 static void _display_defio_handler(struct fb_info *info, struct list_head *FB_DEFIO_LIST) 
 {
+#ifdef RPUSBDISP_DEFIO_PAGEREF
+    struct fb_deferred_io_pageref *pageref;
+#else
     struct page *cur;
+#endif
     struct fb_deferred_io *fbdefio __maybe_unused = info->fbdefio;
-    int top = RP_DISP_DEFAULT_HEIGHT, bottom = 0;
-    int current_val;
-    unsigned long offset;
-    unsigned long page_start;
+    struct dirty_region damage;
+    int pos;
 
     struct rpusbdisp_fb_private *pa = _get_fb_private(info);
     if (!pa->binded_usbdev) return;  // No device bound, ignore
 
-    // Iterate through the deferred I/O page list
-    list_for_each_entry(cur, FB_DEFIO_LIST, lru) {
-        // Get the physical address of the page
-        page_start = page_to_pfn(cur) << PAGE_SHIFT;
+    atomic_inc(&pa->defio_calls);
 
-        // Check if the page address is within the valid range
-        if (page_start < info->fix.mmio_start || 
-            page_start >= info->fix.mmio_start + info->fix.smem_len) {
-            continue;
-        }
+    _clear_dirty_region(&damage);
 
-        // Calculate the offset within the framebuffer
-        offset = (unsigned long)(page_start - info->fix.mmio_start);
-        current_val = offset / info->fix.line_length;
-        
-        // Update the top boundary of the dirty region
-        if (top > current_val) 
-            top = current_val;
-        
-        // Calculate the bottom boundary of the dirty region
-        current_val = (offset + PAGE_SIZE + info->fix.line_length - 1) / info->fix.line_length;
-        if (bottom < current_val) 
-            bottom = current_val;
+    // Iterate through the deferred I/O page list, the offsets are the ones within the framebuffer
+#ifdef RPUSBDISP_DEFIO_PAGEREF
+    list_for_each_entry(pageref, FB_DEFIO_LIST, list) {
+        _defio_page_damage(info, &damage, pageref->offset);
+    }
+#else
+    list_for_each_entry(cur, FB_DEFIO_LIST, lru) {
+        _defio_page_damage(info, &damage, cur->index << PAGE_SHIFT);
     }
+#endif
 
-    // Adjust the bottom limit to prevent overflow
-    if (bottom >= RP_DISP_DEFAULT_HEIGHT) 
-        bottom = RP_DISP_DEFAULT_HEIGHT - 1;
+    // Each row span is trimmed and sent as its own bitblt by the worker
+    mutex_lock(&pa->pending_lock);
+    for (pos = 0; pos < damage.count; ++pos) {
+        struct display_op op = { .hint = DISPLAY_UPDATE_HINT_REGION, .rect = damage.rects[pos] };
+        _display_record(pa, &op);
+    }
+    mutex_unlock(&pa->pending_lock);
 
-    // Update the display with the calculated dirty region
-    _display_update(info, 0, top, info->var.width, bottom - top + 1, DISPLAY_UPDATE_HINT_NONE, NULL);
+    _display_kick(pa);
 }
 
 static int rpusbdisp_fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
@@ -331,17 +1108,6 @@ static int rpusbdisp_fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
     return 0;
 }
 
-static struct fb_ops _display_fbops = {
-    .owner = THIS_MODULE,
-    .fb_read = fb_sys_read,
-    .fb_write = _display_write,
-    .fb_fillrect = _display_fillrect,
-    .fb_copyarea = _display_copyarea,
-    .fb_imageblit = _display_imageblit,
-    .fb_setcolreg = _display_setcolreg,
-    .fb_mmap = rpusbdisp_fb_mmap,
-};
-
 static void *rvmalloc(unsigned long size)
 {
     void *mem;
@@ -379,6 +1145,33 @@ static void rvfree(void *mem, unsigned long size)
 	vfree(mem);
 }
 
+// called once the framebuffer is unregistered and the last user has closed it
+static void _display_destroy(struct fb_info *p)
+{
+    fb_deferred_io_cleanup(p);
+    destroy_workqueue(_get_fb_private(p)->update_wq);
+    kfree(p->fbdefio);
+    vfree(_get_fb_private(p)->shadow);
+    vfree(_get_fb_private(p)->pending.mono);
+    vfree(_get_fb_private(p)->running.mono);
+    fb_dealloc_cmap(&p->cmap);
+    rvfree(p->screen_base, p->fix.smem_len);
+    framebuffer_release(p);
+}
+
+static struct fb_ops _display_fbops = {
+    .owner = THIS_MODULE,
+    .fb_read = fb_sys_read,
+    .fb_write = _display_write,
+    .fb_fillrect = _display_fillrect,
+    .fb_copyarea = _display_copyarea,
+    .fb_imageblit = _display_imageblit,
+    .fb_setcolreg = _display_setcolreg,
+    .fb_mmap = rpusbdisp_fb_mmap,
+    .fb_ioctl = _display_ioctl,
+    .fb_destroy = _display_destroy,
+};
+
 #if 0
 static struct platform_driver rpusbdisp_fb_driver = {
 	.probe = _rpusbdisp_initial_probe,
@@ -390,6 +1183,21 @@ static struct platform_driver rpusbdisp_fb_driver = {
 };
 #endif
 
+// take the resolution and the pixel format from the module parameters
+static void _setup_fb_format(struct fb_info * fb)
+{
+    const struct fb_bitfield * bitfields = (disp_bpp == RP_DISP_PIXEL_BITS_XRGB8888) ? _xrgb8888_bitfields : _rgb565_bitfields;
+
+    fb->var.xres = fb->var.xres_virtual = fb->var.width = disp_width;
+    fb->var.yres = fb->var.yres_virtual = fb->var.height = disp_height;
+    fb->var.bits_per_pixel = disp_bpp;
+    fb->var.red = bitfields[0];
+    fb->var.green = bitfields[1];
+    fb->var.blue = bitfields[2];
+
+    fb->fix.line_length = disp_width * disp_bpp / 8;
+}
+
 static int _on_create_new_fb(struct fb_info ** out_fb, struct rpusbdisp_dev *dev)
 {
     int ret = -ENOMEM;
@@ -410,12 +1218,14 @@ static int _on_create_new_fb(struct fb_info ** out_fb, struct rpusbdisp_dev *dev
 
     fb->fix = _vfb_fix;
     fb->var = _var_info;
+    _setup_fb_format(fb);
 
 
     fb->fbops       = &_display_fbops;
-    fb->flags       = FBINFO_DEFAULT | FBINFO_VIRTFB;
+    // the display fills and copies by itself, so fbcon scrolls with copyarea instead of redrawing the text
+    fb->flags       = FBINFO_DEFAULT | FBINFO_VIRTFB | FBINFO_HWACCEL_COPYAREA | FBINFO_HWACCEL_FILLRECT;
     
-    fbmem_size = _var_info.yres * _vfb_fix.line_length; // Correct issue with size allocation (too big)
+    fbmem_size = fb->var.yres * fb->fix.line_length; // Correct issue with size allocation (too big)
     fbmem =  rvmalloc(fbmem_size);
     if (!fbmem) {
 
@@ -447,6 +1257,7 @@ static int _on_create_new_fb(struct fb_info ** out_fb, struct rpusbdisp_dev *dev
 
 	if (fbdefio) {
                 // frame rate is configurable through the fps option during the load operation
+		// or by the measured throughput with adaptive_fps, starting at the fixed rate
 		fbdefio->delay = HZ/fps;
 		fbdefio->deferred_io = _display_defio_handler;
 	} else {
@@ -461,6 +1272,34 @@ static int _on_create_new_fb(struct fb_info ** out_fb, struct rpusbdisp_dev *dev
 
 
     _reset_fb_private(_get_fb_private(fb));
+    _get_fb_private(fb)->info = fb;
+    _get_fb_private(fb)->binded_usbdev = dev;
+
+    // the encoding and the transfers are done by a worker of each display, the fb operations only record what they draw
+    INIT_WORK(&_get_fb_private(fb)->update_work, _display_update_work);
+    _get_fb_private(fb)->update_wq = alloc_ordered_workqueue("rpusbdisp_update", WQ_HIGHPRI);
+    if (!_get_fb_private(fb)->update_wq) {
+        err("Cannot create the update worker.\n");
+        ret = -ENOMEM;
+        goto failed_nowq;
+    }
+
+    // the column diff of the deferred io is disabled without the shadow
+    _get_fb_private(fb)->shadow = vzalloc(fbmem_size);
+    if (!_get_fb_private(fb)->shadow) {
+        err("Cannot allocate the shadow fb memory.\n");
+    }
+
+    // mono images are sent as bitblts of the framebuffer without the planes
+    _get_fb_private(fb)->mono_line_length = (fb->var.xres + 7) / 8;
+    _get_fb_private(fb)->pending.mono = vzalloc(_get_fb_private(fb)->mono_line_length * fb->var.yres);
+    _get_fb_private(fb)->running.mono = vzalloc(_get_fb_private(fb)->mono_line_length * fb->var.yres);
+    if (!_get_fb_private(fb)->pending.mono || !_get_fb_private(fb)->running.mono) {
+        vfree(_get_fb_private(fb)->pending.mono);
+        vfree(_get_fb_private(fb)->running.mono);
+        _get_fb_private(fb)->pending.mono = NULL;
+        _get_fb_private(fb)->running.mono = NULL;
+    }
 
     // register the framebuffer device
     ret = register_framebuffer(fb);
@@ -473,6 +1312,12 @@ static int _on_create_new_fb(struct fb_info ** out_fb, struct rpusbdisp_dev *dev
     return ret;
 
 failed_on_reg:
+    destroy_workqueue(_get_fb_private(fb)->update_wq);
+failed_nowq:
+    vfree(_get_fb_private(fb)->shadow);
+    vfree(_get_fb_private(fb)->pending.mono);
+    vfree(_get_fb_private(fb)->running.mono);
+    fb_deferred_io_cleanup(fb);
     kfree(fbdefio);
 failed_nodefio:
     fb_dealloc_cmap(&fb->cmap);
@@ -488,24 +1333,18 @@ static void _on_release_fb(struct fb_info * fb)
 {
     if (!fb) return;
 
-    // del the defio
-    fb_deferred_io_cleanup(fb);
-    
+    // the memory is released by _display_destroy when the framebuffer is not used anymore
     unregister_framebuffer(fb);
-    kfree(fb->fbdefio);
-    fb_dealloc_cmap(&fb->cmap);
-    rvfree(fb->screen_base, fb->fix.smem_len);
-    framebuffer_release(fb);
 }
 
+// framebuffers are created for each device when it is connected
 int __init_or_module register_fb_handlers(void)
 {
-    return _on_create_new_fb(&_default_fb, NULL);
+    return 0;
 }
 
 void unregister_fb_handlers(void)
 {
-    _on_release_fb(_default_fb);
 }
 
 void fbhandler_on_all_transfer_done(struct rpusbdisp_dev * dev)
@@ -517,34 +1356,30 @@ void fbhandler_on_all_transfer_done(struct rpusbdisp_dev * dev)
     if (!fb) return;
 
     fb_pri = _get_fb_private(fb);
+
+    _display_pacing_update(fb, fb_pri);
+
+    // a frame failed to be sent is done only when the worker has sent it again
+    if (atomic_read(&fb_pri->unsync_flag) != 1) {
+        _display_frame_done(fb_pri);
+    }
     
-    if (atomic_read(&fb_pri->dirty_rect.dirty_flag) || atomic_read(&fb_pri->unsync_flag)==1) {
-        _display_update(fb, 0, 0, RP_DISP_DEFAULT_WIDTH, RP_DISP_DEFAULT_HEIGHT, DISPLAY_UPDATE_HINT_NONE, NULL);
+    if (atomic_read(&fb_pri->dirty_region.dirty_flag) || atomic_read(&fb_pri->unsync_flag)==1) {
+        queue_work(fb_pri->update_wq, &fb_pri->update_work);
     }
 }
 
 int fbhandler_on_new_device(struct rpusbdisp_dev *dev)
 {
-    int ans = -1;
-    struct rpusbdisp_fb_private *fb_pri;
-    
-    mutex_lock(&_mutex_devreg);
-
-    // check whether the default fb has been binded
-    fb_pri = _get_fb_private(_default_fb);
-    if (!fb_pri->binded_usbdev) {
-        mutex_lock(&fb_pri->operation_lock);
-
-        // bind to the default framebuffer ( the only one)
-        fb_pri->binded_usbdev = dev;
-        rpusbdisp_usb_set_fbhandle(dev, _default_fb);
+    struct fb_info * fb;
+    int ret;
 
-        ans = 0; 
-        mutex_unlock(&fb_pri->operation_lock);
-    }
+    // each device has its own framebuffer, deferred io and locks, so the devices are updated independently
+    ret = _on_create_new_fb(&fb, dev);
+    if (ret < 0) return ret;
 
-    mutex_unlock(&_mutex_devreg);
-    return ans;
+    rpusbdisp_usb_set_fbhandle(dev, fb);
+    return 0;
 }
 
 // Remove the device from the framebuffer
@@ -552,28 +1387,24 @@ void fbhandler_on_remove_device(struct rpusbdisp_dev *dev)
 {
     struct fb_info *fb = (struct fb_info *)rpusbdisp_usb_get_fbhandle(dev);
 
-    // Acquire the mutex for safe device removal
-    mutex_lock(&_mutex_devreg);
-
     if (fb) {
-        struct rpusbdisp_fb_private *fb_pri = _get_fb_private(_default_fb);
+        struct rpusbdisp_fb_private *fb_pri = _get_fb_private(fb);
 
         // Acquire the operation lock
         mutex_lock(&fb_pri->operation_lock);
 
-        // Unbind the device
+        // Unbind the device, the framebuffer may still be used by the applications until they close it
         fb_pri->binded_usbdev = NULL;
         rpusbdisp_usb_set_fbhandle(dev, NULL);
 
         mutex_unlock(&fb_pri->operation_lock);
 
-        // Unregister the framebuffer if it is not the default one
-        if (fb != _default_fb) {
-            _on_release_fb(fb);
-        }
-    }
+        // nothing more is going to be transferred
+        wake_up_all(&fb_pri->frame_wait);
+        wake_up_all(&fb_pri->pending_wait);
 
-    mutex_unlock(&_mutex_devreg);
+        _on_release_fb(fb);
+    }
 }
 
 // Set the unsynchronized flag for the device
@@ -582,7 +1413,7 @@ void fbhandler_set_unsync_flag(struct rpusbdisp_dev *dev)
     struct fb_info *fb = (struct fb_info *)rpusbdisp_usb_get_fbhandle(dev);
 
     if (fb) {
-        struct rpusbdisp_fb_private *fb_pri = _get_fb_private(_default_fb);
+        struct rpusbdisp_fb_private *fb_pri = _get_fb_private(fb);
         atomic_set(&fb_pri->unsync_flag, 1);
     }
 }
@@ -34,6 +34,7 @@
 #include <linux/vmalloc.h>
 #include <linux/input.h>
 #include <linux/wait.h>
+#include <asm/unaligned.h>
 
 #include "inc/types.h"
 #include "inc/drvconf.h"
@@ -43,6 +44,13 @@
 #include "inc/protocol.h"
 
 extern int fps;
+extern int rle_optimal;
+extern int adaptive_fps;
+extern int zero_copy;
+extern int autosuspend;
+extern int disp_width;
+extern int disp_height;
+extern int disp_bpp;
 
 // object predefine
 
@@ -25,6 +25,20 @@
 #define RP_DISP_DEFAULT_PIXEL_BITS  16
 typedef _u16  pixel_type_t; 
 
+// limits of the resolution set through the module parameters
+#define RP_DISP_MAX_WIDTH           800
+#define RP_DISP_MAX_HEIGHT          480
+
+// framebuffer formats, the display always takes RGB565 and XRGB8888 is converted by the driver
+#define RP_DISP_PIXEL_BITS_RGB565   16
+#define RP_DISP_PIXEL_BITS_XRGB8888 32
+
+// XRGB8888 to the RGB565 layout of the display (red in the low bits)
+static inline pixel_type_t rp_disp_xrgb8888_to_pixel(_u32 color)
+{
+    return (pixel_type_t)(((color >> 19) & 0x1f) | (((color >> 10) & 0x3f) << 5) | (((color >> 3) & 0x1f) << 11));
+}
+
 
 #define RP_DISP_FEATURE_RLE_FWVERSION 0x0104
 
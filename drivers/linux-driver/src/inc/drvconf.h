@@ -21,10 +21,38 @@
 
 #define RPUSBDISP_MINOR		   300
 
+// consecutive transient errors of the status endpoint retried right away
 #define RPUSBDISP_STATUS_QUERY_RETRY_COUNT  4
 
+// interrupt urbs queued on the status endpoint
+#define RPUSBDISP_STATUS_URB_COUNT          3
+
+// the polling is restarted after RPUSBDISP_STATUS_RECOVERY_MIN_MS, doubled at each attempt up to RPUSBDISP_STATUS_RECOVERY_MAX_MS
+#define RPUSBDISP_STATUS_RECOVERY_MIN_MS    50
+#define RPUSBDISP_STATUS_RECOVERY_MAX_MS    5000
+#define RPUSBDISP_STATUS_RECOVERY_MAX_SHIFT 7
+
+// time given to the transfers in flight to complete before a suspend
+#define RPUSBDISP_SUSPEND_DRAIN_TIMEOUT_MS  500
+
 
 #define RPUSBDISP_MAX_TRANSFER_SIZE          (PAGE_SIZE*16 - 512)
 #define RPUSBDISP_MAX_TRANSFER_TICKETS_COUNT 10
 
+// max time a small command waits in the batch ticket before it is sent
+#define RPUSBDISP_BATCH_FLUSH_DELAY_MS       5
+
+// max time the bitblt encoder waits for a ticket in the middle of an image
+#define RPUSBDISP_TICKET_WAIT_TIMEOUT_MS     1000
+
+// max time a copyarea waits for the update worker when too many operations are pending
+#define RPUSBDISP_PENDING_WAIT_TIMEOUT_MS    200
+
+// max time FBIO_WAITFORVSYNC waits for the frame to be transferred
+#define RPUSBDISP_FRAME_WAIT_TIMEOUT_MS      1000
+
+// the range of the refresh rate chosen by adaptive_fps
+#define RPUSBDISP_ADAPTIVE_MIN_FPS           4
+#define RPUSBDISP_ADAPTIVE_MAX_FPS           60
+
 #endif
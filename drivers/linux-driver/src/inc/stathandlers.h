@@ -0,0 +1,87 @@
+/*
+ *    RoboPeak USB LCD Display Linux Driver
+ *    
+ *    Copyright (C) 2009 - 2013 RoboPeak Team
+ *    This file is licensed under the GPL. See LICENSE in the package.
+ *
+ *    http://www.robopeak.net
+ *
+ *    Author Shikai Chen
+ *
+ *   ---------------------------------------------------
+ *    Definition of Performance Counters
+ */
+
+#ifndef _RPUSBDISP_STAT_HANDLERS_H
+#define _RPUSBDISP_STAT_HANDLERS_H
+
+#include <linux/percpu.h>
+
+enum {
+    RPUSBDISP_STAT_FRAMES = 0,          // rounds of the update worker sending something
+    RPUSBDISP_STAT_DEFIO_CALLBACKS,     // pages written through mmap reported by the deferred io
+    RPUSBDISP_STAT_BITBLT_RLE,
+    RPUSBDISP_STAT_BITBLT_RAW,
+    RPUSBDISP_STAT_BITBLT_ZERO_COPY,
+    RPUSBDISP_STAT_BITBLT_BYTES_IN,     // image bytes before the RLE
+    RPUSBDISP_STAT_BITBLT_BYTES_OUT,    // image bytes after the RLE
+    RPUSBDISP_STAT_TICKET_STARVED,      // ticket acquisitions whose first try found too few tickets
+    RPUSBDISP_STAT_DISP_URB_ERRORS,
+    RPUSBDISP_STAT_STATUS_URB_ERRORS,
+
+    RPUSBDISP_STAT_COUNT,
+};
+
+enum {
+    RPUSBDISP_HIST_ENCODE_NS = 0,       // encoding and queuing an image, including the waits for tickets
+    RPUSBDISP_HIST_TRANSFER_US,         // from the submission of a ticket to its completion
+
+    RPUSBDISP_HIST_COUNT,
+};
+
+// bucket 0 counts the zero values, bucket n the values in [2^(n-1), 2^n), the last one everything above
+#define RPUSBDISP_HIST_BUCKETS  32
+
+struct rpusbdisp_stats_cpu {
+    u64   counters[RPUSBDISP_STAT_COUNT];
+    u64   buckets[RPUSBDISP_HIST_COUNT][RPUSBDISP_HIST_BUCKETS];
+    u64   sums[RPUSBDISP_HIST_COUNT];
+};
+
+// the hot paths only touch the counters of their own cpu, the readers sum them up
+struct rpusbdisp_stats {
+    struct rpusbdisp_stats_cpu __percpu * percpu;
+    struct dentry                       * debugfs_dir;
+};
+
+
+int register_stat_handlers(void);
+void unregister_stat_handlers(void);
+
+// name is the name of the debugfs directory of the device
+int stathandler_on_new_device(struct rpusbdisp_stats * stats, const char * name);
+void stathandler_on_remove_device(struct rpusbdisp_stats * stats);
+
+u64 stathandler_read(struct rpusbdisp_stats * stats, int counter);
+ssize_t stathandler_show_summary(struct rpusbdisp_stats * stats, char * buf);
+
+
+static inline void rpusbdisp_stat_add(struct rpusbdisp_stats * stats, int counter, u64 value)
+{
+    this_cpu_add(stats->percpu->counters[counter], value);
+}
+
+static inline void rpusbdisp_stat_inc(struct rpusbdisp_stats * stats, int counter)
+{
+    this_cpu_inc(stats->percpu->counters[counter]);
+}
+
+static inline void rpusbdisp_stat_record(struct rpusbdisp_stats * stats, int histogram, u64 value)
+{
+    int bucket = min(fls64(value), RPUSBDISP_HIST_BUCKETS - 1);
+
+    this_cpu_inc(stats->percpu->buckets[histogram][bucket]);
+    this_cpu_add(stats->percpu->sums[histogram], value);
+}
+
+#endif
@@ -15,6 +15,8 @@
 #ifndef _DRIVER_HANDLER_H
 #define _DRIVER_HANDLER_H
 
+struct rpusbdisp_stats;
+
 int register_usb_handlers(void);
 void unregister_usb_handlers(void);
 
@@ -27,8 +29,24 @@ void * rpusbdisp_usb_get_fbhandle(struct rpusbdisp_dev * dev);
 void   rpusbdisp_usb_set_touchhandle(struct rpusbdisp_dev * dev, void *);
 void * rpusbdisp_usb_get_touchhandle(struct rpusbdisp_dev * dev);
 
-int rpusbdisp_usb_try_send_image(struct rpusbdisp_dev * dev, const pixel_type_t * framebuffer, int x, int y, int right, int bottom, int line_width, int clear_dirty);
+struct rpusbdisp_stats * rpusbdisp_usb_get_stats(struct rpusbdisp_dev * dev);
+
+// line_length is in bytes, bpp is RP_DISP_PIXEL_BITS_RGB565 or RP_DISP_PIXEL_BITS_XRGB8888
+int rpusbdisp_usb_try_send_image(struct rpusbdisp_dev * dev, const void * framebuffer, int x, int y, int right, int bottom, int line_length, int bpp, int clear_dirty);
+// bitmap is 1bpp with the leftmost pixel in the most significant bit, line_length is in bytes
+int rpusbdisp_usb_try_send_mono(struct rpusbdisp_dev * dev, const void * bitmap, int x, int y, int right, int bottom, int line_length, pixel_type_t fg, pixel_type_t bg);
+
+// the pixel x of a row of such a bitmap
+static inline int rpusbdisp_mono_bit(const _u8 * row, int x)
+{
+    return (row[x >> 3] >> (7 - (x & 7))) & 1;
+}
 int rpusbdisp_usb_try_draw_rect(struct rpusbdisp_dev * dev, int x, int y, int right, int bottom,  pixel_type_t color, int operation);
 int rpusbdisp_usb_try_copy_area(struct rpusbdisp_dev * dev, int sx, int sy, int dx, int dy, int width, int height);
+void rpusbdisp_usb_flush(struct rpusbdisp_dev * dev);
+int rpusbdisp_usb_is_idle(struct rpusbdisp_dev * dev);
+// the update worker holds the display awake while it sends, get returns non-zero if nothing can be sent now
+int rpusbdisp_usb_autopm_get(struct rpusbdisp_dev * dev);
+void rpusbdisp_usb_autopm_put(struct rpusbdisp_dev * dev);
 
 #endif
\ No newline at end of file
@@ -13,6 +13,7 @@
 #include "inc/usbhandlers.h"
 #include "inc/fbhandlers.h"
 #include "inc/touchhandlers.h"
+#include "inc/stathandlers.h"
 
 #if 0
 // File operations for the USB LCD device
@@ -39,6 +40,39 @@ int fps = 0;
 module_param(fps, int, 0);
 MODULE_PARM_DESC(fps, "Specify the frame rate used to refresh the display (override kernel config)");
 
+// Adaptive pacing, can be changed at runtime through sysfs
+int adaptive_fps = 0;
+module_param(adaptive_fps, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adaptive_fps, "Refresh the display as fast as the measured USB throughput allows instead of at the fixed frame rate (0: fixed, 1: adaptive)");
+
+// RLE encoding mode, can be changed at runtime through sysfs
+int rle_optimal = 0;
+module_param(rle_optimal, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rle_optimal, "Plan the RLE sections for the smallest transfer instead of the faster greedy encoding (0: greedy, 1: optimal)");
+
+// Zero copy transfers, can be changed at runtime through sysfs
+int zero_copy = 0;
+module_param(zero_copy, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(zero_copy, "Send the uncompressed 16bpp images straight from the framebuffer pages with scatter-gather transfers when the USB host controller supports them (0: off, 1: on)");
+
+// Runtime power management, read when a display is plugged in
+int autosuspend = 0;
+module_param(autosuspend, int, S_IRUGO);
+MODULE_PARM_DESC(autosuspend, "Suspend the display after this many seconds without anything drawn (0: never)");
+
+// Resolution and format of the framebuffer, the defaults match the panel of the RoboPeak display
+int disp_width = RP_DISP_DEFAULT_WIDTH;
+module_param_named(width, disp_width, int, 0);
+MODULE_PARM_DESC(width, "Horizontal resolution of the framebuffer (default 320)");
+
+int disp_height = RP_DISP_DEFAULT_HEIGHT;
+module_param_named(height, disp_height, int, 0);
+MODULE_PARM_DESC(height, "Vertical resolution of the framebuffer (default 240)");
+
+int disp_bpp = RP_DISP_DEFAULT_PIXEL_BITS;
+module_param_named(bpp, disp_bpp, int, 0);
+MODULE_PARM_DESC(bpp, "Bits per pixel of the framebuffer (16: RGB565, 32: XRGB8888 converted to RGB565 by the driver)");
+
 
 // Module initialization function
 static int __init usb_disp_init(void)
@@ -56,8 +90,27 @@ static int __init usb_disp_init(void)
 #endif
     }
 
-    // Register the touch, framebuffer, and USB handlers
+    // Fall back to the defaults on an unsupported framebuffer configuration
+    if (disp_width <= 0 || disp_width > RP_DISP_MAX_WIDTH || disp_height <= 0 || disp_height > RP_DISP_MAX_HEIGHT) {
+        err("Unsupported resolution %dx%d, using %dx%d", disp_width, disp_height, RP_DISP_DEFAULT_WIDTH, RP_DISP_DEFAULT_HEIGHT);
+        disp_width = RP_DISP_DEFAULT_WIDTH;
+        disp_height = RP_DISP_DEFAULT_HEIGHT;
+    }
+
+    if (disp_bpp != RP_DISP_PIXEL_BITS_RGB565 && disp_bpp != RP_DISP_PIXEL_BITS_XRGB8888) {
+        err("Unsupported bpp %d, using %d", disp_bpp, RP_DISP_DEFAULT_PIXEL_BITS);
+        disp_bpp = RP_DISP_DEFAULT_PIXEL_BITS;
+    }
+
+    // Register the counters, touch, framebuffer, and USB handlers
     do {
+        // Register the debugfs directory of the counters
+        result = register_stat_handlers();
+        if (result) {
+            err("Counters registration failed. Error number %d", result);
+            break;
+        }
+
         // Register touch handler
         result = register_touch_handler();
         if (result) {
@@ -88,10 +141,11 @@ static int __init usb_disp_init(void)
 // Module cleanup function
 static void __exit usb_disp_exit(void)
 {
-    // Unregister USB, framebuffer, and touch handlers
+    // Unregister USB, framebuffer, touch, and counter handlers
     unregister_usb_handlers();
     unregister_fb_handlers();
     unregister_touch_handler();
+    unregister_stat_handlers();
 }
 
 
@@ -0,0 +1,255 @@
+/*
+ *    RoboPeak USB LCD Display Linux Driver
+ *    
+ *    Copyright (C) 2009 - 2013 RoboPeak Team
+ *    This file is licensed under the GPL. See LICENSE in the package.
+ *
+ *    http://www.robopeak.net
+ *
+ *    Author Shikai Chen
+ *
+ *   ---------------------------------------------------
+ *   Performance Counters
+ *
+ *   Each device gets a directory under <debugfs>/rpusbdisp with its counters
+ *   and the latency histograms, the summary attribute of the usb interface
+ *   shows the totals and the percentiles.
+ */
+
+
+#include "inc/common.h"
+#include "inc/stathandlers.h"
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+static struct dentry * _debugfs_root;
+
+static const char * const _counter_names[RPUSBDISP_STAT_COUNT] = {
+    [RPUSBDISP_STAT_FRAMES]             = "frames",
+    [RPUSBDISP_STAT_DEFIO_CALLBACKS]    = "defio_callbacks",
+    [RPUSBDISP_STAT_BITBLT_RLE]         = "bitblt_rle",
+    [RPUSBDISP_STAT_BITBLT_RAW]         = "bitblt_raw",
+    [RPUSBDISP_STAT_BITBLT_ZERO_COPY]   = "bitblt_zero_copy",
+    [RPUSBDISP_STAT_BITBLT_BYTES_IN]    = "bitblt_bytes_in",
+    [RPUSBDISP_STAT_BITBLT_BYTES_OUT]   = "bitblt_bytes_out",
+    [RPUSBDISP_STAT_TICKET_STARVED]     = "ticket_starved",
+    [RPUSBDISP_STAT_DISP_URB_ERRORS]    = "disp_urb_errors",
+    [RPUSBDISP_STAT_STATUS_URB_ERRORS]  = "status_urb_errors",
+};
+
+static const char * const _histogram_names[RPUSBDISP_HIST_COUNT] = {
+    [RPUSBDISP_HIST_ENCODE_NS]          = "encode_ns",
+    [RPUSBDISP_HIST_TRANSFER_US]        = "transfer_us",
+};
+
+// a histogram summed up over the cpus
+struct hist_snapshot {
+    u64   buckets[RPUSBDISP_HIST_BUCKETS];
+    u64   count;
+    u64   sum;
+};
+
+
+u64 stathandler_read(struct rpusbdisp_stats * stats, int counter)
+{
+    u64 total = 0;
+    int cpu;
+
+    // the counters keep changing meanwhile, the total is as good as a single read
+    for_each_possible_cpu(cpu) {
+        total += per_cpu_ptr(stats->percpu, cpu)->counters[counter];
+    }
+    return total;
+}
+
+static void _hist_read(struct rpusbdisp_stats * stats, int histogram, struct hist_snapshot * snapshot)
+{
+    int cpu, bucket;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    for_each_possible_cpu(cpu) {
+        const struct rpusbdisp_stats_cpu * percpu = per_cpu_ptr(stats->percpu, cpu);
+
+        for (bucket = 0; bucket < RPUSBDISP_HIST_BUCKETS; ++bucket) {
+            snapshot->buckets[bucket] += percpu->buckets[histogram][bucket];
+        }
+        snapshot->sum += percpu->sums[histogram];
+    }
+
+    for (bucket = 0; bucket < RPUSBDISP_HIST_BUCKETS; ++bucket) {
+        snapshot->count += snapshot->buckets[bucket];
+    }
+}
+
+// the largest value counted in a bucket
+static u64 _hist_bucket_max(int bucket)
+{
+    if (bucket == RPUSBDISP_HIST_BUCKETS - 1) return ~0ULL;
+    return bucket ? (1ULL << bucket) - 1 : 0;
+}
+
+static u64 _hist_mean(const struct hist_snapshot * snapshot)
+{
+    return snapshot->count ? div64_u64(snapshot->sum, snapshot->count) : 0;
+}
+
+// the upper bound of the bucket holding the percentile, within a factor of 2 of the actual value
+static u64 _hist_percentile(const struct hist_snapshot * snapshot, int percent)
+{
+    u64 rank = div64_u64(snapshot->count * percent + 99, 100);
+    u64 seen = 0;
+    int bucket;
+
+    if (!snapshot->count) return 0;
+
+    for (bucket = 0; bucket < RPUSBDISP_HIST_BUCKETS; ++bucket) {
+        seen += snapshot->buckets[bucket];
+        if (seen >= rank) break;
+    }
+    return _hist_bucket_max(min(bucket, RPUSBDISP_HIST_BUCKETS - 1));
+}
+
+
+static int _show_counters(struct seq_file * m, void * v)
+{
+    struct rpusbdisp_stats * stats = m->private;
+    int counter;
+
+    for (counter = 0; counter < RPUSBDISP_STAT_COUNT; ++counter) {
+        seq_printf(m, "%s %llu\n", _counter_names[counter], stathandler_read(stats, counter));
+    }
+    return 0;
+}
+
+static void _show_histogram(struct seq_file * m, int histogram)
+{
+    struct rpusbdisp_stats * stats = m->private;
+    struct hist_snapshot snapshot;
+    int bucket;
+
+    _hist_read(stats, histogram, &snapshot);
+
+    seq_printf(m, "count %llu\nmean %llu\np50 %llu\np90 %llu\np99 %llu\n",
+               snapshot.count, _hist_mean(&snapshot),
+               _hist_percentile(&snapshot, 50), _hist_percentile(&snapshot, 90), _hist_percentile(&snapshot, 99));
+
+    // the non-empty buckets as "min-max count"
+    for (bucket = 0; bucket < RPUSBDISP_HIST_BUCKETS; ++bucket) {
+        if (!snapshot.buckets[bucket]) continue;
+
+        seq_printf(m, "%llu-%llu %llu\n", bucket ? 1ULL << (bucket - 1) : 0ULL, _hist_bucket_max(bucket),
+                   snapshot.buckets[bucket]);
+    }
+}
+
+static int _show_encode_ns(struct seq_file * m, void * v)
+{
+    _show_histogram(m, RPUSBDISP_HIST_ENCODE_NS);
+    return 0;
+}
+
+static int _show_transfer_us(struct seq_file * m, void * v)
+{
+    _show_histogram(m, RPUSBDISP_HIST_TRANSFER_US);
+    return 0;
+}
+
+static int _open_counters(struct inode * inode, struct file * file)
+{
+    return single_open(file, _show_counters, inode->i_private);
+}
+
+static int _open_encode_ns(struct inode * inode, struct file * file)
+{
+    return single_open(file, _show_encode_ns, inode->i_private);
+}
+
+static int _open_transfer_us(struct inode * inode, struct file * file)
+{
+    return single_open(file, _show_transfer_us, inode->i_private);
+}
+
+static const struct file_operations _counters_fops = {
+    .owner   = THIS_MODULE,
+    .open    = _open_counters,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations _encode_ns_fops = {
+    .owner   = THIS_MODULE,
+    .open    = _open_encode_ns,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations _transfer_us_fops = {
+    .owner   = THIS_MODULE,
+    .open    = _open_transfer_us,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+
+ssize_t stathandler_show_summary(struct rpusbdisp_stats * stats, char * buf)
+{
+    struct hist_snapshot encode, transfer;
+    ssize_t size = 0;
+    int counter;
+
+    for (counter = 0; counter < RPUSBDISP_STAT_COUNT; ++counter) {
+        size += sprintf(buf + size, "%s %llu\n", _counter_names[counter], stathandler_read(stats, counter));
+    }
+
+    _hist_read(stats, RPUSBDISP_HIST_ENCODE_NS, &encode);
+    _hist_read(stats, RPUSBDISP_HIST_TRANSFER_US, &transfer);
+
+    size += sprintf(buf + size, "%s_mean %llu\n%s_p99 %llu\n",
+                    _histogram_names[RPUSBDISP_HIST_ENCODE_NS], _hist_mean(&encode),
+                    _histogram_names[RPUSBDISP_HIST_ENCODE_NS], _hist_percentile(&encode, 99));
+    size += sprintf(buf + size, "%s_mean %llu\n%s_p99 %llu\n",
+                    _histogram_names[RPUSBDISP_HIST_TRANSFER_US], _hist_mean(&transfer),
+                    _histogram_names[RPUSBDISP_HIST_TRANSFER_US], _hist_percentile(&transfer, 99));
+    return size;
+}
+
+
+int stathandler_on_new_device(struct rpusbdisp_stats * stats, const char * name)
+{
+    stats->percpu = alloc_percpu(struct rpusbdisp_stats_cpu);
+    if (!stats->percpu) return -ENOMEM;
+
+    // debugfs is optional, the device works without it
+    stats->debugfs_dir = debugfs_create_dir(name, _debugfs_root);
+    debugfs_create_file("counters", S_IRUGO, stats->debugfs_dir, stats, &_counters_fops);
+    debugfs_create_file(_histogram_names[RPUSBDISP_HIST_ENCODE_NS], S_IRUGO, stats->debugfs_dir, stats, &_encode_ns_fops);
+    debugfs_create_file(_histogram_names[RPUSBDISP_HIST_TRANSFER_US], S_IRUGO, stats->debugfs_dir, stats, &_transfer_us_fops);
+    return 0;
+}
+
+void stathandler_on_remove_device(struct rpusbdisp_stats * stats)
+{
+    // no file can be read once this returns
+    debugfs_remove_recursive(stats->debugfs_dir);
+    stats->debugfs_dir = NULL;
+
+    free_percpu(stats->percpu);
+    stats->percpu = NULL;
+}
+
+
+int register_stat_handlers(void)
+{
+    _debugfs_root = debugfs_create_dir("rpusbdisp", NULL);
+    return 0;
+}
+
+void unregister_stat_handlers(void)
+{
+    debugfs_remove_recursive(_debugfs_root);
+    _debugfs_root = NULL;
+}
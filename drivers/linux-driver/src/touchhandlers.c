@@ -16,29 +16,89 @@
 #include "inc/common.h"
 #include "inc/touchhandlers.h"
 #include "inc/usbhandlers.h"
+#include <linux/input/mt.h>
 
-static struct input_dev * _default_input_dev;
-static volatile int _live_flag;
+// the matrix maps a raw sample to the screen the same way as the tslib pointercal file:
+//     x' = (a*x + b*y + c) / s,  y' = (d*x + e*y + f) / s
+enum {
+    TOUCH_CALIB_A = 0, TOUCH_CALIB_B, TOUCH_CALIB_C,
+    TOUCH_CALIB_D, TOUCH_CALIB_E, TOUCH_CALIB_F,
+    TOUCH_CALIB_S,
+    TOUCH_CALIB_COUNT,
+};
 
-static int _on_create_input_dev(struct input_dev ** inputdev)
+static const int _identity_calibration[TOUCH_CALIB_COUNT] = { 1, 0, 0, 0, 1, 0, 1 };
+
+struct rpusbdisp_touch_private {
+    struct input_dev * inputdev;
+
+    // the last sample reported, the status packets repeat it until the touch changes
+    int last_x, last_y, last_touch;
+
+    spinlock_t lock;    // the calibration is changed through sysfs while the status urb is reporting
+    int calibration[TOUCH_CALIB_COUNT];
+};
+
+static ssize_t _show_calibration(struct device * d, struct device_attribute * attr, char * buf)
+{
+    struct rpusbdisp_touch_private * touch = input_get_drvdata(to_input_dev(d));
+    int calibration[TOUCH_CALIB_COUNT];
+    unsigned long flags;
+
+    spin_lock_irqsave(&touch->lock, flags);
+    memcpy(calibration, touch->calibration, sizeof(calibration));
+    spin_unlock_irqrestore(&touch->lock, flags);
+
+    return sprintf(buf, "%d %d %d %d %d %d %d\n", calibration[0], calibration[1], calibration[2],
+        calibration[3], calibration[4], calibration[5], calibration[6]);
+}
+
+static ssize_t _store_calibration(struct device * d, struct device_attribute * attr, const char * buf, size_t count)
+{
+    struct rpusbdisp_touch_private * touch = input_get_drvdata(to_input_dev(d));
+    int calibration[TOUCH_CALIB_COUNT];
+    unsigned long flags;
+
+    if (sscanf(buf, "%d %d %d %d %d %d %d", &calibration[0], &calibration[1], &calibration[2],
+        &calibration[3], &calibration[4], &calibration[5], &calibration[6]) != TOUCH_CALIB_COUNT) {
+        return -EINVAL;
+    }
+
+    if (!calibration[TOUCH_CALIB_S]) return -EINVAL;
+
+    spin_lock_irqsave(&touch->lock, flags);
+    memcpy(touch->calibration, calibration, sizeof(calibration));
+    spin_unlock_irqrestore(&touch->lock, flags);
+
+    return count;
+}
+
+static DEVICE_ATTR(calibration, S_IRUGO | S_IWUSR, _show_calibration, _store_calibration);
+
+static int _on_create_input_dev(struct input_dev ** inputdev, struct rpusbdisp_dev * dev)
 {
+    int ret;
+
     *inputdev = input_allocate_device();
 
-    if (!inputdev) {
+    if (!*inputdev) {
         return -ENOMEM;
     }
 
-    (*inputdev)->evbit[0] = BIT(EV_SYN) | BIT(EV_KEY) | BIT(EV_ABS);  
-    
-    (*inputdev)->keybit[BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH);  
+    // a single slot, the panel tracks one finger. The pointer emulation reports ABS_X, ABS_Y and BTN_TOUCH as well
+    input_set_abs_params((*inputdev), ABS_MT_POSITION_X, 0, disp_width - 1, 0, 0);
+    input_set_abs_params((*inputdev), ABS_MT_POSITION_Y, 0, disp_height - 1, 0, 0);
 
-
-    input_set_abs_params((*inputdev), ABS_X, 0, RP_DISP_DEFAULT_WIDTH, 0, 0);
-    input_set_abs_params((*inputdev), ABS_Y, 0, RP_DISP_DEFAULT_HEIGHT, 0, 0);
-    input_set_abs_params((*inputdev), ABS_PRESSURE, 0, 1, 0, 0);  
+    ret = input_mt_init_slots((*inputdev), 1, INPUT_MT_DIRECT);
+    if (ret) {
+        return ret;
+    }
 
     (*inputdev)->name = "RoboPeakUSBDisplayTS";
     (*inputdev)->id.bustype    = BUS_USB;
+    (*inputdev)->id.vendor     = RP_DISP_USB_VENDOR_ID;
+    (*inputdev)->id.product    = RP_DISP_USB_PRODUCT_ID;
+    (*inputdev)->dev.parent    = rpusbdisp_usb_get_devicehandle(dev);
 
     return input_register_device((*inputdev));
 }
@@ -50,46 +110,99 @@ static void _on_release_input_dev(struct input_dev * inputdev)
 }
 
 
+// input devices are created for each device when it is connected
 int __init register_touch_handler(void)
 {
-    int ret = _on_create_input_dev(&_default_input_dev);
-    if (!ret) _live_flag = 1;
-    return ret;
+    return 0;
 }
 
 void unregister_touch_handler(void)
 {
-    _live_flag = 0;
-    _on_release_input_dev(_default_input_dev);
-    _default_input_dev = NULL;
 }
 
 
 int touchhandler_on_new_device(struct rpusbdisp_dev * dev)
 {
-    // singleton design
+    struct rpusbdisp_touch_private * touch;
+    int ret;
+
+    touch = kzalloc(sizeof(struct rpusbdisp_touch_private), GFP_KERNEL);
+    if (!touch) {
+        return -ENOMEM;
+    }
+
+    spin_lock_init(&touch->lock);
+    memcpy(touch->calibration, _identity_calibration, sizeof(touch->calibration));
+
+    ret = _on_create_input_dev(&touch->inputdev, dev);
+    if (ret) {
+        input_free_device(touch->inputdev);
+        kfree(touch);
+        return ret;
+    }
+
+    input_set_drvdata(touch->inputdev, touch);
+    if (device_create_file(&touch->inputdev->dev, &dev_attr_calibration)) {
+        dev_warn(&touch->inputdev->dev, "Cannot create the calibration attribute.\n");
+    }
+
+    rpusbdisp_usb_set_touchhandle(dev, touch);
     return 0;
 }
 
 void touchhandler_on_remove_device(struct rpusbdisp_dev * dev)
 {
-    // singleton design
+    struct rpusbdisp_touch_private * touch = (struct rpusbdisp_touch_private *)rpusbdisp_usb_get_touchhandle(dev);
+
+    if (!touch) return;
+
+    rpusbdisp_usb_set_touchhandle(dev, NULL);
+
+    device_remove_file(&touch->inputdev->dev, &dev_attr_calibration);
+    _on_release_input_dev(touch->inputdev);
+    kfree(touch);
 }
 
+static void _apply_calibration(struct rpusbdisp_touch_private * touch, int * x, int * y)
+{
+    s64 raw_x = *x, raw_y = *y;
+    unsigned long flags;
+
+    spin_lock_irqsave(&touch->lock, flags);
+    *x = (int)div_s64(touch->calibration[TOUCH_CALIB_A] * raw_x + touch->calibration[TOUCH_CALIB_B] * raw_y + touch->calibration[TOUCH_CALIB_C],
+        touch->calibration[TOUCH_CALIB_S]);
+    *y = (int)div_s64(touch->calibration[TOUCH_CALIB_D] * raw_x + touch->calibration[TOUCH_CALIB_E] * raw_y + touch->calibration[TOUCH_CALIB_F],
+        touch->calibration[TOUCH_CALIB_S]);
+    spin_unlock_irqrestore(&touch->lock, flags);
+
+    *x = clamp(*x, 0, disp_width - 1);
+    *y = clamp(*y, 0, disp_height - 1);
+}
 
+// called once for each status packet, all the events of a packet are reported as a single frame
 void touchhandler_send_ts_event(struct rpusbdisp_dev * dev, int x, int y, int touch)
 {
-    if (!_default_input_dev || !_live_flag) return;
+    struct rpusbdisp_touch_private * pa = (struct rpusbdisp_touch_private *)rpusbdisp_usb_get_touchhandle(dev);
+    struct input_dev * inputdev;
+
+    if (!pa) return;
+    inputdev = pa->inputdev;
+
+    // the same sample repeated by the status packets would only wake up the readers
+    if (touch == pa->last_touch && (!touch || (x == pa->last_x && y == pa->last_y))) return;
+
+    pa->last_x = x;
+    pa->last_y = y;
+    pa->last_touch = touch;
+
+    input_mt_slot(inputdev, 0);
+    input_mt_report_slot_state(inputdev, MT_TOOL_FINGER, touch);
     if (touch) {
-        input_report_abs(_default_input_dev,ABS_X, x);
-        input_report_abs(_default_input_dev,ABS_Y, y);
-        input_report_abs(_default_input_dev, ABS_PRESSURE, 1);
-        input_report_key(_default_input_dev,BTN_TOUCH, 1);
-
-        input_sync(_default_input_dev);
-    } else {
-        input_report_abs(_default_input_dev, ABS_PRESSURE, 0);
-        input_report_key(_default_input_dev,BTN_TOUCH, 0);
-        input_sync(_default_input_dev);        
+        _apply_calibration(pa, &x, &y);
+        input_report_abs(inputdev, ABS_MT_POSITION_X, x);
+        input_report_abs(inputdev, ABS_MT_POSITION_Y, y);
     }
-}
\ No newline at end of file
+    input_mt_report_pointer_emulation(inputdev, true);
+
+    input_sync(inputdev);
+}
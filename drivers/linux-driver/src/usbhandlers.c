@@ -15,6 +15,7 @@
 #include "inc/usbhandlers.h"
 #include "inc/fbhandlers.h"
 #include "inc/touchhandlers.h"
+#include "inc/stathandlers.h"
 
 #define DL_ALIGN_UP(x, a) ALIGN(x, a)
 #define DL_ALIGN_DOWN(x, a) ALIGN(x-(a-1), a)
@@ -45,31 +46,44 @@ static volatile int _working_flag = 0;
 #define RPUSBDISP_STATUS_BUFFER_SIZE   32
 
 
-struct rpusbdisp_disp_ticket_bundle {
-    int  ticket_count;
-    struct list_head   ticket_list;
-
-};
-
 struct rpusbdisp_disp_ticket {
     struct urb                      *  transfer_urb;
-    struct list_head                   ticket_list_node;
+    int                                index;   // bit of the ticket in the free map of the pool
     struct rpusbdisp_dev            *  binded_dev;
+    struct completion               *  sg_done; // a zero copy transfer, the sender waits for it and returns the ticket
+    u64                                submit_ns;
     
 };
 
+struct rpusbdisp_disp_ticket_bundle {
+    int  ticket_count;
+    struct rpusbdisp_disp_ticket    *  tickets[RPUSBDISP_MAX_TRANSFER_TICKETS_COUNT];
+
+};
+
 
+// the tickets are handed out without locks: a seller reserves the whole bundle with a single
+// cmpxchg on availiable_count, then claims that many bits of free_map. A returned ticket sets
+// its bit before bumping availiable_count, so a reservation always finds enough set bits.
 struct rpusbdisp_disp_ticket_pool {
-    struct list_head                   list;
-    spinlock_t                         oplock;
+    struct rpusbdisp_disp_ticket    *  tickets[RPUSBDISP_MAX_TRANSFER_TICKETS_COUNT];
+    unsigned long                      free_map;
     size_t                             disp_urb_count;
     size_t                             packet_size_factor;
-    int                                availiable_count;
+    atomic_t                           availiable_count;
     wait_queue_head_t                  wait_queue;
     struct delayed_work                completion_work;
 
 };  
 
+// small display commands packed into a single ticket, each of them starts at a packet boundary
+struct rpusbdisp_disp_batch {
+    struct mutex                       lock;
+    struct rpusbdisp_disp_ticket    *  ticket;
+    size_t                             encoded_size;
+    struct delayed_work                flush_work;
+};
+
 struct rpusbdisp_dev {
     // timing and sync 
     struct list_head                   dev_list_node;
@@ -82,16 +96,14 @@ struct rpusbdisp_dev {
     struct usb_interface            *  interface;
     
 
-    // status package related
-    __u8                               status_in_buffer[RPUSBDISP_STATUS_BUFFER_SIZE]; // data buffer for the status IN endpoint
-    size_t                             status_in_buffer_recvsize;
-
-        
-
+    // status package related, several urbs are queued so the endpoint is polled at every bInterval
     __u8                               status_in_ep_addr;
     wait_queue_head_t                  status_wait_queue;
-    struct urb                      *  urb_status_query;
-    int                                urb_status_fail_count;
+    struct urb                      *  urb_status_query[RPUSBDISP_STATUS_URB_COUNT];
+    atomic_t                           urb_status_fail_count;   // consecutive transient errors
+    atomic_t                           status_stalled;
+    atomic_t                           status_recovery_attempts; // since the last packet received, for the backoff
+    struct delayed_work                status_recovery_work;
 
 
     // display data related
@@ -99,7 +111,28 @@ struct rpusbdisp_dev {
     size_t                             disp_out_ep_max_size;
 
     struct rpusbdisp_disp_ticket_pool  disp_tickets_pool;
+    struct rpusbdisp_disp_batch        disp_batch;
+    struct rpusbdisp_rle_planner    *  rle_planner;
+
+    // 16 bit copy of the images from 32bpp framebuffers
+    pixel_type_t                    *  convert_buffer;
+    size_t                             convert_buffer_size;
 
+    // performance counters
+    struct rpusbdisp_stats             stats;
+
+    // the host controller takes scatter-gather urbs with entries of any size
+    int                                disp_sg_capable;
+
+    // power management, pm_lock is held by the update worker while it sends and by the suspend
+    struct mutex                       pm_lock;
+    int                                pm_suspended;     // the urbs have been stopped
+    int                                pm_system_sleep;  // nothing is sent until the resume, the damage is kept
+    atomic_t                           wake_pending;     // the update worker has woken the display up, waiting for the first transfer
+    ktime_t                            wake_start;
+    atomic64_t                         wake_count;
+    atomic64_t                         wake_latency_last_us;
+    atomic64_t                         wake_latency_max_us;
 
 
     void                            *  fb_handle;
@@ -124,6 +157,7 @@ static struct usb_class_driver lcd_class = {
 
 
 static int _return_disp_tickets(struct rpusbdisp_dev * dev,  struct  rpusbdisp_disp_ticket * ticket);
+static struct rpusbdisp_disp_ticket * _wait_disp_ticket(struct rpusbdisp_dev * dev);
 
 
 struct device * rpusbdisp_usb_get_devicehandle(struct rpusbdisp_dev *dev)
@@ -146,6 +180,11 @@ void rpusbdisp_usb_set_touchhandle(struct rpusbdisp_dev * dev, void * touch_hand
     dev->touch_handle = touch_handle;
 }
 
+struct rpusbdisp_stats * rpusbdisp_usb_get_stats(struct rpusbdisp_dev * dev)
+{
+    return &dev->stats;
+}
+
 void * rpusbdisp_usb_get_touchhandle(struct rpusbdisp_dev * dev)
 {
     return dev->touch_handle;
@@ -178,13 +217,15 @@ static void _del_usbdev_from_list(struct rpusbdisp_dev * dev)
 }
 
 
-static void _on_parse_status_packet(struct rpusbdisp_dev *dev)
+static void _on_parse_status_packet(struct rpusbdisp_dev *dev, const void * packet, size_t size)
 {
-    rpusbdisp_status_packet_header_t * header = (rpusbdisp_status_packet_header_t *)dev->status_in_buffer;
+    const rpusbdisp_status_packet_header_t * header = (const rpusbdisp_status_packet_header_t *)packet;
+
+    if (size < sizeof(rpusbdisp_status_normal_packet_t)) return;
 
     if (header->packet_type == RPUSBDISP_STATUS_TYPE_NORMAL) {
         // only supports the normal status packet currently
-        rpusbdisp_status_normal_packet_t * normalpacket = (rpusbdisp_status_normal_packet_t *)header;
+        const rpusbdisp_status_normal_packet_t * normalpacket = (const rpusbdisp_status_normal_packet_t *)header;
         
 
 
@@ -209,34 +250,86 @@ static void _on_display_transfer_finished_delaywork(struct work_struct *work)
     fbhandler_on_all_transfer_done(dev);
 }
 
+static void _release_disp_ticket(struct rpusbdisp_disp_ticket * ticket, int status)
+{
+    struct rpusbdisp_dev * dev = ticket->binded_dev;
+    int                    all_finished;
+
+    ticket->transfer_urb->transfer_buffer_length = dev->disp_tickets_pool.packet_size_factor * dev->disp_out_ep_max_size; // reset buffer size
+
+    // the first pixels have reached the display after a wake up
+    if (!status && atomic_read(&dev->wake_pending) && atomic_xchg(&dev->wake_pending, 0)) {
+        s64 latency = ktime_us_delta(ktime_get(), dev->wake_start);
+
+        atomic64_inc(&dev->wake_count);
+        atomic64_set(&dev->wake_latency_last_us, latency);
+        if (latency > atomic64_read(&dev->wake_latency_max_us)) {
+            atomic64_set(&dev->wake_latency_max_us, latency);
+        }
+    }
+
+    // insert to the available queue
+    all_finished = _return_disp_tickets(dev, ticket);
+
+    if (all_finished && !status) {
+        schedule_delayed_work(&dev->disp_tickets_pool.completion_work, 0);
+    }
+}
+
 static void _on_display_transfer_finished(struct urb *urb)
 {
     struct rpusbdisp_disp_ticket * ticket = (struct rpusbdisp_disp_ticket *)urb->context;
     struct rpusbdisp_dev         * dev = ticket->binded_dev;
     
-    int                            all_finished = 0;
 	/* sync/async unlink faults aren't errors */
 	if (urb->status) {
 	
+        rpusbdisp_stat_inc(&dev->stats, RPUSBDISP_STAT_DISP_URB_ERRORS);
         if (dev->is_alive) {
             // set unsync flag
 		    fbhandler_set_unsync_flag(dev);
         }
         err("transmission failed for urb %p, error code %x\n", urb, urb->status);
 	
-	} 
+	} else {
+        rpusbdisp_stat_record(&dev->stats, RPUSBDISP_HIST_TRANSFER_US, div_u64(ktime_get_ns() - ticket->submit_ns, NSEC_PER_USEC));
+    }
 
     
 
-    urb->transfer_buffer_length = dev->disp_tickets_pool.packet_size_factor * dev->disp_out_ep_max_size; // reset buffer size
+    if (ticket->sg_done) {
+        // the image pages are still owned by the zero copy sender, which returns the ticket
+        complete(ticket->sg_done);
+        return;
+    }
 
-    // insert to the available queue
-    all_finished = _return_disp_tickets(dev, ticket);
+    _release_disp_ticket(ticket, urb->status);
+}
 
-    if (all_finished && !urb->status) {
-        schedule_delayed_work(&dev->disp_tickets_pool.completion_work, 0);
+// restart the polling later, the delay doubles with each attempt failing to receive a packet
+static void _status_schedule_recovery(struct rpusbdisp_dev * dev)
+{
+    int attempts = min(atomic_read(&dev->status_recovery_attempts), RPUSBDISP_STATUS_RECOVERY_MAX_SHIFT);
+    unsigned int delay_ms = min(RPUSBDISP_STATUS_RECOVERY_MIN_MS << attempts, RPUSBDISP_STATUS_RECOVERY_MAX_MS);
+
+    if (!dev->is_alive || dev->pm_suspended) return;
+
+    schedule_delayed_work(&dev->status_recovery_work, msecs_to_jiffies(delay_ms));
+}
+
+static void _status_submit(struct rpusbdisp_dev * dev, struct urb * urb)
+{
+    int status = usb_submit_urb(urb, GFP_ATOMIC);
+
+    // -EPERM: being killed by the recovery or the disconnection
+    if (!status || status == -EPERM) return;
+
+    if (status == -EPIPE) {
+        atomic_set(&dev->status_stalled, 1);
     }
-    
+
+    rpusbdisp_stat_inc(&dev->stats, RPUSBDISP_STAT_STATUS_URB_ERRORS);
+    _status_schedule_recovery(dev);
 }
 
 static void _on_status_query_finished(struct urb *urb)
@@ -251,24 +344,35 @@ static void _on_status_query_finished(struct urb *urb)
     switch (urb->status) {
         case 0:
             // succeed
-            // store the actual transfer size
-            dev->status_in_buffer_recvsize = urb->actual_length;
-            
+            atomic_set(&dev->urb_status_fail_count, 0);
+            atomic_set(&dev->status_recovery_attempts, 0);
 
-            _on_parse_status_packet(dev);
+            _on_parse_status_packet(dev, urb->transfer_buffer, urb->actual_length);
             // notify the waiters..
             wake_up(&dev->status_wait_queue);
             break;
+        case -ENOENT:
+        case -ECONNRESET:
+        case -ESHUTDOWN:
+            // killed, or the device is gone
+            return;
         case -EPIPE:
-          //  usb_clear_halt(dev->udev, usb_rcvintpipe(dev->udev, dev->status_in_ep_addr));
+            // the halt can only be cleared in process context
+            rpusbdisp_stat_inc(&dev->stats, RPUSBDISP_STAT_STATUS_URB_ERRORS);
+            atomic_set(&dev->status_stalled, 1);
+            _status_schedule_recovery(dev);
+            return;
         default:
-            //++dev->urb_status_fail_count;
-            dev->urb_status_fail_count = RPUSBDISP_STATUS_QUERY_RETRY_COUNT;
+            // crc, babble, timeout... are retried right away a few times
+            rpusbdisp_stat_inc(&dev->stats, RPUSBDISP_STAT_STATUS_URB_ERRORS);
+            if (atomic_inc_return(&dev->urb_status_fail_count) >= RPUSBDISP_STATUS_QUERY_RETRY_COUNT) {
+                _status_schedule_recovery(dev);
+                return;
+            }
     }
     
-    if (dev->urb_status_fail_count < RPUSBDISP_STATUS_QUERY_RETRY_COUNT) {
-        _status_start_querying(dev);
-    }
+    // the other urbs are still queued, this one goes to the end of the ring
+    _status_submit(dev, urb);
 }
 
 
@@ -276,8 +380,8 @@ static void _on_status_query_finished(struct urb *urb)
 static void _status_start_querying(struct rpusbdisp_dev * dev)
 {
     unsigned int pipe;
-    int status;
     struct usb_host_endpoint *ep;
+    int pos;
 
 	
     if (!dev->is_alive) {
@@ -285,106 +389,309 @@ static void _status_start_querying(struct rpusbdisp_dev * dev)
         return;
     }
 
-    if (dev->urb_status_fail_count >= RPUSBDISP_STATUS_QUERY_RETRY_COUNT) {
-        // max retry count has reached, return
-        return;
-    }
-
     pipe = usb_rcvintpipe(dev->udev, dev->status_in_ep_addr);
     ep = usb_pipe_endpoint(dev->udev, pipe);
 
     if (!ep) return;
 
+    for (pos = 0; pos < RPUSBDISP_STATUS_URB_COUNT; ++pos) {
+        struct urb * urb = dev->urb_status_query[pos];
 
-    usb_fill_int_urb(dev->urb_status_query, dev->udev, pipe, dev->status_in_buffer, RPUSBDISP_STATUS_BUFFER_SIZE,
+        usb_fill_int_urb(urb, dev->udev, pipe, urb->transfer_buffer, RPUSBDISP_STATUS_BUFFER_SIZE,
 				_on_status_query_finished, dev,
 				ep->desc.bInterval);
     
-    //submit it
-    status = usb_submit_urb(dev->urb_status_query, GFP_ATOMIC);
-    if (status) {
-        if (status == -EPIPE) {
-            usb_clear_halt(dev->udev, pipe);
-        }
-        
-        ++ dev->urb_status_fail_count;
+        //submit it
+        _status_submit(dev, urb);
+    }
+}
+
+static void _status_recovery_delaywork(struct work_struct *work)
+{
+    struct rpusbdisp_dev * dev = container_of(work, struct rpusbdisp_dev, status_recovery_work.work);
+    int pos;
+
+    if (!dev->is_alive || dev->pm_suspended) return;
+
+    dev_info(&dev->interface->dev, "restarting the status polling (attempt %d)\n", atomic_inc_return(&dev->status_recovery_attempts));
+
+    for (pos = 0; pos < RPUSBDISP_STATUS_URB_COUNT; ++pos) {
+        usb_kill_urb(dev->urb_status_query[pos]);
+    }
+
+    if (atomic_xchg(&dev->status_stalled, 0)) {
+        usb_clear_halt(dev->udev, usb_rcvintpipe(dev->udev, dev->status_in_ep_addr));
+    }
+
+    atomic_set(&dev->urb_status_fail_count, 0);
+    _status_start_querying(dev);
+}
+
+static void _free_status_urbs(struct rpusbdisp_dev * dev)
+{
+    int pos;
+
+    for (pos = 0; pos < RPUSBDISP_STATUS_URB_COUNT; ++pos) {
+        // the buffer is freed with the urb
+        usb_free_urb(dev->urb_status_query[pos]);
+        dev->urb_status_query[pos] = NULL;
+    }
+}
+
+static int _alloc_status_urbs(struct rpusbdisp_dev * dev)
+{
+    int pos;
+
+    for (pos = 0; pos < RPUSBDISP_STATUS_URB_COUNT; ++pos) {
+        struct urb * urb = usb_alloc_urb(0, GFP_KERNEL);
+
+        if (!urb) goto failed;
+        dev->urb_status_query[pos] = urb;
+
+        urb->transfer_buffer = kmalloc(RPUSBDISP_STATUS_BUFFER_SIZE, GFP_KERNEL);
+        if (!urb->transfer_buffer) goto failed;
+        urb->transfer_flags |= URB_FREE_BUFFER;
     }
+
+    INIT_DELAYED_WORK(&dev->status_recovery_work, _status_recovery_delaywork);
+    return 0;
+
+failed:
+    _free_status_urbs(dev);
+    return -ENOMEM;
 }
 
 
 static int _sell_disp_tickets(struct rpusbdisp_dev * dev, struct rpusbdisp_disp_ticket_bundle * bundle, size_t required_count)
 {
-    unsigned long irq_flags;
-    int ans = 0;
-    struct list_head *node;
+    struct rpusbdisp_disp_ticket_pool * pool = &dev->disp_tickets_pool;
+    int available, prev;
+    int claimed = 0;
+    unsigned long pos;
+
     // do not sell tickets when the device has been closed
     if (!dev->is_alive) return 0;
     if (required_count == 0) {
         printk("required for zero ?!\n");
         return 0;
     }
-    spin_lock_irqsave(&dev->disp_tickets_pool.oplock, irq_flags);
-    do {
-        if (required_count > dev->disp_tickets_pool.availiable_count) {
+
+    // reserve the whole bundle at once
+    available = atomic_read(&pool->availiable_count);
+    for (;;) {
+        if ((int)required_count > available) {
             // no enough tickets availiable
-            break;
+            return 0;
         }
 
-        dev->disp_tickets_pool.availiable_count -= required_count;
-        
-        bundle->ticket_count = required_count;
-        ans = bundle->ticket_count;
-        
-        INIT_LIST_HEAD(&bundle->ticket_list);
-        while(required_count--) {
-            node = dev->disp_tickets_pool.list.next;
-            list_del_init(node);
-            list_add_tail(node, &bundle->ticket_list);
+        prev = atomic_cmpxchg(&pool->availiable_count, available, available - (int)required_count);
+        if (prev == available) break;
+        available = prev;
+    }
+
+    // the reservation guarantees enough free bits, the other sellers may only take the ones we look at first
+    while (claimed < (int)required_count) {
+        pos = find_first_bit(&pool->free_map, pool->disp_urb_count);
+        if (pos >= pool->disp_urb_count) {
+            cpu_relax();
+            continue;
+        }
+
+        if (test_and_clear_bit(pos, &pool->free_map)) {
+            bundle->tickets[claimed++] = pool->tickets[pos];
         }
-    }while(0);
-    spin_unlock_irqrestore(&dev->disp_tickets_pool.oplock,irq_flags);
-    return ans;
+    }
+
+    bundle->ticket_count = claimed;
+    return claimed;
+}
+
+// the first try of an acquisition, a failure is counted as ticket starvation once
+static int _try_sell_disp_tickets(struct rpusbdisp_dev * dev, struct rpusbdisp_disp_ticket_bundle * bundle, size_t required_count)
+{
+    int sold = _sell_disp_tickets(dev, bundle, required_count);
+
+    if (!sold && dev->is_alive) {
+        rpusbdisp_stat_inc(&dev->stats, RPUSBDISP_STAT_TICKET_STARVED);
+    }
+    return sold;
 }
 
 
 static int _return_disp_tickets(struct rpusbdisp_dev * dev,  struct  rpusbdisp_disp_ticket * ticket)
 {
-    int all_finished = 0;
-    unsigned long  irq_flags;
-    // insert to the available queue
-    
-    spin_lock_irqsave(&dev->disp_tickets_pool.oplock, irq_flags);
-	list_add_tail(&ticket->ticket_list_node, &dev->disp_tickets_pool.list);
+    struct rpusbdisp_disp_ticket_pool * pool = &dev->disp_tickets_pool;
+    int all_finished;
 
-    if ( ++dev->disp_tickets_pool.availiable_count == dev->disp_tickets_pool.disp_urb_count) {
-        all_finished = 1;   
-    }
-	
-	spin_unlock_irqrestore(&dev->disp_tickets_pool.oplock, irq_flags);
+    // the bit must be visible before the ticket can be reserved again
+    set_bit(ticket->index, &pool->free_map);
+    smp_mb__after_atomic();
 
+    all_finished = (atomic_inc_return(&pool->availiable_count) == (int)pool->disp_urb_count);
+
+    // the bitblt encoder may be waiting for its next ticket, the atomic op above orders the check
+    if (waitqueue_active(&pool->wait_queue)) {
+        wake_up(&pool->wait_queue);
+    }
 
-    wake_up(&dev->disp_tickets_pool.wait_queue);
     return all_finished;
 }
 
+// all the tickets are back, nothing is being transferred
+int rpusbdisp_usb_is_idle(struct rpusbdisp_dev * dev)
+{
+    return atomic_read(&dev->disp_tickets_pool.availiable_count) == (int)dev->disp_tickets_pool.disp_urb_count;
+}
+
+
+// submit a filled ticket, stamped for the transfer time histogram
+static int _submit_disp_ticket(struct rpusbdisp_disp_ticket * ticket)
+{
+    ticket->submit_ns = ktime_get_ns();
+    return usb_submit_urb(ticket->transfer_urb, GFP_KERNEL);
+}
+
+
+/*
+ * Power management
+ *
+ * The update worker holds a runtime pm reference of the interface while it sends, so the display is
+ * autosuspended once nothing has been drawn for the autosuspend delay, and woken up by the next damage.
+ * The suspend drains the tickets and stops the status urbs; the framebuffer driver keeps recording
+ * the damage meanwhile, so the resume only sends what has changed instead of the whole screen.
+ */
+
+// keep the display awake while the update worker sends, returns non-zero if nothing can be sent now
+int rpusbdisp_usb_autopm_get(struct rpusbdisp_dev * dev)
+{
+    int was_suspended = dev->pm_suspended;
+    ktime_t start = ktime_get();
+    int ret;
+
+    ret = usb_autopm_get_interface(dev->interface);
+    if (ret) return ret;
+
+    mutex_lock(&dev->pm_lock);
+    if (dev->pm_system_sleep) {
+        mutex_unlock(&dev->pm_lock);
+        usb_autopm_put_interface(dev->interface);
+        return -EBUSY;
+    }
+
+    if (was_suspended && !atomic_read(&dev->wake_pending)) {
+        // measured up to the completion of the first transfer
+        dev->wake_start = start;
+        atomic_set(&dev->wake_pending, 1);
+    }
+    return 0;
+}
+
+// the autosuspend delay starts over from now
+void rpusbdisp_usb_autopm_put(struct rpusbdisp_dev * dev)
+{
+    mutex_unlock(&dev->pm_lock);
+    usb_autopm_put_interface(dev->interface);
+}
+
+
+/*
+ * Command batching
+ *
+ * fillrect and copyarea commands are only a few bytes long, sending each of them in its own urb costs
+ * a full round trip per command. They are appended to a batch ticket instead, every command starting at
+ * a packet boundary with RPUSBDISP_CMD_FLAG_START as the protocol requires. The batch is submitted when
+ * it is full, RPUSBDISP_BATCH_FLUSH_DELAY_MS after its first command, or before an image is sent.
+ */
+
+static void _batch_submit_locked(struct rpusbdisp_dev * dev)
+{
+    struct rpusbdisp_disp_ticket * ticket = dev->disp_batch.ticket;
+
+    if (!ticket) return;
+    dev->disp_batch.ticket = NULL;
+
+    ticket->transfer_urb->transfer_buffer_length = dev->disp_batch.encoded_size;
+
+    if (_submit_disp_ticket(ticket)) {
+        // submit failure,
+        _on_display_transfer_finished(ticket->transfer_urb);
+    }
+}
+
+static void _batch_flush(struct rpusbdisp_dev * dev)
+{
+    mutex_lock(&dev->disp_batch.lock);
+    _batch_submit_locked(dev);
+    mutex_unlock(&dev->disp_batch.lock);
+}
+
+static void _batch_flush_delaywork(struct work_struct *work)
+{
+    struct rpusbdisp_dev * dev = container_of(work, struct rpusbdisp_dev,
+					      disp_batch.flush_work.work);
+
+    _batch_flush(dev);
+}
+
+// submit the commands waiting in the batch ticket without waiting for the flush delay
+void rpusbdisp_usb_flush(struct rpusbdisp_dev * dev)
+{
+    _batch_flush(dev);
+}
+
+// reserve size bytes starting at a packet boundary of the batch ticket, returns NULL if no ticket comes back in time
+static _u8 * _batch_reserve_locked(struct rpusbdisp_dev * dev, size_t size)
+{
+    struct  rpusbdisp_disp_ticket * ticket;
+    size_t  ticket_logic_size = dev->disp_tickets_pool.packet_size_factor * dev->disp_out_ep_max_size;
+    size_t  offset;
+    _u8   * buffer;
+
+    if (dev->disp_batch.ticket) {
+        buffer = (_u8 *)dev->disp_batch.ticket->transfer_urb->transfer_buffer;
+        offset = roundup(dev->disp_batch.encoded_size, dev->disp_out_ep_max_size);
+
+        if (offset + size <= ticket_logic_size) {
+            // zero fill the rest of the last packet of the previous command
+            memset(buffer + dev->disp_batch.encoded_size, 0, offset - dev->disp_batch.encoded_size);
+            dev->disp_batch.encoded_size = offset + size;
+            return buffer + offset;
+        }
+
+        // the batch is full
+        _batch_submit_locked(dev);
+    }
+
+    // the commands are queued rather than dropped, a fill or a copy costs a lot more sent as pixels
+    ticket = _wait_disp_ticket(dev);
+    if (!ticket) {
+        return NULL;
+    }
+
+    dev->disp_batch.ticket = ticket;
+    dev->disp_batch.encoded_size = size;
+    schedule_delayed_work(&dev->disp_batch.flush_work, msecs_to_jiffies(RPUSBDISP_BATCH_FLUSH_DELAY_MS));
+
+    return (_u8 *)dev->disp_batch.ticket->transfer_urb->transfer_buffer;
+}
+
 
 int rpusbdisp_usb_try_copy_area(struct rpusbdisp_dev * dev, int sx, int sy, int dx, int dy, int width, int height)
 {
     
-    struct  rpusbdisp_disp_ticket_bundle bundle;
-    struct  rpusbdisp_disp_ticket * ticket;
     rpusbdisp_disp_copyarea_packet_t * cmd_copyarea;
-    // only one ticket is enough
-    if (!_sell_disp_tickets(dev, &bundle, 1)) {
-        // tickets is inadequate, try next time
+
+    BUG_ON(sizeof(rpusbdisp_disp_copyarea_packet_t) + 1 > dev->disp_out_ep_max_size);
+
+    mutex_lock(&dev->disp_batch.lock);
+
+    //add one more byte to bypass usbdisp 1.03 fw bug
+    cmd_copyarea = (rpusbdisp_disp_copyarea_packet_t *)_batch_reserve_locked(dev, sizeof(rpusbdisp_disp_copyarea_packet_t) + 1);
+    if (!cmd_copyarea) {
+        mutex_unlock(&dev->disp_batch.lock);
         return 0;
     }
 
-    BUG_ON(sizeof(rpusbdisp_disp_copyarea_packet_t) > dev->disp_out_ep_max_size);
-
-    ticket = list_entry(bundle.ticket_list.next, struct  rpusbdisp_disp_ticket, ticket_list_node);
-    
-    cmd_copyarea = (rpusbdisp_disp_copyarea_packet_t *)ticket->transfer_urb->transfer_buffer;
     cmd_copyarea->header.cmd_flag = RPUSBDISP_DISPCMD_COPY_AREA| RPUSBDISP_CMD_FLAG_START;
 
     cmd_copyarea->sx = cpu_to_le16(sx);
@@ -395,15 +702,7 @@ int rpusbdisp_usb_try_copy_area(struct rpusbdisp_dev * dev, int sx, int sy, int
     cmd_copyarea->width= cpu_to_le16(width);
     cmd_copyarea->height = cpu_to_le16(height);
 
-    //add one more byte to bypass usbdisp 1.03 fw bug
-    ticket->transfer_urb->transfer_buffer_length = sizeof(rpusbdisp_disp_copyarea_packet_t) + 1; 
-
-    if (usb_submit_urb(ticket->transfer_urb, GFP_KERNEL)) {
-        // submit failure,
-         _on_display_transfer_finished(ticket->transfer_urb);
-        return 0;
-    }
-    
+    mutex_unlock(&dev->disp_batch.lock);
     return 1;
 
 }
@@ -411,20 +710,16 @@ int rpusbdisp_usb_try_copy_area(struct rpusbdisp_dev * dev, int sx, int sy, int
 int rpusbdisp_usb_try_draw_rect(struct rpusbdisp_dev * dev, int x, int y, int right, int bottom,  pixel_type_t color, int operation)
 {
     rpusbdisp_disp_fillrect_packet_t * cmd_fillrect;
-    struct  rpusbdisp_disp_ticket_bundle bundle;
-    struct  rpusbdisp_disp_ticket * ticket;
-
-    // only one ticket is enough
-    if (!_sell_disp_tickets(dev, &bundle, 1)) {
-        // tickets is inadequate, try next time
-        return 0;
-    }
 
     BUG_ON(sizeof(rpusbdisp_disp_fillrect_packet_t) > dev->disp_out_ep_max_size);
 
-    ticket = list_entry(bundle.ticket_list.next, struct  rpusbdisp_disp_ticket, ticket_list_node);
-    
-    cmd_fillrect = (rpusbdisp_disp_fillrect_packet_t *)ticket->transfer_urb->transfer_buffer;
+    mutex_lock(&dev->disp_batch.lock);
+
+    cmd_fillrect = (rpusbdisp_disp_fillrect_packet_t *)_batch_reserve_locked(dev, sizeof(rpusbdisp_disp_fillrect_packet_t));
+    if (!cmd_fillrect) {
+        mutex_unlock(&dev->disp_batch.lock);
+        return 0;
+    }
 
     cmd_fillrect->header.cmd_flag = RPUSBDISP_DISPCMD_RECT | RPUSBDISP_CMD_FLAG_START;
 
@@ -436,14 +731,7 @@ int rpusbdisp_usb_try_draw_rect(struct rpusbdisp_dev * dev, int x, int y, int ri
     cmd_fillrect->color_565 = cpu_to_le16(color);
     cmd_fillrect->operation = operation;
 
-    ticket->transfer_urb->transfer_buffer_length = sizeof(rpusbdisp_disp_fillrect_packet_t);
-
-    if (usb_submit_urb(ticket->transfer_urb, GFP_KERNEL)) {
-        // submit failure,
-         _on_display_transfer_finished(ticket->transfer_urb);
-        return 0;
-    }
-    
+    mutex_unlock(&dev->disp_batch.lock);
     return 1;
 
 }
@@ -452,11 +740,9 @@ int rpusbdisp_usb_try_draw_rect(struct rpusbdisp_dev * dev, int x, int y, int ri
 
 
 
-// context used by the bitblt display packet encoder
+// context used by the bitblt display packet encoder, the image is streamed through one ticket at a time
 struct bitblt_encoding_context_t {
-    struct  rpusbdisp_disp_ticket_bundle bundle;
     struct  rpusbdisp_disp_ticket * ticket;
-    struct  list_head * current_node;
 
     size_t  encoded_pos;
     size_t  packet_pos;
@@ -466,65 +752,51 @@ struct bitblt_encoding_context_t {
 } ;
 
 
-
-static int _bitblt_encoder_init(struct bitblt_encoding_context_t * ctx, struct rpusbdisp_dev * dev, size_t image_size, int rlemode) 
+// wait until a ticket is returned by the urb completion, returns NULL if the device is gone or stops responding
+static struct rpusbdisp_disp_ticket * _wait_disp_ticket(struct rpusbdisp_dev * dev)
 {
-    
-    size_t effective_payload_per_packet_size;
-    size_t packet_count;
-    size_t required_tickets_count;
-
-    size_t payload_without_header_size = sizeof(rpusbdisp_disp_bitblt_packet_t) - sizeof(rpusbdisp_disp_packet_header_t)
-                                                 + image_size;
-
+    struct rpusbdisp_disp_ticket_bundle bundle;
 
+    bundle.ticket_count = 0;
+    if (_try_sell_disp_tickets(dev, &bundle, 1)) {
+        return bundle.tickets[0];
+    }
 
-    if (rlemode) {
-        // the worst case for RLE is 1 extra byte with each 128 pixels (since the 7bit size block can represent 128 uints)
-        payload_without_header_size += (((image_size>>1) + 0x7f)>>7);
-    }   
+    wait_event_timeout(dev->disp_tickets_pool.wait_queue,
+        _sell_disp_tickets(dev, &bundle, 1) || !dev->is_alive,
+        msecs_to_jiffies(RPUSBDISP_TICKET_WAIT_TIMEOUT_MS));
 
+    return bundle.ticket_count ? bundle.tickets[0] : NULL;
+}
 
-    // calc how many tickets are needed ...
-    effective_payload_per_packet_size = dev->disp_out_ep_max_size - sizeof(rpusbdisp_disp_packet_header_t);
-    
-    packet_count = (payload_without_header_size + effective_payload_per_packet_size-1) /effective_payload_per_packet_size;
-    required_tickets_count = (packet_count + dev->disp_tickets_pool.packet_size_factor-1) / dev->disp_tickets_pool.packet_size_factor;
+static void _bitblt_encoder_use_ticket(struct bitblt_encoding_context_t * ctx, struct rpusbdisp_disp_ticket * ticket)
+{
+    ctx->ticket = ticket;
+    ctx->packet_pos = 0;
+    ctx->urbbuffer = (_u8 *)ticket->transfer_urb->transfer_buffer;
+}
 
-    
-    if ( required_tickets_count>RPUSBDISP_MAX_TRANSFER_TICKETS_COUNT)
-    {
-        err("required_tickets_count (%zu)>RPUSBDISP_MAX_TRANSFER_TICKETS_COUNT(%d)\n", required_tickets_count, RPUSBDISP_MAX_TRANSFER_TICKETS_COUNT);
-       // BUG_ON(1);
-        return 0;
-    }
+static int _bitblt_encoder_init(struct bitblt_encoding_context_t * ctx, struct rpusbdisp_dev * dev, int rlemode) 
+{
+    struct  rpusbdisp_disp_ticket_bundle bundle;
 
- 
-    
-    if (!_sell_disp_tickets(dev, &ctx->bundle, required_tickets_count)) {
-        // tickets is inadequate, try next time
+    // only the first ticket is required to start, the following ones are waited for while the
+    // previous ones are being transferred. If all of them are busy, try next time
+    if (!_try_sell_disp_tickets(dev, &bundle, 1)) {
         return 0;
     }
 
     // init the context...
-    ctx->packet_pos = 0;
-    ctx->current_node = ctx->bundle.ticket_list.next;
-    ctx->ticket = list_entry(ctx->current_node, struct  rpusbdisp_disp_ticket, ticket_list_node);
-    ctx->urbbuffer = (_u8 *)ctx->ticket->transfer_urb->transfer_buffer;
+    _bitblt_encoder_use_ticket(ctx, bundle.tickets[0]);
     ctx->encoded_pos = 0;
     ctx->rlemode = rlemode;
     return 1;
 }
 
 
-static void _bitblt_encode_command_header(struct bitblt_encoding_context_t * ctx, struct rpusbdisp_dev * dev, int x, int y, int right, int bottom, int clear_dirty)
+static void _bitblt_fill_command_header(rpusbdisp_disp_bitblt_packet_t * bitblt_header, int rlemode, int x, int y, int right, int bottom, int clear_dirty)
 {
-    rpusbdisp_disp_bitblt_packet_t * bitblt_header ;
-
-    // encoding the command header...
-       
-    bitblt_header = (rpusbdisp_disp_bitblt_packet_t *)ctx->urbbuffer;
-    bitblt_header->header.cmd_flag = ctx->rlemode?RPUSBDISP_DISPCMD_BITBLT_RLE:RPUSBDISP_DISPCMD_BITBLT;
+    bitblt_header->header.cmd_flag = rlemode?RPUSBDISP_DISPCMD_BITBLT_RLE:RPUSBDISP_DISPCMD_BITBLT;
     bitblt_header->header.cmd_flag |= RPUSBDISP_CMD_FLAG_START;
     if (clear_dirty) {
         bitblt_header->header.cmd_flag |= RPUSBDISP_CMD_FLAG_CLEARDITY;
@@ -535,6 +807,12 @@ static void _bitblt_encode_command_header(struct bitblt_encoding_context_t * ctx
     bitblt_header->width = cpu_to_le16(right+1-x);
     bitblt_header->height = cpu_to_le16(bottom+1-y);
     bitblt_header->operation = RPUSBDISP_OPERATION_COPY;
+}
+
+static void _bitblt_encode_command_header(struct bitblt_encoding_context_t * ctx, struct rpusbdisp_dev * dev, int x, int y, int right, int bottom, int clear_dirty)
+{
+    // encoding the command header...
+    _bitblt_fill_command_header((rpusbdisp_disp_bitblt_packet_t *)ctx->urbbuffer, ctx->rlemode, x, y, right, bottom, clear_dirty);
         
     ctx->encoded_pos = sizeof(rpusbdisp_disp_bitblt_packet_t);
 
@@ -543,15 +821,10 @@ static void _bitblt_encode_command_header(struct bitblt_encoding_context_t * ctx
 
 static void _bitblt_encoder_cleanup(struct bitblt_encoding_context_t * ctx, struct rpusbdisp_dev * dev)
 {
-    struct  rpusbdisp_disp_ticket * ticket;
-
-    // return unused tickets
-    while (ctx->current_node != &ctx->bundle.ticket_list) {
-
-        ticket = list_entry(ctx->current_node, struct  rpusbdisp_disp_ticket, ticket_list_node);
-        ctx->current_node = ctx->current_node->next;
-
-        _return_disp_tickets(dev, ticket);
+    // return the ticket not submitted
+    if (ctx->ticket) {
+        _return_disp_tickets(dev, ctx->ticket);
+        ctx->ticket = NULL;
     }
 
 }
@@ -565,13 +838,15 @@ static int _bitblt_encoder_flush(struct bitblt_encoding_context_t * ctx, struct
     size_t transfer_size = ctx->packet_pos * dev->disp_out_ep_max_size + ctx->encoded_pos;
     
     if (transfer_size) {
-        ctx->ticket->transfer_urb->transfer_buffer_length = transfer_size;
+        struct  rpusbdisp_disp_ticket * ticket = ctx->ticket;
+
+        ticket->transfer_urb->transfer_buffer_length = transfer_size;
         
-        ctx->current_node = ctx->current_node->next;
-        if (usb_submit_urb(ctx->ticket->transfer_urb, GFP_KERNEL)) {
+        ctx->ticket = NULL;
+        if (_submit_disp_ticket(ticket)) {
             // submit failure,
            
-            _on_display_transfer_finished(ctx->ticket->transfer_urb);
+            _on_display_transfer_finished(ticket->transfer_urb);
             return 0; //abort
         }
     }
@@ -606,22 +881,26 @@ static int _bitblt_encode_n_transfer_data(struct bitblt_encoding_context_t * ctx
             
             if (++ctx->packet_pos >= dev->disp_tickets_pool.packet_size_factor) {
                 // current urb is full, send the ticket
-                ctx->current_node = ctx->current_node->next;
-                if (usb_submit_urb(ctx->ticket->transfer_urb, GFP_KERNEL)) {
+                struct  rpusbdisp_disp_ticket * ticket = ctx->ticket;
+
+                ctx->ticket = NULL;
+                if (_submit_disp_ticket(ticket)) {
                     // submit failure,
                   
-                    _on_display_transfer_finished(ctx->ticket->transfer_urb);
+                    _on_display_transfer_finished(ticket->transfer_urb);
                     return 0; //abort
                 }
 
                 
-                // a new ticket
-                ctx->packet_pos = 0;
-                
-                BUG_ON(ctx->current_node == &ctx->bundle.ticket_list);
+                // a new ticket, the encoding goes on as soon as any submitted transfer is done
+                ticket = _wait_disp_ticket(dev);
+                if (!ticket) {
+                    // the display received a partial image, let the whole screen be sent again
+                    fbhandler_set_unsync_flag(dev);
+                    return 0;
+                }
 
-                ctx->ticket = list_entry(ctx->current_node, struct  rpusbdisp_disp_ticket, ticket_list_node);
-                ctx->urbbuffer = (_u8 *)ctx->ticket->transfer_urb->transfer_buffer;
+                _bitblt_encoder_use_ticket(ctx, ticket);
     
             }
 
@@ -641,20 +920,99 @@ struct rle_encoder_context {
     int    is_common_section;
     size_t section_size;
     pixel_type_t   section_data[128];
+    size_t         encoded_size;
 
+    // the run reaching the end of the previous row, it may continue in the next row
+    pixel_type_t   run_value;
+    size_t         run_length;
 };
 
 
-static void _rle_compress_init(struct rle_encoder_context * rle_ctx, struct bitblt_encoding_context_t * encoder_ctx, struct rpusbdisp_dev * dev)
+/*
+ * Run boundary scanners
+ *
+ * The RLE encoder spends most of its time finding where runs of equal pixels begin and end.
+ * Instead of checking the pixels one by one, a machine word worth of pixels is compared at once (SWAR).
+ * The vector units are not used here as they require kernel_fpu_begin()/kernel_neon_begin() around
+ * each use and cannot be touched from every context the framebuffer may be flushed in.
+ *
+ * _rle_scan_run:      count the leading pixels equal to value
+ * _rle_scan_distinct: count the leading pixels differing from their next pixel (the last pixel is never counted)
+ */
+
+#ifdef __LITTLE_ENDIAN
+
+#define RLE_SCAN_PIXELS_PER_WORD   (sizeof(unsigned long) / sizeof(pixel_type_t))
+#define RLE_SCAN_LANE_LOW_BITS     (~0UL / 0xFFFF)
+#define RLE_SCAN_LANE_HIGH_BITS    (RLE_SCAN_LANE_LOW_BITS << 15)
+
+static size_t _rle_scan_run(const pixel_type_t * pixels, size_t count, pixel_type_t value)
 {
-    rle_ctx->encoder_ctx = encoder_ctx;
-    rle_ctx->is_common_section = 0;
-    rle_ctx->section_size = 0;
-    
-}
+    const unsigned long pattern = RLE_SCAN_LANE_LOW_BITS * value;
+    size_t pos = 0;
+
+    for (; pos + RLE_SCAN_PIXELS_PER_WORD <= count; pos += RLE_SCAN_PIXELS_PER_WORD) {
+        // any non-zero lane is a pixel different from value, the lowest lane is the first pixel
+        unsigned long diff = get_unaligned((const unsigned long *)(pixels + pos)) ^ pattern;
+        if (diff) {
+            return pos + __ffs(diff) / 16;
+        }
+    }
 
+    while (pos < count && pixels[pos] == value) ++pos;
+    return pos;
+}
 
-static int _rle_flush_section(struct rle_encoder_context * rle_ctx, struct rpusbdisp_dev * dev)
+static size_t _rle_scan_distinct(const pixel_type_t * pixels, size_t count)
+{
+    size_t pos = 0;
+
+    for (; pos + RLE_SCAN_PIXELS_PER_WORD < count; pos += RLE_SCAN_PIXELS_PER_WORD) {
+        unsigned long diff = get_unaligned((const unsigned long *)(pixels + pos))
+                           ^ get_unaligned((const unsigned long *)(pixels + pos + 1));
+        
+        // flags the zero lanes, only lanes above a real zero lane may be flagged by mistake, so the lowest flag is exact
+        unsigned long zero_lanes = (diff - RLE_SCAN_LANE_LOW_BITS) & ~diff & RLE_SCAN_LANE_HIGH_BITS;
+        if (zero_lanes) {
+            return pos + __ffs(zero_lanes) / 16;
+        }
+    }
+
+    while (pos + 1 < count && pixels[pos] != pixels[pos + 1]) ++pos;
+    return pos;
+}
+
+#else
+
+static size_t _rle_scan_run(const pixel_type_t * pixels, size_t count, pixel_type_t value)
+{
+    size_t pos = 0;
+    while (pos < count && pixels[pos] == value) ++pos;
+    return pos;
+}
+
+static size_t _rle_scan_distinct(const pixel_type_t * pixels, size_t count)
+{
+    size_t pos = 0;
+    while (pos + 1 < count && pixels[pos] != pixels[pos + 1]) ++pos;
+    return pos;
+}
+
+#endif
+
+
+static void _rle_compress_init(struct rle_encoder_context * rle_ctx, struct bitblt_encoding_context_t * encoder_ctx, struct rpusbdisp_dev * dev)
+{
+    rle_ctx->encoder_ctx = encoder_ctx;
+    rle_ctx->is_common_section = 0;
+    rle_ctx->section_size = 0;
+    rle_ctx->encoded_size = 0;
+    rle_ctx->run_length = 0;
+    
+}
+
+
+static int _rle_flush_section(struct rle_encoder_context * rle_ctx, struct rpusbdisp_dev * dev)
 {
 
     // flush the current section ...
@@ -684,190 +1042,757 @@ static int _rle_flush_section(struct rle_encoder_context * rle_ctx, struct rpusb
     }
                 
     
+    rle_ctx->encoded_size += sizeof(_u8) + sizeof(pixel_type_t) * section_data_len;
+
     // reinit the section
     rle_ctx->is_common_section = 0;
     rle_ctx->section_size = 0;
     return 1;
 }
 
-static int  _rle_compress_n_encode(struct rle_encoder_context * rle_ctx, struct rpusbdisp_dev * dev, pixel_type_t pixel)
+static int _rle_encode_raw(struct rle_encoder_context * rle_ctx, struct rpusbdisp_dev * dev, const pixel_type_t * pixels, size_t count)
+{
+    BUG_ON(rle_ctx->is_common_section);
+
+    while (count) {
+        size_t size_to_copy;
+
+        if (rle_ctx->section_size == RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1) {
+            // section is full, flush it...
+            if (!_rle_flush_section(rle_ctx, dev)) {
+                return 0;
+            }
+        }
+
+        size_to_copy = RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1 - rle_ctx->section_size;
+        if (size_to_copy > count) size_to_copy = count;
+
+        count -= size_to_copy;
+        while (size_to_copy--) {
+            rle_ctx->section_data[rle_ctx->section_size++] = cpu_to_le16(*pixels++);
+        }
+    }
+    return 1;
+}
+
+static int _rle_encode_run(struct rle_encoder_context * rle_ctx, struct rpusbdisp_dev * dev, pixel_type_t value, size_t length)
+{
+    if (length == 1) {
+        // a single pixel is a part of the raw section
+        return _rle_encode_raw(rle_ctx, dev, &value, 1);
+    }
+
+    // the pending raw section ends here
+    if (!_rle_flush_section(rle_ctx, dev)) {
+        return 0;
+    }
+
+    while (length) {
+        size_t section_size = length > RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1 ? RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1 : length;
+
+        if (section_size == 1) {
+            // the pixel left by a full common section starts a new raw section
+            return _rle_encode_raw(rle_ctx, dev, &value, 1);
+        }
+
+        rle_ctx->is_common_section = 1;
+        rle_ctx->section_size = section_size;
+        rle_ctx->section_data[0] = cpu_to_le16(value);
+        if (!_rle_flush_section(rle_ctx, dev)) {
+            return 0;
+        }
+
+        length -= section_size;
+    }
+    return 1;
+}
+
+static int  _rle_compress_n_encode(struct rle_encoder_context * rle_ctx, struct rpusbdisp_dev * dev, const pixel_type_t * pixels, size_t count)
 {
 #if RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1 > 128
 #error "RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1 > 128"
 #endif
-    if (rle_ctx->is_common_section) {
-        BUG_ON(rle_ctx->section_size == 0);
+    size_t pos = 0;
 
-        if (pixel != rle_ctx->section_data[0]) {
-            if (!_rle_flush_section(rle_ctx, dev)) {
+    if (!count) return 1;
+
+    if (rle_ctx->run_length) {
+        // try to extend the run left by the previous row
+        pos = _rle_scan_run(pixels, count, rle_ctx->run_value);
+        rle_ctx->run_length += pos;
+
+        if (pos == count) {
+            return 1;
+        }
+
+        if (!_rle_encode_run(rle_ctx, dev, rle_ctx->run_value, rle_ctx->run_length)) {
+            return 0;
+        }
+        rle_ctx->run_length = 0;
+    }
+
+    while (pos < count) {
+        pixel_type_t value = pixels[pos];
+        size_t end = pos + 1 + _rle_scan_run(pixels + pos + 1, count - pos - 1, value);
+
+        if (end == count) {
+            // the run may continue in the next row
+            rle_ctx->run_value = value;
+            rle_ctx->run_length = end - pos;
+            return 1;
+        }
+
+        if (end - pos > 1) {
+            if (!_rle_encode_run(rle_ctx, dev, value, end - pos)) {
                 return 0;
             }
-            rle_ctx->section_size = 1;
-            rle_ctx->section_data[0] = pixel;
         } else {
+            // take all the pixels before the next run in one go
+            end = pos + 1 + _rle_scan_distinct(pixels + pos + 1, count - pos - 1);
+
+            if (!_rle_encode_raw(rle_ctx, dev, pixels + pos, end - pos)) {
+                return 0;
+            }
+        }
+        pos = end;
+    }
+
+    return 1;
+}
+
+static int _rle_compress_flush(struct rle_encoder_context * rle_ctx, struct rpusbdisp_dev * dev)
+{
+    if (rle_ctx->run_length) {
+        if (!_rle_encode_run(rle_ctx, dev, rle_ctx->run_value, rle_ctx->run_length)) {
+            return 0;
+        }
+        rle_ctx->run_length = 0;
+    }
+
+    return _rle_flush_section(rle_ctx, dev);
+}
+
 
-            if (rle_ctx->section_size == RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1) {
-                // section is full, flush it...
-                
-                if (!_rle_flush_section(rle_ctx, dev)) {
-                    return 0;
-                }
-                rle_ctx->section_size = 1;
-                rle_ctx->section_data[0] = pixel;
 
+// Must be a power of 2 larger than RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1
+#define RLE_PLANNER_WINDOW_SIZE    256
+#define RLE_PLANNER_WINDOW_MASK    (RLE_PLANNER_WINDOW_SIZE - 1)
+
+#define RLE_RAW_SECTION_COST(size) (sizeof(_u8) + (size) * sizeof(pixel_type_t))
+#define RLE_COMMON_SECTION_COST    (sizeof(_u8) + sizeof(pixel_type_t))
+
+// working memory of the minimum size encoder, allocated on demand as it is too large for the stack
+struct rpusbdisp_rle_planner {
+    _u32   cost[RLE_PLANNER_WINDOW_SIZE];
+    size_t raw_starts[RLE_PLANNER_WINDOW_SIZE];
+    size_t plan_size;
+    _u8    plan[];
+};
+
+static struct rpusbdisp_rle_planner * _rle_get_planner(struct rpusbdisp_dev * dev, size_t pixel_count)
+{
+    if (!dev->rle_planner || dev->rle_planner->plan_size < pixel_count) {
+        vfree(dev->rle_planner);
+
+        dev->rle_planner = vmalloc(sizeof(struct rpusbdisp_rle_planner) + pixel_count);
+        if (!dev->rle_planner) {
+            return NULL;
+        }
+        dev->rle_planner->plan_size = pixel_count;
+    }
+    return dev->rle_planner;
+}
+
+/*
+ * Minimum size encoder
+ *
+ * cost[i] is the least bytes needed by the first i pixels. The last section of that encoding is either a raw section
+ * or a common section within the run pixel i-1 belongs to. As cost[i] never decreases with i, the longest common
+ * section is always the best one, and the best raw section starts at the minimum of cost[j] - 2j over the last 128
+ * positions, which is kept in a monotonic queue.
+ *
+ * plan[i-1] records the header of the last section chosen for the first i pixels, walking these headers back from
+ * the end leaves the header of every chosen section at its first pixel, then the sections are encoded in order.
+ */
+static int _rle_compress_optimal(struct rle_encoder_context * rle_ctx, struct rpusbdisp_dev * dev, struct rpusbdisp_rle_planner * planner,
+                                 const pixel_type_t * framebuffer, size_t width, size_t height, int line_width)
+{
+    const size_t pixel_count = width * height;
+    const pixel_type_t * line = framebuffer;
+    size_t head = 0, tail = 0;
+    size_t i = 0, run_start = 0, pos, x, y;
+    pixel_type_t run_value = 0;
+
+    planner->cost[0] = 0;
+    planner->raw_starts[tail++ & RLE_PLANNER_WINDOW_MASK] = 0;
+
+    for (y = 0; y < height; ++y, line += line_width) {
+        for (x = 0; x < width; ++x) {
+            size_t raw_start, common_start;
+            _u32   raw_cost, common_cost, best_cost;
+
+            if (!i || line[x] != run_value) {
+                run_start = i;
+                run_value = line[x];
+            }
+            ++i;
+
+            while (planner->raw_starts[head & RLE_PLANNER_WINDOW_MASK] + RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1 < i) ++head;
+
+            raw_start = planner->raw_starts[head & RLE_PLANNER_WINDOW_MASK];
+            raw_cost = planner->cost[raw_start & RLE_PLANNER_WINDOW_MASK] + RLE_RAW_SECTION_COST(i - raw_start);
+
+            common_start = (i - run_start > RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1) ? i - (RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1) : run_start;
+            common_cost = planner->cost[common_start & RLE_PLANNER_WINDOW_MASK] + RLE_COMMON_SECTION_COST;
+
+            if (common_cost <= raw_cost) {
+                best_cost = common_cost;
+                planner->plan[i - 1] = RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT | (i - common_start - 1);
             } else {
-                // simply increase the section size...
-                ++ rle_ctx->section_size;
+                best_cost = raw_cost;
+                planner->plan[i - 1] = i - raw_start - 1;
+            }
+            planner->cost[i & RLE_PLANNER_WINDOW_MASK] = best_cost;
+
+            // i becomes a candidate start of raw sections, drop the candidates it beats
+            while (tail != head) {
+                size_t candidate = planner->raw_starts[(tail - 1) & RLE_PLANNER_WINDOW_MASK];
+                if (planner->cost[candidate & RLE_PLANNER_WINDOW_MASK] + (i - candidate) * sizeof(pixel_type_t) <= best_cost) break;
+                --tail;
             }
+            planner->raw_starts[tail++ & RLE_PLANNER_WINDOW_MASK] = i;
         }
-    } else {
-        // check whether the current pixel is equal to the last pixel value...
-  
-        if (rle_ctx->section_size && (pixel == rle_ctx->section_data[rle_ctx->section_size-1])) {
-            // remove the last pixel from the current section, flush the section and form a common section
-            --rle_ctx->section_size;
+    }
 
-            if (rle_ctx->section_size) {
-                // only flush a section with non-zero data
-                if (!_rle_flush_section(rle_ctx, dev)) {
-                    return 0;
-                }
+    for (pos = pixel_count; pos; ) {
+        _u8 section_header = planner->plan[pos - 1];
+        pos -= (section_header & RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT) + 1;
+        planner->plan[pos] = section_header;
+    }
+
+    line = framebuffer;
+    for (pos = 0, x = 0; pos < pixel_count; ) {
+        _u8 section_header = planner->plan[pos];
+        size_t section_size = (section_header & RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT) + 1;
+
+        rle_ctx->is_common_section = (section_header & RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT) ? 1 : 0;
+        rle_ctx->section_size = 0;
+        pos += section_size;
+
+        // step over the pixels of the section, raw pixels are collected on the way
+        while (rle_ctx->section_size < section_size) {
+            if (rle_ctx->is_common_section) {
+                size_t chunk = section_size - rle_ctx->section_size;
+                if (chunk > width - x) chunk = width - x;
+
+                rle_ctx->section_data[0] = cpu_to_le16(line[x]);
+                rle_ctx->section_size += chunk;
+                x += chunk;
+            } else {
+                rle_ctx->section_data[rle_ctx->section_size++] = cpu_to_le16(line[x++]);
             }
 
-            // form a common section
-            rle_ctx->section_size = 2;
-            rle_ctx->section_data[0] = pixel;
-            rle_ctx->is_common_section = 1;
+            if (x == width) {
+                x = 0;
+                line += line_width;
+            }
+        }
+
+        if (!_rle_flush_section(rle_ctx, dev)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+#define RLE_ESTIMATE_SAMPLE_ROWS   16
+
+// the greedy encoded size of a row, runs are not joined with the neighbour rows
+static size_t _rle_estimate_row_size(const pixel_type_t * pixels, size_t count)
+{
+    size_t size = 0, pos = 0;
+
+    while (pos < count) {
+        size_t end = pos + 1 + _rle_scan_run(pixels + pos + 1, count - pos - 1, pixels[pos]);
+
+        if (end - pos > 1) {
+            size += DIV_ROUND_UP(end - pos, RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1) * RLE_COMMON_SECTION_COST;
         } else {
-            if (rle_ctx->section_size == RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1) {
-                // section is full, flush it...
-                
-                if (!_rle_flush_section(rle_ctx, dev)) {
-                    return 0;
-                }
+            end = pos + 1 + _rle_scan_distinct(pixels + pos + 1, count - pos - 1);
+            size += RLE_RAW_SECTION_COST(end - pos) + (end - pos - 1) / (RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1);
+        }
+        pos = end;
+    }
+    return size;
+}
 
-            }
-            // include the new data
-            rle_ctx->section_data[rle_ctx->section_size++] = pixel;
+// estimate the RLE encoded size of an image by encoding a few evenly spaced rows only
+static size_t _rle_estimate_size(const pixel_type_t * framebuffer, size_t width, size_t height, int line_width)
+{
+    size_t step = DIV_ROUND_UP(height, RLE_ESTIMATE_SAMPLE_ROWS);
+    size_t sampled_rows = 0, sampled_size = 0, y;
+
+    for (y = 0; y < height; y += step, ++sampled_rows) {
+        sampled_size += _rle_estimate_row_size(framebuffer + y * line_width, width);
+    }
+
+    return sampled_size * height / sampled_rows;
+}
+
+// rle_ctx is NULL if the image is sent uncompressed
+static void _bitblt_update_stats(struct rpusbdisp_dev * dev, size_t image_size, const struct rle_encoder_context * rle_ctx)
+{
+    rpusbdisp_stat_inc(&dev->stats, rle_ctx ? RPUSBDISP_STAT_BITBLT_RLE : RPUSBDISP_STAT_BITBLT_RAW);
+    rpusbdisp_stat_add(&dev->stats, RPUSBDISP_STAT_BITBLT_BYTES_IN, image_size);
+    rpusbdisp_stat_add(&dev->stats, RPUSBDISP_STAT_BITBLT_BYTES_OUT, rle_ctx ? rle_ctx->encoded_size : image_size);
+}
+
+
+// convert a rect of a 32bpp framebuffer into the rows of dev->convert_buffer
+static const pixel_type_t * _convert_xrgb8888_image(struct rpusbdisp_dev * dev, const void * framebuffer, int x, int y, int right, int bottom, int line_length)
+{
+    const size_t width = right + 1 - x;
+    const size_t pixel_count = width * (bottom + 1 - y);
+    pixel_type_t * dest;
+    size_t pos;
+
+    if (!dev->convert_buffer || dev->convert_buffer_size < pixel_count) {
+        vfree(dev->convert_buffer);
+        dev->convert_buffer_size = 0;
+
+        dev->convert_buffer = vmalloc(pixel_count * sizeof(pixel_type_t));
+        if (!dev->convert_buffer) {
+            return NULL;
         }
-        
+        dev->convert_buffer_size = pixel_count;
+    }
 
+    dest = dev->convert_buffer;
+    for (; y <= bottom; ++y) {
+        const _u32 * src = (const _u32 *)((const _u8 *)framebuffer + y * line_length) + x;
+
+        for (pos = 0; pos < width; ++pos) {
+            *dest++ = rp_disp_xrgb8888_to_pixel(src[pos]);
+        }
     }
 
+    return dev->convert_buffer;
+}
 
-    return 1;
+/*
+ * Zero copy bitblt
+ *
+ * An uncompressed 16bpp image is already in the format of the display, so instead of being copied into a ticket
+ * it is sent with a scatter-gather urb pointing at the image pages. The packet headers come from a small side
+ * buffer: the bitblt command, then one byte for each following packet. Such entries are only accepted by the
+ * host controllers without sg constraints (xHCI). The host controller reads the pages after the urb is submitted,
+ * so the sender waits for the transfer before handing the image back to the caller.
+ */
+
+struct bitblt_sg_context {
+    struct sg_table      table;
+    struct scatterlist * sg;            // the next entry to fill
+    struct scatterlist * last;
+    unsigned int         nents;
+    size_t               size;
+    _u8                * headers;
+    size_t               packet_count;  // the packets after the first one
+    size_t               packet_left;   // room left in the current packet
+};
+
+static void _bitblt_sg_add(struct bitblt_sg_context * ctx, const void * addr, size_t size)
+{
+    struct page * page = is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+
+    sg_set_page(ctx->sg, page, size, offset_in_page(addr));
+    ctx->last = ctx->sg;
+    ctx->sg = sg_next(ctx->sg);
+    ++ctx->nents;
+    ctx->size += size;
 }
 
+// add the pixels of a row, splitting them at the packet and the page boundaries
+static void _bitblt_sg_add_data(struct bitblt_sg_context * ctx, struct rpusbdisp_dev * dev, const _u8 * data, size_t size)
+{
+    while (size) {
+        size_t chunk;
+
+        if (!ctx->packet_left) {
+            // current transfer block is full, the next one starts with its header
+            _u8 * header = ctx->headers + sizeof(rpusbdisp_disp_bitblt_packet_t) + ctx->packet_count++;
+
+            *header = 0;
+            ((rpusbdisp_disp_packet_header_t *)header)->cmd_flag = RPUSBDISP_DISPCMD_BITBLT;
+            _bitblt_sg_add(ctx, header, sizeof(rpusbdisp_disp_packet_header_t));
+
+            ctx->packet_left = dev->disp_out_ep_max_size - sizeof(rpusbdisp_disp_packet_header_t);
+        }
+
+        chunk = min(size, ctx->packet_left);
+        chunk = min(chunk, (size_t)(PAGE_SIZE - offset_in_page(data)));
+        _bitblt_sg_add(ctx, data, chunk);
+
+        data += chunk;
+        size -= chunk;
+        ctx->packet_left -= chunk;
+    }
+}
+
+// returns 1 if the image is sent, 0 if it should be tried again and a negative error if it should be copied instead
+static int _bitblt_send_sg(struct rpusbdisp_dev * dev, const void * image, int x, int y, int right, int bottom, int line_length, int clear_dirty)
+{
+    const size_t row_size = (right + 1 - x) * sizeof(pixel_type_t);
+    const size_t rows = bottom + 1 - y;
+    const size_t packets = DIV_ROUND_UP(row_size * rows, dev->disp_out_ep_max_size - sizeof(rpusbdisp_disp_packet_header_t)) + 1;
+    // each entry ends at a packet, a row or a page boundary
+    const size_t max_nents = 2 * packets + 2 * rows + row_size * rows / PAGE_SIZE + 2;
+    const _u8 * row = (const _u8 *)image + y * line_length + x * sizeof(pixel_type_t);
+    struct rpusbdisp_disp_ticket_bundle bundle;
+    struct rpusbdisp_disp_ticket * ticket;
+    struct bitblt_sg_context ctx;
+    struct urb * urb;
+    void * transfer_buffer;
+    DECLARE_COMPLETION_ONSTACK(done);
+    int status = 0;
+    int ret;
+    size_t pos;
+
+    if (max_nents > dev->udev->bus->sg_tablesize) return -E2BIG;
+
+    if (sg_alloc_table(&ctx.table, max_nents, GFP_KERNEL)) return -ENOMEM;
+
+    ctx.headers = kmalloc(sizeof(rpusbdisp_disp_bitblt_packet_t) + packets, GFP_KERNEL);
+    if (!ctx.headers) {
+        ret = -ENOMEM;
+        goto final;
+    }
+
+    if (!_try_sell_disp_tickets(dev, &bundle, 1)) {
+        // tickets is inadequate, try next time
+        ret = 0;
+        goto final;
+    }
+    ticket = bundle.tickets[0];
+    urb = ticket->transfer_urb;
+
+    ctx.sg = ctx.table.sgl;
+    ctx.last = NULL;
+    ctx.nents = 0;
+    ctx.size = 0;
+    ctx.packet_count = 0;
+
+    _bitblt_fill_command_header((rpusbdisp_disp_bitblt_packet_t *)ctx.headers, 0, x, y, right, bottom, clear_dirty);
+    _bitblt_sg_add(&ctx, ctx.headers, sizeof(rpusbdisp_disp_bitblt_packet_t));
+    ctx.packet_left = dev->disp_out_ep_max_size - sizeof(rpusbdisp_disp_bitblt_packet_t);
+
+    for (pos = 0; pos < rows; ++pos, row += line_length) {
+        _bitblt_sg_add_data(&ctx, dev, row, row_size);
+    }
+    sg_mark_end(ctx.last);
+
+    // let the host controller map the pages instead of the coherent buffer of the ticket
+    transfer_buffer = urb->transfer_buffer;
+    urb->transfer_buffer = NULL;
+    urb->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
+    urb->sg = ctx.table.sgl;
+    urb->num_sgs = ctx.nents;
+    urb->transfer_buffer_length = ctx.size;
+    ticket->sg_done = &done;
+
+    ret = _submit_disp_ticket(ticket);
+    if (!ret) {
+        if (!wait_for_completion_timeout(&done, msecs_to_jiffies(RPUSBDISP_TICKET_WAIT_TIMEOUT_MS))) {
+            usb_kill_urb(urb);
+            wait_for_completion(&done);
+        }
+        status = urb->status;
+    }
+
+    urb->sg = NULL;
+    urb->num_sgs = 0;
+    urb->transfer_buffer = transfer_buffer;
+    urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    ticket->sg_done = NULL;
+    _release_disp_ticket(ticket, ret ? ret : status);
+
+    if (ret) {
+        // not taken by the host controller, copy the images from now on
+        dev_warn(&dev->interface->dev, "zero copy transfer rejected (%d), using the ticket buffers.\n", ret);
+        dev->disp_sg_capable = 0;
+        ret = -EIO;
+        goto final;
+    }
+
+    // a failed transfer has already set the unsync flag
+    ret = status ? 0 : 1;
 
+final:
+    kfree(ctx.headers);
+    sg_free_table(&ctx.table);
+    return ret;
+}
 
-int rpusbdisp_usb_try_send_image(struct rpusbdisp_dev * dev, const pixel_type_t * framebuffer, int x, int y, int right, int bottom, int line_width, int clear_dirty)
+static int _bitblt_send_image(struct rpusbdisp_dev * dev, const void * image, int x, int y, int right, int bottom, int line_length, int bpp, int clear_dirty)
 {
+    const pixel_type_t * framebuffer;
+    int    line_width;
     struct bitblt_encoding_context_t encoder_ctx;
     struct rle_encoder_context       rle_ctx;
+    struct rpusbdisp_rle_planner   * rle_planner = NULL;
     int    last_copied_x, last_copied_y; 
     int    rlemode;
 
-    // estimate how many tickets are needed
-    const size_t image_size = (right-x + 1)* (bottom-y+1) * (RP_DISP_DEFAULT_PIXEL_BITS/8);
+    const size_t image_size = (right-x + 1)* (bottom-y+1) * sizeof(pixel_type_t);
 
     // do not transmit zero size image
     if (!image_size) return 1;
 
+    if (bpp == RP_DISP_PIXEL_BITS_XRGB8888) {
+        // the encoders below take the pixels of the display, convert the image first
+        framebuffer = _convert_xrgb8888_image(dev, image, x, y, right, bottom, line_length);
+        if (!framebuffer) return 0;
+
+        line_width = right + 1 - x;
+    } else {
+        line_width = line_length / sizeof(pixel_type_t);
+        framebuffer = (const pixel_type_t *)image + (y*line_width + x);
+    }
+
+    // the queued commands should reach the display before the image
+    _batch_flush(dev);
+
     if (dev->device_fwver >= RP_DISP_FEATURE_RLE_FWVERSION) {
         rlemode = 1;
     } else {
         rlemode = 0;
     }
+
+    // images which do not compress (photos, videos...) would grow with RLE, send them uncompressed instead
+    if (rlemode && _rle_estimate_size(framebuffer, right + 1 - x, bottom + 1 - y, line_width) >= image_size) {
+        rlemode = 0;
+    }
+
+#ifdef __LITTLE_ENDIAN
+    if (zero_copy && !rlemode && bpp == RP_DISP_PIXEL_BITS_RGB565 && dev->disp_sg_capable) {
+        int ret = _bitblt_send_sg(dev, image, x, y, right, bottom, line_length, clear_dirty);
+
+        if (ret >= 0) {
+            if (ret) {
+                _bitblt_update_stats(dev, image_size, NULL);
+                rpusbdisp_stat_inc(&dev->stats, RPUSBDISP_STAT_BITBLT_ZERO_COPY);
+            }
+            return ret;
+        }
+    }
+#endif
     
-    if (!_bitblt_encoder_init(&encoder_ctx, dev, image_size, rlemode)) return 0;
+    if (!_bitblt_encoder_init(&encoder_ctx, dev, rlemode)) return 0;
 
     if (rlemode) {
         _rle_compress_init(&rle_ctx, &encoder_ctx, dev);
+
+        if (rle_optimal) {
+            // fall back to the greedy encoder if the planner memory is not available
+            rle_planner = _rle_get_planner(dev, image_size / sizeof(pixel_type_t));
+        }
     }
 
     _bitblt_encode_command_header(&encoder_ctx, dev, x, y, right, bottom, clear_dirty);
 
-    // locate to the begining...
-    framebuffer += (y*line_width + x);
-    
+    if (rle_planner) {
+        if (!_rle_compress_optimal(&rle_ctx, dev, rle_planner, framebuffer, right + 1 - x, bottom + 1 - y, line_width)) {
+            _bitblt_encoder_cleanup(&encoder_ctx, dev);
+            return 0;
+        }
+        _bitblt_update_stats(dev, image_size, &rle_ctx);
+        return _bitblt_encoder_flush(&encoder_ctx, dev);
+    }
+
     for (last_copied_y = y; last_copied_y <= bottom; ++last_copied_y) {
         
-        for (last_copied_x = x; last_copied_x <= right; ++last_copied_x) {
-           pixel_type_t current_pixel_le = cpu_to_le16(*framebuffer);
-            
-#if (RP_DISP_DEFAULT_PIXEL_BITS/8) != 2
-    #error "only 16bit pixel type is supported"
-#endif  
-           if (rlemode) {
-                if (!_rle_compress_n_encode(&rle_ctx, dev, current_pixel_le)) {
-                    _bitblt_encoder_cleanup(&encoder_ctx, dev);
-                    return 0;
-                }
-           } else {
+        if (rlemode) {
+            if (!_rle_compress_n_encode(&rle_ctx, dev, framebuffer, right + 1 - x)) {
+                _bitblt_encoder_cleanup(&encoder_ctx, dev);
+                return 0;
+            }
+        } else {
+            for (last_copied_x = x; last_copied_x <= right; ++last_copied_x) {
+                pixel_type_t current_pixel_le = cpu_to_le16(framebuffer[last_copied_x - x]);
+
                 if (!_bitblt_encode_n_transfer_data(&encoder_ctx, dev, &current_pixel_le, sizeof(pixel_type_t))) {
                     // abort the operation...
                     
                     _bitblt_encoder_cleanup(&encoder_ctx, dev);
                     return 0;
                 }
-           }
-           
-           ++framebuffer;
-           
+            }
         }
-        framebuffer += line_width - right - 1 + x;
+        
+        framebuffer += line_width;
     }
     
     if (rlemode) {
-        if (!_rle_flush_section(&rle_ctx, dev)) {
+        if (!_rle_compress_flush(&rle_ctx, dev)) {
             _bitblt_encoder_cleanup(&encoder_ctx, dev);
             return 0;
         }            
     }
 
+    _bitblt_update_stats(dev, image_size, rlemode ? &rle_ctx : NULL);
+    return _bitblt_encoder_flush(&encoder_ctx, dev);
+
+
+}
+
+// count the leading bits of a row from x equal to bit, whole bytes are compared at once
+static size_t _mono_scan_run(const _u8 * row, int x, size_t count, int bit)
+{
+    const _u8 filled = bit ? 0xFF : 0;
+    size_t pos = 0;
+
+    while (pos < count) {
+        const int cur = x + (int)pos;
+
+        if (!(cur & 7) && pos + 8 <= count && row[cur >> 3] == filled) {
+            pos += 8;
+        } else if (rpusbdisp_mono_bit(row, cur) == bit) {
+            ++pos;
+        } else {
+            break;
+        }
+    }
+    return pos;
+}
+
+// same as _rle_compress_n_encode, the runs are found in the bits of the row instead of the pixels
+static int _rle_compress_n_encode_mono(struct rle_encoder_context * rle_ctx, struct rpusbdisp_dev * dev, const _u8 * row, int x, size_t count,
+    pixel_type_t fg, pixel_type_t bg)
+{
+    size_t pos = 0;
+
+    while (pos < count) {
+        const int bit = rpusbdisp_mono_bit(row, x + (int)pos);
+        const pixel_type_t value = bit ? fg : bg;
+        const size_t length = _mono_scan_run(row, x + (int)pos, count - pos, bit);
+
+        if (rle_ctx->run_length && rle_ctx->run_value == value) {
+            // the run left by the previous row goes on
+            rle_ctx->run_length += length;
+        } else {
+            if (rle_ctx->run_length && !_rle_encode_run(rle_ctx, dev, rle_ctx->run_value, rle_ctx->run_length)) {
+                return 0;
+            }
+            rle_ctx->run_value = value;
+            rle_ctx->run_length = length;
+        }
+
+        pos += length;
+        if (pos == count) {
+            // the run may continue in the next row
+            return 1;
+        }
+
+        if (!_rle_encode_run(rle_ctx, dev, rle_ctx->run_value, rle_ctx->run_length)) {
+            return 0;
+        }
+        rle_ctx->run_length = 0;
+    }
+    return 1;
+}
+
+// send a rect of a 1bpp bitmap, the set bits in fg and the others in bg. The framebuffer is not read
+static int _bitblt_send_mono(struct rpusbdisp_dev * dev, const void * bitmap, int x, int y, int right, int bottom, int line_length,
+    pixel_type_t fg, pixel_type_t bg)
+{
+    struct bitblt_encoding_context_t encoder_ctx;
+    struct rle_encoder_context       rle_ctx;
+    const size_t width = right + 1 - x;
+    const size_t image_size = width * (bottom + 1 - y) * sizeof(pixel_type_t);
+    const _u8 * row = (const _u8 *)bitmap + y * line_length;
+    int    rlemode = (dev->device_fwver >= RP_DISP_FEATURE_RLE_FWVERSION);
+    size_t pos;
+
+    if (!image_size) return 1;
+
+    // the queued commands should reach the display before the image
+    _batch_flush(dev);
+
+    if (!_bitblt_encoder_init(&encoder_ctx, dev, rlemode)) return 0;
+    if (rlemode) _rle_compress_init(&rle_ctx, &encoder_ctx, dev);
+
+    _bitblt_encode_command_header(&encoder_ctx, dev, x, y, right, bottom, 0);
+
+    for (; y <= bottom; ++y, row += line_length) {
+        if (rlemode) {
+            if (!_rle_compress_n_encode_mono(&rle_ctx, dev, row, x, width, fg, bg)) {
+                _bitblt_encoder_cleanup(&encoder_ctx, dev);
+                return 0;
+            }
+            continue;
+        }
+
+        for (pos = 0; pos < width; ++pos) {
+            pixel_type_t current_pixel_le = cpu_to_le16(rpusbdisp_mono_bit(row, x + (int)pos) ? fg : bg);
+
+            if (!_bitblt_encode_n_transfer_data(&encoder_ctx, dev, &current_pixel_le, sizeof(pixel_type_t))) {
+                _bitblt_encoder_cleanup(&encoder_ctx, dev);
+                return 0;
+            }
+        }
+    }
+
+    if (rlemode && !_rle_compress_flush(&rle_ctx, dev)) {
+        _bitblt_encoder_cleanup(&encoder_ctx, dev);
+        return 0;
+    }
+
+    _bitblt_update_stats(dev, image_size, rlemode ? &rle_ctx : NULL);
     return _bitblt_encoder_flush(&encoder_ctx, dev);
+}
+
+int rpusbdisp_usb_try_send_image(struct rpusbdisp_dev * dev, const void * image, int x, int y, int right, int bottom, int line_length, int bpp, int clear_dirty)
+{
+    u64 start = ktime_get_ns();
+    int ret = _bitblt_send_image(dev, image, x, y, right, bottom, line_length, bpp, clear_dirty);
+
+    rpusbdisp_stat_record(&dev->stats, RPUSBDISP_HIST_ENCODE_NS, ktime_get_ns() - start);
+    return ret;
+}
 
+int rpusbdisp_usb_try_send_mono(struct rpusbdisp_dev * dev, const void * bitmap, int x, int y, int right, int bottom, int line_length,
+    pixel_type_t fg, pixel_type_t bg)
+{
+    u64 start = ktime_get_ns();
+    int ret = _bitblt_send_mono(dev, bitmap, x, y, right, bottom, line_length, fg, bg);
 
+    rpusbdisp_stat_record(&dev->stats, RPUSBDISP_HIST_ENCODE_NS, ktime_get_ns() - start);
+    return ret;
 }
 
 static void _on_release_disp_tickets_pool(struct rpusbdisp_dev * dev)
 {
-    unsigned long irq_flags;
     struct rpusbdisp_disp_ticket * ticket;
-    struct list_head *node;
     int tickets_count = dev->disp_tickets_pool.disp_urb_count;
-    DEFINE_WAIT(wait);
     
     dev_info(&dev->interface->dev, "waiting for all tickets to be finished...\n");
 
-    
+    // no ticket is sold once the device is dead, wait for the submitted ones to come back
+    while (atomic_read(&dev->disp_tickets_pool.availiable_count) != tickets_count) {
+        wait_event_timeout(dev->disp_tickets_pool.wait_queue,
+            atomic_read(&dev->disp_tickets_pool.availiable_count) == tickets_count, 2*HZ);
+    }
 
     while(tickets_count) {
-        
-        spin_lock_irqsave(&dev->disp_tickets_pool.oplock, irq_flags);
-        if (dev->disp_tickets_pool.availiable_count) {
-            --dev->disp_tickets_pool.availiable_count;
-        } else {
-            spin_unlock_irqrestore(&dev->disp_tickets_pool.oplock,irq_flags);
-            // sleep_on_timeout(&dev->disp_tickets_pool.wait_queue, 2*HZ);
-
-            prepare_to_wait(&dev->disp_tickets_pool.wait_queue, &wait, TASK_UNINTERRUPTIBLE);
-            schedule_timeout(2*HZ);
-            finish_wait(&dev->disp_tickets_pool.wait_queue, &wait);
-            continue;
-        }
-        node = dev->disp_tickets_pool.list.next;
-        list_del_init(node);
-        spin_unlock_irqrestore(&dev->disp_tickets_pool.oplock,irq_flags);
-
-        ticket = list_entry(node, struct rpusbdisp_disp_ticket, ticket_list_node);
+        ticket = dev->disp_tickets_pool.tickets[--tickets_count];
+        dev->disp_tickets_pool.tickets[tickets_count] = NULL;
       
 		usb_free_coherent(ticket->transfer_urb->dev, RPUSBDISP_MAX_TRANSFER_SIZE,
 				  ticket->transfer_urb->transfer_buffer, ticket->transfer_urb->transfer_dma);
 
         usb_free_urb(ticket->transfer_urb);
         kfree(ticket);
-        --tickets_count;
     }
 
 }
@@ -883,9 +1808,9 @@ static int _on_alloc_disp_tickets_pool(struct rpusbdisp_dev * dev)
     packet_size_factor = (RPUSBDISP_MAX_TRANSFER_SIZE/dev->disp_out_ep_max_size) ;
     ticket_logic_size = packet_size_factor * dev->disp_out_ep_max_size ;
 
-    
-    spin_lock_init(&dev->disp_tickets_pool.oplock);
-    INIT_LIST_HEAD(&dev->disp_tickets_pool.list);
+    BUILD_BUG_ON(RPUSBDISP_MAX_TRANSFER_TICKETS_COUNT > BITS_PER_LONG);
+
+    dev->disp_tickets_pool.free_map = 0;
 
     while(actual_allocated < RPUSBDISP_MAX_TRANSFER_TICKETS_COUNT) {
         newborn = kzalloc(sizeof(struct rpusbdisp_disp_ticket), GFP_KERNEL);
@@ -916,11 +1841,13 @@ static int _on_alloc_disp_tickets_pool(struct rpusbdisp_dev * dev)
 
         
         newborn->binded_dev = dev;
+        newborn->index = actual_allocated;
 
         dev_info(&dev->interface->dev, "allocated ticket %p with urb %p\n", newborn, newborn->transfer_urb);
 
 
-        list_add_tail(&newborn->ticket_list_node, &dev->disp_tickets_pool.list);
+        dev->disp_tickets_pool.tickets[actual_allocated] = newborn;
+        set_bit(actual_allocated, &dev->disp_tickets_pool.free_map);
 
         ++actual_allocated;
         
@@ -928,24 +1855,72 @@ static int _on_alloc_disp_tickets_pool(struct rpusbdisp_dev * dev)
 
     INIT_DELAYED_WORK(&dev->disp_tickets_pool.completion_work, _on_display_transfer_finished_delaywork);
 
+    mutex_init(&dev->disp_batch.lock);
+    INIT_DELAYED_WORK(&dev->disp_batch.flush_work, _batch_flush_delaywork);
+
     init_waitqueue_head(&dev->disp_tickets_pool.wait_queue);
     dev->disp_tickets_pool.disp_urb_count = actual_allocated;
-    dev->disp_tickets_pool.availiable_count = actual_allocated;
+    atomic_set(&dev->disp_tickets_pool.availiable_count, actual_allocated);
     dev->disp_tickets_pool.packet_size_factor = packet_size_factor;
     dev_info(&dev->interface->dev, "allocated %d urb tickets for transfering display data. %lu size each\n", actual_allocated, ticket_logic_size);
 
     return actual_allocated?0:-ENOMEM;
 };
 
+static ssize_t _show_bitblt_stats(struct device * d, struct device_attribute * attr, char * buf)
+{
+    struct rpusbdisp_dev * dev = usb_get_intfdata(to_usb_interface(d));
+
+    if (!dev) return -ENODEV;
+
+    return sprintf(buf, "rle %lld\nraw %lld\nbytes_saved %lld\nzero_copy %lld\n",
+                   (long long)stathandler_read(&dev->stats, RPUSBDISP_STAT_BITBLT_RLE),
+                   (long long)stathandler_read(&dev->stats, RPUSBDISP_STAT_BITBLT_RAW),
+                   (long long)(stathandler_read(&dev->stats, RPUSBDISP_STAT_BITBLT_BYTES_IN) - stathandler_read(&dev->stats, RPUSBDISP_STAT_BITBLT_BYTES_OUT)),
+                   (long long)stathandler_read(&dev->stats, RPUSBDISP_STAT_BITBLT_ZERO_COPY));
+}
+
+static DEVICE_ATTR(bitblt_stats, S_IRUGO, _show_bitblt_stats, NULL);
+
+static ssize_t _show_perf_stats(struct device * d, struct device_attribute * attr, char * buf)
+{
+    struct rpusbdisp_dev * dev = usb_get_intfdata(to_usb_interface(d));
+
+    if (!dev) return -ENODEV;
+
+    return stathandler_show_summary(&dev->stats, buf);
+}
+
+static DEVICE_ATTR(perf_stats, S_IRUGO, _show_perf_stats, NULL);
+
+static ssize_t _show_wake_latency(struct device * d, struct device_attribute * attr, char * buf)
+{
+    struct rpusbdisp_dev * dev = usb_get_intfdata(to_usb_interface(d));
+
+    if (!dev) return -ENODEV;
+
+    return sprintf(buf, "count %lld\nlast_us %lld\nmax_us %lld\n",
+                   (long long)atomic64_read(&dev->wake_count),
+                   (long long)atomic64_read(&dev->wake_latency_last_us),
+                   (long long)atomic64_read(&dev->wake_latency_max_us));
+}
+
+static DEVICE_ATTR(wake_latency, S_IRUGO, _show_wake_latency, NULL);
+
+
 static int _on_new_usb_device(struct rpusbdisp_dev * dev)
 {
     // the rp-usb-display device has been verified
     mutex_init(&dev->op_locker);
+    mutex_init(&dev->pm_lock);
     init_waitqueue_head(&dev->status_wait_queue);
 	
+    if (stathandler_on_new_device(&dev->stats, dev_name(&dev->interface->dev))) {
+        dev_info(&dev->interface->dev, "Cannot allocate the performance counters.\n");
+        goto stats_alloc_fail;
+    }
 
-    dev->urb_status_query = usb_alloc_urb(0, GFP_KERNEL);
-    if (! dev->urb_status_query) {
+    if (_alloc_status_urbs(dev)) {
         dev_info(&dev->interface->dev, "Cannot allocate status query urbs.\n");
         goto status_urb_alloc_fail;
     }
@@ -960,6 +1935,19 @@ static int _on_new_usb_device(struct rpusbdisp_dev * dev)
     dev->dev_id = rpusbdisp_usb_get_device_count();
     dev->is_alive = 1;
     dev->device_fwver = le16_to_cpu(dev->udev->descriptor.bcdDevice);
+    dev->disp_sg_capable = dev->udev->bus->sg_tablesize > 0 && dev->udev->bus->no_sg_constraint;
+
+    if (device_create_file(&dev->interface->dev, &dev_attr_bitblt_stats)) {
+        dev_warn(&dev->interface->dev, "Cannot create the bitblt_stats attribute.\n");
+    }
+
+    if (device_create_file(&dev->interface->dev, &dev_attr_wake_latency)) {
+        dev_warn(&dev->interface->dev, "Cannot create the wake_latency attribute.\n");
+    }
+
+    if (device_create_file(&dev->interface->dev, &dev_attr_perf_stats)) {
+        dev_warn(&dev->interface->dev, "Cannot create the perf_stats attribute.\n");
+    }
 
     dev_info(&dev->interface->dev, "RP USB Display found (#%d), Firmware Version: %d.%02d, S/N: %s\n", 
                                 dev->dev_id, 
@@ -971,37 +1959,68 @@ static int _on_new_usb_device(struct rpusbdisp_dev * dev)
     // start status querying...
     _status_start_querying(dev);
 
-    fbhandler_on_new_device(dev);
-    touchhandler_on_new_device(dev);
+    if (fbhandler_on_new_device(dev)) {
+        dev_warn(&dev->interface->dev, "Cannot create the framebuffer.\n");
+    }
+
+    if (touchhandler_on_new_device(dev)) {
+        dev_warn(&dev->interface->dev, "Cannot create the touch input device.\n");
+    }
 
 
     // force all the image to be flush
     fbhandler_set_unsync_flag(dev);
     schedule_delayed_work(&dev->disp_tickets_pool.completion_work, 0);
+
+    if (autosuspend > 0) {
+        // touch wakes the display up if it supports remote wakeup, otherwise touch is not reported while suspended
+        dev->interface->needs_remote_wakeup = device_can_wakeup(&dev->udev->dev);
+        pm_runtime_set_autosuspend_delay(&dev->udev->dev, autosuspend * 1000);
+        usb_enable_autosuspend(dev->udev);
+    }
     return 0;
 
 disp_tickets_alloc_fail:
-    usb_free_urb(dev->urb_status_query);
+    _free_status_urbs(dev);
 
 status_urb_alloc_fail:
+    stathandler_on_remove_device(&dev->stats);
+
+stats_alloc_fail:
     return -ENOMEM;
 }
 
 
 static void _on_del_usb_device(struct rpusbdisp_dev * dev)
 {
+    int pos;
 
     mutex_lock(&dev->op_locker);
     dev->is_alive = 0;
     mutex_unlock(&dev->op_locker);
+
+    // an encoder waiting for its next ticket gives up now
+    wake_up(&dev->disp_tickets_pool.wait_queue);
     
+    device_remove_file(&dev->interface->dev, &dev_attr_bitblt_stats);
+    device_remove_file(&dev->interface->dev, &dev_attr_wake_latency);
+    device_remove_file(&dev->interface->dev, &dev_attr_perf_stats);
+
+    // kill all pending urbs, so no touch event or ticket completion
+    // can reach the input and fb devices released below. The poisoned
+    // status urbs cannot be submitted again by a running recovery
+    for (pos = 0; pos < RPUSBDISP_STATUS_URB_COUNT; ++pos) {
+        usb_poison_urb(dev->urb_status_query[pos]);
+    }
+    cancel_delayed_work_sync(&dev->status_recovery_work);
+    cancel_delayed_work_sync(&dev->disp_tickets_pool.completion_work);
+
     touchhandler_on_remove_device(dev);
     fbhandler_on_remove_device(dev);
 
-    // kill all pending urbs
-    usb_kill_urb(dev->urb_status_query);
-    cancel_delayed_work_sync(&dev->disp_tickets_pool.completion_work);
-
+    // send (or give back the ticket of) the queued commands
+    cancel_delayed_work_sync(&dev->disp_batch.flush_work);
+    _batch_flush(dev);
 
 
     
@@ -1010,9 +2029,19 @@ static void _on_del_usb_device(struct rpusbdisp_dev * dev)
 
     
     _on_release_disp_tickets_pool(dev);
+
+    // the last tickets back, e.g. the batch flushed above, may have scheduled the completion work again
+    cancel_delayed_work_sync(&dev->disp_tickets_pool.completion_work);
    
-    usb_free_urb(dev->urb_status_query);
-    dev->urb_status_query = NULL;
+    vfree(dev->rle_planner);
+    dev->rle_planner = NULL;
+
+    vfree(dev->convert_buffer);
+    dev->convert_buffer = NULL;
+
+    _free_status_urbs(dev);
+
+    stathandler_on_remove_device(&dev->stats);
      
     dev_info(&dev->interface->dev, "RP USB Display (#%d) now disconnected\n", dev->dev_id);
 }
@@ -1128,21 +2157,79 @@ static void lcd_draw_down(struct usb_lcd *dev)
 
 static int rpusbdisp_suspend(struct usb_interface *intf, pm_message_t message)
 {
-	struct usb_lcd *dev = usb_get_intfdata(intf);
+	struct rpusbdisp_dev *dev = usb_get_intfdata(intf);
+    int pos;
 
 	if (!dev)
 		return 0;
-    // not implemented yet
+
+    // waits for the update worker to finish its round
+    mutex_lock(&dev->pm_lock);
+
+    // the queued commands go out, the display keeps what it has got
+    cancel_delayed_work_sync(&dev->disp_batch.flush_work);
+    _batch_flush(dev);
+
+    if (!wait_event_timeout(dev->disp_tickets_pool.wait_queue, rpusbdisp_usb_is_idle(dev),
+                            msecs_to_jiffies(RPUSBDISP_SUSPEND_DRAIN_TIMEOUT_MS)))
+    {
+        if (PMSG_IS_AUTO(message)) {
+            // tried again after the autosuspend delay
+            mutex_unlock(&dev->pm_lock);
+            return -EBUSY;
+        }
+
+        // system sleep cannot be refused, the killed transfers mark the display unsynced
+        for (pos = 0; pos < dev->disp_tickets_pool.disp_urb_count; ++pos) {
+            usb_kill_urb(dev->disp_tickets_pool.tickets[pos]->transfer_urb);
+        }
+    }
+
+    dev->pm_suspended = 1;
+    dev->pm_system_sleep = !PMSG_IS_AUTO(message);
+    atomic_set(&dev->wake_pending, 0);
+
+    cancel_delayed_work_sync(&dev->status_recovery_work);
+    for (pos = 0; pos < RPUSBDISP_STATUS_URB_COUNT; ++pos) {
+        usb_kill_urb(dev->urb_status_query[pos]);
+    }
+
+    mutex_unlock(&dev->pm_lock);
 	return 0;
 }
 
 
 static int rpusbdisp_resume (struct usb_interface *intf)
 {
-    // not implemented yet
+	struct rpusbdisp_dev *dev = usb_get_intfdata(intf);
+
+	if (!dev)
+		return 0;
+
+    mutex_lock(&dev->pm_lock);
+    dev->pm_suspended = 0;
+    dev->pm_system_sleep = 0;
+    mutex_unlock(&dev->pm_lock);
+
+    atomic_set(&dev->urb_status_fail_count, 0);
+    atomic_set(&dev->status_recovery_attempts, 0);
+    _status_start_querying(dev);
+
+    // the display still shows the image it had, only the damage recorded meanwhile is sent
+    schedule_delayed_work(&dev->disp_tickets_pool.completion_work, 0);
 	return 0;
 }
 
+static int rpusbdisp_reset_resume(struct usb_interface *intf)
+{
+	struct rpusbdisp_dev *dev = usb_get_intfdata(intf);
+
+    // the display has been reset and lost its image
+    if (dev) fbhandler_set_unsync_flag(dev);
+
+	return rpusbdisp_resume(intf);
+}
+
 static void rpusbdisp_disconnect(struct usb_interface *interface)
 {
 	struct rpusbdisp_dev *dev;
@@ -1161,8 +2248,9 @@ static struct usb_driver usbdisp_driver = {
 	.disconnect =  rpusbdisp_disconnect,
 	.suspend    =  rpusbdisp_suspend,
 	.resume     =  rpusbdisp_resume,
+	.reset_resume = rpusbdisp_reset_resume,
 	.id_table   =  id_table,
-	.supports_autosuspend = 0,
+	.supports_autosuspend = 1,
 };
 
 int __init register_usb_handlers(void)
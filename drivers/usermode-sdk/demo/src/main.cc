@@ -18,6 +18,8 @@
 #	include <unistd.h>
 #endif
 #include <math.h>
+#include <thread>
+#include <chrono>
 #include <stdlib.h>
 #include <rp/infra_config.h>
 #include <rp/deps/libusbx_wrap/libusbx_wrap.h>
@@ -57,6 +59,8 @@ static int cPlusPlusInterfaceDemo(void* framebuffer) {
             display->bitblt(0, 0, 320, 240, RoboPeakUsbDisplayBitOperationCopy, framebuffer);
             this_thread::sleep_for(chrono::seconds(2));
             
+            // send the rectangles in a few transfers instead of one transfer each
+            display->setBatchMode(true);
             for (int i = 0; i < 100; i++) {
                 uint16_t x = rand()%320;
                 uint16_t y = rand()%240;
@@ -67,6 +71,8 @@ static int cPlusPlusInterfaceDemo(void* framebuffer) {
                 
                 display->fillrect(x, y, x + width, y + height, color, bitOperation);
             }
+            display->setBatchMode(false);
+            display->flush();
             this_thread::sleep_for(chrono::seconds(2));
             
             display->copyArea(0, 0, 160, 120, 160, 120);
@@ -9,6 +9,7 @@
 #pragma once
 
 #include <memory>
+#include <functional>
 #include <rp/util/noncopyable.h>
 #include <rp/deps/libusbx_wrap/enums.h>
 
@@ -33,8 +34,17 @@ namespace rp { namespace deps { namespace libusbx_wrap {
         ~Transfer();
         
         void setTransferBuffer(std::shared_ptr<rp::util::Buffer> buffer);
+        void setTransferBuffer(std::shared_ptr<rp::util::Buffer> buffer, size_t length);
         std::shared_ptr<rp::util::Buffer> getTransferBuffer();
         
+        /**
+         * \brief Set a callback to be invoked once the transfer is completed
+         *
+         * The callback is invoked from the thread handling libusb events, so it should return quickly.
+         * The callback is kept across submissions, so a completed transfer can be recycled by simply submitting it again.
+         */
+        void setCompletionCallback(std::function<void(TransferStatus)> callback);
+        
         void submit();
         void waitForCompletion();
         TransferStatus getStatus();
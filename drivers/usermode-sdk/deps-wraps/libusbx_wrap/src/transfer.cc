@@ -37,13 +37,21 @@ namespace rp { namespace deps { namespace libusbx_wrap {
         }
     
         void setTransferBuffer(shared_ptr<Buffer> transferBuffer) {
+            setTransferBuffer(transferBuffer, transferBuffer->size());
+        }
+        
+        void setTransferBuffer(shared_ptr<Buffer> transferBuffer, size_t length) {
+            if (length > transferBuffer->size()) {
+                throw Exception(-1, "Transfer length exceeds the transfer buffer");
+            }
+            
             releaseTransferBuffer_();
             
             transferBuffer_ = transferBuffer;
             if (transferBuffer) {
                 handle_->buffer = (uint8_t*)transferBuffer->lock();
             }
-            handle_->length = (int)transferBuffer->size();
+            handle_->length = (int)length;
         }
         
         shared_ptr<Buffer> getTransferBuffer() {
@@ -55,6 +63,12 @@ namespace rp { namespace deps { namespace libusbx_wrap {
                 handle_->user_data = new weak_ptr<TransferImpl>(shared_from_this());
             }
             
+            {
+                // a transfer can be submitted again once it is completed
+                lock_guard<mutex> guard(conditionLock_);
+                completion_ = false;
+            }
+            
             int result = libusb_submit_transfer(handle_);
             
             if (result) {
@@ -68,6 +82,10 @@ namespace rp { namespace deps { namespace libusbx_wrap {
             this->completion_ = false;
         }
         
+        void setCompletionCallback(function<void(TransferStatus)> callback) {
+            completionCallback_ = callback;
+        }
+        
         TransferStatus getStatus() {
             switch (handle_->status) {
                 case LIBUSB_TRANSFER_COMPLETED:
@@ -105,6 +123,10 @@ namespace rp { namespace deps { namespace libusbx_wrap {
                 completion_ = true;
             }
             condition_.notify_one();
+            
+            if (completionCallback_) {
+                completionCallback_(getStatus());
+            }
         }
         
         bool isCompleted_() {
@@ -125,6 +147,7 @@ namespace rp { namespace deps { namespace libusbx_wrap {
         mutex conditionLock_;
         condition_variable condition_;
         bool completion_;
+        function<void(TransferStatus)> completionCallback_;
         
         shared_ptr<DeviceHandle> deviceHandle_;
         shared_ptr<Buffer> transferBuffer_;
@@ -138,10 +161,18 @@ namespace rp { namespace deps { namespace libusbx_wrap {
         impl_->setTransferBuffer(buffer);
     }
     
+    void Transfer::setTransferBuffer(shared_ptr<Buffer> buffer, size_t length) {
+        impl_->setTransferBuffer(buffer, length);
+    }
+    
     shared_ptr<Buffer> Transfer::getTransferBuffer() {
         return impl_->getTransferBuffer();
     }
     
+    void Transfer::setCompletionCallback(function<void(TransferStatus)> callback) {
+        impl_->setCompletionCallback(callback);
+    }
+    
     void Transfer::submit() {
         impl_->submit();
     }
@@ -34,6 +34,16 @@ namespace rp { namespace util {
          */
         Buffer(size_t size);
         
+        /**
+         * \brief Create a buffer whose memory starts at an aligned address
+         *
+         * Same as Buffer(size_t), but the memory area is aligned to alignment bytes (e.g. the page size for buffers handed over to DMA).
+         *
+         * \param size The size of the buffer
+         * \param alignment The alignment of the memory area, should be a power of 2 and a multiple of sizeof(void*)
+         */
+        Buffer(size_t size, size_t alignment);
+        
         /**
          * \brief Create a buffer by cloning another buffer
          *
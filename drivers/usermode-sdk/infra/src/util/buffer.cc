@@ -12,22 +12,26 @@
 #include <rp/util/buffer.h>
 #include <rp/util/exception.h>
 
+#if defined(RP_INFRA_PLATFORM_WINDOWS)
+#   include <malloc.h>
+#endif
+
 using namespace std;
 
 namespace rp { namespace util {
     
     class BufferImpl {
     public:
-        BufferImpl(size_t size) : size_(size) {
-            nakedBuffer_ = malloc(size);
+        BufferImpl(size_t size, size_t alignment) : size_(size), alignment_(alignment) {
+            nakedBuffer_ = allocate_(size_, alignment_);
             
             if (!nakedBuffer_) {
                 throw Exception(-1, "Failed to alloc buffer");
             }
         }
         
-        BufferImpl(const BufferImpl& that) : size_(that.size_) {
-            nakedBuffer_ = malloc(size_);
+        BufferImpl(const BufferImpl& that) : size_(that.size_), alignment_(that.alignment_) {
+            nakedBuffer_ = allocate_(size_, alignment_);
             
             if (!nakedBuffer_) {
                 throw Exception(-1, "Failed to alloc buffer");
@@ -40,7 +44,7 @@ namespace rp { namespace util {
             lock_guard<mutex> guard(lock_);
             
             if (nakedBuffer_) {
-                free(nakedBuffer_);
+                release_(nakedBuffer_, alignment_);
                 nakedBuffer_ = 0;
             }
         }
@@ -62,12 +66,39 @@ namespace rp { namespace util {
         }
         
     private:
+        static void* allocate_(size_t size, size_t alignment) {
+            if (!alignment) {
+                return malloc(size);
+            }
+
+#if defined(RP_INFRA_PLATFORM_WINDOWS)
+            return _aligned_malloc(size, alignment);
+#else
+            void* buffer;
+            return posix_memalign(&buffer, alignment, size) ? 0 : buffer;
+#endif
+        }
+        
+        static void release_(void* buffer, size_t alignment) {
+#if defined(RP_INFRA_PLATFORM_WINDOWS)
+            if (alignment) {
+                _aligned_free(buffer);
+                return;
+            }
+#else
+            (void)alignment;
+#endif
+            free(buffer);
+        }
+        
         mutex lock_;
         void* nakedBuffer_;
         size_t size_;
+        size_t alignment_;
     };
     
-    Buffer::Buffer(size_t size) : impl_(new BufferImpl(size)) {}
+    Buffer::Buffer(size_t size) : impl_(new BufferImpl(size, 0)) {}
+    Buffer::Buffer(size_t size, size_t alignment) : impl_(new BufferImpl(size, alignment)) {}
     Buffer::Buffer(const Buffer& that) : impl_(new BufferImpl(*that.impl_)) {}
     Buffer::~Buffer() {}
     
@@ -9,6 +9,7 @@
 #pragma once
 
 #include <rp/infra_config.h>
+#include <stddef.h>
 #include <rp/util/int_types.h>
 #include <rp/drivers/display/rpusbdisp/protocol.h>
 #include <rp/drivers/display/rpusbdisp/enums.h>
@@ -33,6 +34,13 @@ extern "C" {
      */
     typedef struct rp_usbdisp_device* RoboPeakUsbDisplayDeviceRef;
     
+    struct rp_usbdisp_surface;
+    
+    /**
+     * \brief A reference to a damage tracking framebuffer of a RoboPeak Usb Display Device
+     */
+    typedef struct rp_usbdisp_surface* RoboPeakUsbDisplaySurfaceRef;
+    
     /**
      * \brief The type of callbacks will be triggered when the status of the display is updated
      */
@@ -118,6 +126,43 @@ extern "C" {
      */
 	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayCopyArea(RoboPeakUsbDisplayDeviceRef device, uint16_t srcX, uint16_t srcY, uint16_t destX, uint16_t destY, uint16_t width, uint16_t height);
     
+    /**
+     * \brief Select how bitblt compresses images when the device supports RLE
+     *
+     * \param device The display device
+     * \param mode RoboPeakUsbDisplayRleModeGreedy (default) or RoboPeakUsbDisplayRleModeOptimal which sends less data but takes more CPU time
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySetRleMode(RoboPeakUsbDisplayDeviceRef device, RoboPeakUsbDisplayRleMode mode);
+    
+    /**
+     * \brief Let the drawing functions return once their commands are submitted
+     *
+     * In async mode the drawing functions do not wait for the device to receive the command, the failures are reported by RoboPeakUsbDisplayFlush
+     *
+     * \param device The display device
+     * \param enabled Enable or disable async mode
+     * \param maxPendingCommands The max commands submitted but not completed yet
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySetAsyncMode(RoboPeakUsbDisplayDeviceRef device, bool enabled, int maxPendingCommands);
+    
+    /**
+     * \brief Enable or disable batch mode
+     *
+     * In batch mode consecutive commands are packed into a single USB transfer, which is sent when it is full, when the oldest command
+     * has been queued for maxDelayMs, or when RoboPeakUsbDisplayFlush is invoked. Failures are reported by RoboPeakUsbDisplayFlush
+     *
+     * \param device The display device
+     * \param enabled Enable or disable batch mode
+     * \param maxDelayMs The max time a command can be queued (in milliseconds)
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySetBatchMode(RoboPeakUsbDisplayDeviceRef device, bool enabled, int maxDelayMs);
+    
+    /**
+     * \brief Send the queued commands and wait until all submitted commands are completed
+     *
+     * \param device The display device
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayFlush(RoboPeakUsbDisplayDeviceRef device);
     
     /**
      * \brief Enable the device
@@ -144,6 +189,66 @@ extern "C" {
      */
 	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayIsAlive(RoboPeakUsbDisplayDeviceRef device, bool* outAlive);
 
+    /**
+     * \brief Create a damage tracking framebuffer covering the whole screen of a display
+     *
+     * The drawing functions of the surface only update a local copy of the screen, RoboPeakUsbDisplaySurfacePresent sends what has changed since the last call
+     *
+     * \param device The display device
+     * \param outSurface [out] A pointer to RoboPeakUsbDisplaySurfaceRef to store the new surface
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayCreateSurface(RoboPeakUsbDisplayDeviceRef device, RoboPeakUsbDisplaySurfaceRef* outSurface);
+    
+    /**
+     * \brief Dispose a surface
+     *
+     * \param surface The surface to dispose
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayDisposeSurface(RoboPeakUsbDisplaySurfaceRef surface);
+    
+    /**
+     * \brief Get the local copy of the screen, changes made through it should be reported with RoboPeakUsbDisplaySurfaceMarkDirty
+     *
+     * \param surface The surface
+     * \param outPixels [out] The first pixel, each pixel is in B5G6R5 format
+     * \param outStride [out] Bytes between the beginnings of two adjacent rows
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceGetPixels(RoboPeakUsbDisplaySurfaceRef surface, uint16_t** outPixels, size_t* outStride);
+    
+    /**
+     * \brief Report an area changed through the pixels returned by RoboPeakUsbDisplaySurfaceGetPixels
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceMarkDirty(RoboPeakUsbDisplaySurfaceRef surface, int x, int y, int width, int height);
+    
+    /**
+     * \brief Fill a rectangle of the surface with a solid color
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceFillRect(RoboPeakUsbDisplaySurfaceRef surface, int x, int y, int width, int height, uint16_t color);
+    
+    /**
+     * \brief Copy an image (width*height B5G6R5 pixels) into the surface
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceDrawImage(RoboPeakUsbDisplaySurfaceRef surface, int x, int y, int width, int height, const void* pixels);
+    
+    /**
+     * \brief Replace the whole surface with a new frame, only the areas that differ from the previous frame will be sent by RoboPeakUsbDisplaySurfacePresent
+     *
+     * \param surface The surface
+     * \param pixels The first pixel of the frame, each pixel should be in B5G6R5 format
+     * \param stride Bytes between the beginnings of two adjacent rows of the frame, 0 if the rows are adjacent in memory
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceDrawFrame(RoboPeakUsbDisplaySurfaceRef surface, const void* pixels, size_t stride);
+    
+    /**
+     * \brief Copy a part of the surface to another position
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceCopyArea(RoboPeakUsbDisplaySurfaceRef surface, int srcX, int srcY, int destX, int destY, int width, int height);
+    
+    /**
+     * \brief Send the changes made since the last call to the display
+     */
+	extern RP_INFRA_API RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfacePresent(RoboPeakUsbDisplaySurfaceRef surface);
+
 #ifdef __cplusplus
 }
 #endif
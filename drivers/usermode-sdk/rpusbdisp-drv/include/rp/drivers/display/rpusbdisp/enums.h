@@ -14,3 +14,8 @@ enum RoboPeakUsbDisplayBitOperation {
     RoboPeakUsbDisplayBitOperationOr = 2,
     RoboPeakUsbDisplayBitOperationAnd = 3
 };
+
+enum RoboPeakUsbDisplayRleMode {
+    RoboPeakUsbDisplayRleModeGreedy = 0,
+    RoboPeakUsbDisplayRleModeOptimal = 1
+};
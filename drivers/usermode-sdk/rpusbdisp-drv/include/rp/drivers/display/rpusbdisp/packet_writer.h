@@ -0,0 +1,128 @@
+//
+//  packet_writer.h
+//  Writer of the packetized display command stream
+//
+//  Copyright (c) 2013 RoboPeak.com. All rights reserved.
+//
+
+#pragma once
+
+#include <string.h>
+#include <rp/util/int_types.h>
+#include <rp/drivers/display/rpusbdisp/protocol.h>
+
+namespace rp { namespace drivers { namespace display {
+
+    /**
+     * \brief Lay a display command out as endpoint packets while it is being written
+     *
+     * Every packet sent to the display endpoint starts with the command header byte, and the command body is split into
+     * the rest of the packets. PacketWriter writes the command body straight into the final transfer buffer and inserts
+     * the packet headers on the fly, so no intermediate copy of the command is needed. A packet is only started when a
+     * body byte goes into it, so a command which exactly fills its last packet is not followed by a header-only packet.
+     *
+     * The caller is responsible for providing a buffer large enough, see PacketWriter::estimateTransferSize
+     */
+    class PacketWriter {
+    public:
+        /**
+         * \brief Start a new command
+         *
+         * \param buffer The transfer buffer
+         * \param packetSize The max packet size of the display endpoint
+         * \param cmdFlag The command header byte, RPUSBDISP_CMD_FLAG_START will be added to the first packet
+         */
+        PacketWriter(void* buffer, size_t packetSize, _u8 cmdFlag)
+        : begin_((_u8*)buffer), pos_((_u8*)buffer), packetSize_(packetSize), cmdFlag_(cmdFlag)
+        {
+            nextPacket_();
+            *begin_ |= RPUSBDISP_CMD_FLAG_START;
+        }
+        
+        /**
+         * \brief Append one byte to the command body
+         */
+        void put(_u8 data) {
+            *reserve() = data;
+        }
+        
+        /**
+         * \brief Reserve one byte in the command body and return its address so it can be filled later
+         */
+        _u8* reserve() {
+            if (pos_ == packetEnd_) {
+                nextPacket_();
+            }
+            return pos_++;
+        }
+        
+        /**
+         * \brief Append data to the command body
+         */
+        void write(const void* data, size_t size) {
+            const _u8* src = (const _u8*)data;
+            
+            while (size) {
+                if (pos_ == packetEnd_) {
+                    nextPacket_();
+                }
+                
+                size_t chunk = (size_t)(packetEnd_ - pos_);
+                if (chunk > size)
+                    chunk = size;
+                
+                memcpy(pos_, src, chunk);
+                pos_ += chunk;
+                src += chunk;
+                size -= chunk;
+            }
+        }
+        
+        /**
+         * \brief Append a command packet struct, excluding its header byte which has been written by the constructor
+         */
+        template<typename PacketT>
+        void writeCommand(const PacketT& packet) {
+            write((const _u8*)&packet + sizeof(rpusbdisp_disp_packet_header_t), sizeof(PacketT) - sizeof(rpusbdisp_disp_packet_header_t));
+        }
+        
+        /**
+         * \brief The header byte of the first packet, used to set extra flags like RPUSBDISP_CMD_FLAG_CLEARDITY
+         */
+        _u8& firstHeader() {
+            return *begin_;
+        }
+        
+        /**
+         * \brief Bytes written into the transfer buffer so far (including packet headers)
+         */
+        size_t size() const {
+            return (size_t)(pos_ - begin_);
+        }
+        
+        /**
+         * \brief The transfer buffer size required by a command body of bodySize bytes (excluding the first header byte)
+         *
+         * Every started packet carries at least one body byte, except the first one of an empty command
+         */
+        static size_t estimateTransferSize(size_t bodySize, size_t packetSize) {
+            size_t payloadPerPacket = packetSize - sizeof(rpusbdisp_disp_packet_header_t);
+            size_t packetCount = bodySize ? (bodySize + payloadPerPacket - 1) / payloadPerPacket : 1;
+            
+            return bodySize + packetCount * sizeof(rpusbdisp_disp_packet_header_t);
+        }
+    
+    private:
+        void nextPacket_() {
+            *pos_++ = cmdFlag_;
+            packetEnd_ = pos_ + packetSize_ - 1;
+        }
+        
+        _u8* begin_;
+        _u8* pos_;
+        _u8* packetEnd_;
+        size_t packetSize_;
+        _u8 cmdFlag_;
+    };
+
+}}}
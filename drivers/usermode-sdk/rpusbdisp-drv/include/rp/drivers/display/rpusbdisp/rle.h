@@ -9,6 +9,10 @@
 #pragma once
 
 #include <memory>
+#include <vector>
+#include <stddef.h>
+#include <rp/util/int_types.h>
+#include <rp/drivers/display/rpusbdisp/enums.h>
 
 namespace rp { namespace util {
 
@@ -18,9 +22,46 @@ namespace rp { namespace util {
 
 namespace rp { namespace drivers { namespace display {
     
+    class PacketWriter;
+    
     /**
      * Compress data with RLE algorithm and return the compressed data
      */
-    std::shared_ptr<rp::util::Buffer> rleCompress(std::shared_ptr<rp::util::Buffer> buffer);
+    std::shared_ptr<rp::util::Buffer> rleCompress(std::shared_ptr<rp::util::Buffer> buffer, RoboPeakUsbDisplayRleMode mode = RoboPeakUsbDisplayRleModeGreedy);
     
+    /**
+     * \brief Compress an image with RLE algorithm directly into a display command
+     *
+     * The pixels are read in place (row by row, honoring the stride) and the compressed stream is appended to the writer,
+     * so no temporary buffer is involved.
+     *
+     * \param pixels The first pixel of the image, each pixel should be in B5G6R5 pixel format
+     * \param width The width of the image (in pixels)
+     * \param height The height of the image (in pixels)
+     * \param stride Bytes between the beginnings of two adjacent rows
+     * \param writer The command the compressed data will be appended to
+     * \param mode RoboPeakUsbDisplayRleModeGreedy is the fastest, RoboPeakUsbDisplayRleModeOptimal produces the smallest data
+     * \param plan The scratch memory of RoboPeakUsbDisplayRleModeOptimal (one byte per pixel), it only grows so passing the
+     *             same vector for every image avoids allocating it each time. A temporary one is used if it is null
+     */
+    void rleCompress(const void* pixels, size_t width, size_t height, size_t stride, PacketWriter& writer, RoboPeakUsbDisplayRleMode mode = RoboPeakUsbDisplayRleModeGreedy, std::vector<_u8>* plan = nullptr);
+    
+    /**
+     * \brief The max size of RLE compressed data of pixelCount pixels
+     *
+     * The worst case is 1 extra byte with each 128 pixels (since the 7bit size block can represent 128 uints)
+     */
+    size_t rleEstimateCompressedSize(size_t pixelCount);
+
+    /**
+     * \brief Estimate the RLE compressed size of an image by compressing a few evenly spaced rows only
+     *
+     * \param pixels The first pixel of the image, each pixel should be in B5G6R5 pixel format
+     * \param width The width of the image (in pixels)
+     * \param height The height of the image (in pixels)
+     * \param stride Bytes between the beginnings of two adjacent rows
+     * \param sampleRows The max rows to be compressed, all rows are compressed if the image is not higher than this
+     */
+    size_t rleEstimateSampledSize(const void* pixels, size_t width, size_t height, size_t stride, size_t sampleRows);
+
 }}}
@@ -53,6 +53,26 @@ namespace rp { namespace drivers { namespace display {
     
     class RoboPeakUsbDisplayDeviceImpl;
     
+    /**
+     * \brief Statistics of the bitblt operations of a device
+     */
+    struct RoboPeakUsbDisplayBitbltStatistics {
+        /**
+         * \brief Count of the images sent with RLE compression
+         */
+        uint64_t rleBitbltCount;
+        
+        /**
+         * \brief Count of the images sent uncompressed, because the device does not support RLE or the image does not compress well
+         */
+        uint64_t rawBitbltCount;
+        
+        /**
+         * \brief Bytes saved by RLE compression compared with sending the same images uncompressed
+         */
+        int64_t bytesSaved;
+    };
+    
     /**
      * \brief RoboPeak Usb Display Device
      *
@@ -95,8 +115,9 @@ namespace rp { namespace drivers { namespace display {
          * \brief Fill the whole screen with color
          *
          * \param color A 16 bit color represent in B5G6R5 format
+         * \return The completion of the command, see setAsyncMode
          */
-        void fill(uint16_t color);
+        std::shared_future<void> fill(uint16_t color);
         
         /**
          * \brief Draw image to the display
@@ -107,8 +128,20 @@ namespace rp { namespace drivers { namespace display {
          * \param height The height of the image
          * \param bitOperation The pixel bit operation will be done between the original pixel and the pixel from the image
          * \param buffer The buffer of the image, should be more than (width*height*2) bytes, and each pixel should be in B5G6B5 pixel format
+         * \return The completion of the command, see setAsyncMode
+         */
+        std::shared_future<void> bitblt(uint16_t x, uint16_t y, uint16_t width, uint16_t height, RoboPeakUsbDisplayBitOperation bitOperation, void* buffer);
+        
+        /**
+         * \brief Draw a part of a larger image to the display
+         *
+         * Same as the other bitblt, but the rows of the image do not need to be adjacent in memory
+         *
+         * \param buffer The first pixel of the image, each pixel should be in B5G6B5 pixel format
+         * \param stride Bytes between the beginnings of two adjacent rows of the image
+         * \return The completion of the command, see setAsyncMode
          */
-        void bitblt(uint16_t x, uint16_t y, uint16_t width, uint16_t height, RoboPeakUsbDisplayBitOperation bitOperation, void* buffer);
+        std::shared_future<void> bitblt(uint16_t x, uint16_t y, uint16_t width, uint16_t height, RoboPeakUsbDisplayBitOperation bitOperation, const void* buffer, size_t stride);
         
         /**
          * \brief Fill a rectangle of the display with a solid color
@@ -120,8 +153,9 @@ namespace rp { namespace drivers { namespace display {
          * \param right The right boundry of the rectangle
          * \param bottom The bottom boundry of the rectangle
          * \param bitOperation The pixel bit operation will be done when filling the rectangle
+         * \return The completion of the command, see setAsyncMode
          */
-        void fillrect(uint16_t left, uint16_t top, uint16_t right, uint16_t bottom, uint16_t color, RoboPeakUsbDisplayBitOperation bitOperation);
+        std::shared_future<void> fillrect(uint16_t left, uint16_t top, uint16_t right, uint16_t bottom, uint16_t color, RoboPeakUsbDisplayBitOperation bitOperation);
         
         /**
          * \brief Copy a part of the existing image of the screen to another position of the display
@@ -132,8 +166,62 @@ namespace rp { namespace drivers { namespace display {
          * \param destY Destination y coordinate
          * \param width Width of the copying area
          * \param height Height of the copying area
+         * \return The completion of the command, see setAsyncMode
+         */
+        std::shared_future<void> copyArea(uint16_t srcX, uint16_t srcY, uint16_t destX, uint16_t destY, uint16_t width, uint16_t height);
+        
+        /**
+         * \brief Let the drawing methods return once their commands are submitted
+         *
+         * By default fill, bitblt, fillrect and copyArea wait for the device to receive the command and throw on failure.
+         * In async mode they return as soon as the command is submitted, so the next command can be encoded while the
+         * previous ones are being transmitted, and the returned future tells when the command is done or why it failed.
+         * Commands are always transmitted in the order they are issued.
+         *
+         * A transfer buffer large enough for a full screen image is pre-allocated for each pending command and recycled
+         * once the command is completed, so the drawing methods do not allocate memory for images up to the screen size.
+         *
+         * \param enabled Enable or disable async mode
+         * \param maxPendingCommands The max commands submitted but not completed yet, drawing methods block when the limit is reached
+         */
+        void setAsyncMode(bool enabled, int maxPendingCommands = 4);
+        
+        /**
+         * \brief Pack consecutive commands into a single USB transfer
+         *
+         * Small commands like fillrect and copyArea cost a whole transfer round trip each. In batch mode the drawing
+         * methods only queue their commands (each one still starts with a new packet as the protocol requires) and return,
+         * the queued commands are sent together when no more command fits in the transfer buffer, when the oldest one
+         * has been queued for maxDelayMs, or when flush() is invoked. The returned futures complete with the whole batch.
+         *
+         * \param enabled Enable or disable batch mode, the queued commands are sent when it is disabled
+         * \param maxDelayMs The max time a command can be queued (in milliseconds)
+         */
+        void setBatchMode(bool enabled, int maxDelayMs = 5);
+        
+        /**
+         * \brief Send the queued commands and wait until all submitted commands are completed
+         *
+         * Throws the error of the first command failed since the last flush
+         */
+        void flush();
+        
+        /**
+         * \brief Select how bitblt compresses images when the device supports RLE
+         *
+         * RoboPeakUsbDisplayRleModeGreedy is used by default. RoboPeakUsbDisplayRleModeOptimal takes more CPU time but sends
+         * less data, which helps when the USB bandwidth is the bottleneck.
+         *
+         * \param mode The RLE mode
+         */
+        void setRleMode(RoboPeakUsbDisplayRleMode mode);
+        
+        /**
+         * \brief Get the statistics of bitblt operations
+         *
+         * Each bitblt picks RLE compression or raw pixels by sampling the image, these counters show how often each way was taken
          */
-        void copyArea(uint16_t srcX, uint16_t srcY, uint16_t destX, uint16_t destY, uint16_t width, uint16_t height);
+        RoboPeakUsbDisplayBitbltStatistics getBitbltStatistics() const;
         
         /**
          * \brief Enable the device
@@ -0,0 +1,64 @@
+//
+//  simd.h
+//  Vector instruction sets used by the encoders and the surface of rpusbdisp
+//
+//  Copyright (c) 2013 RoboPeak.com. All rights reserved.
+//
+
+#pragma once
+
+/*
+ The instruction sets are detected at compile time: SSE2 on x86-64 and on x86 built for it, NEON on ARM built for it.
+ AVX2 code is compiled with a per function target attribute, it should only be run when cpuSupportsAvx2() returns true.
+ Each accelerated routine keeps a scalar version for the other targets.
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define RP_USBDISP_SIMD_SSE2
+#   include <emmintrin.h>
+#   if defined(_MSC_VER) || defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#       define RP_USBDISP_SIMD_AVX2
+#       include <immintrin.h>
+#       if defined(_MSC_VER)
+#           include <intrin.h>
+#           define RP_USBDISP_TARGET_AVX2
+#       else
+#           define RP_USBDISP_TARGET_AVX2 __attribute__((target("avx2")))
+#       endif
+#   endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#   define RP_USBDISP_SIMD_NEON
+#   include <arm_neon.h>
+#endif
+
+namespace rp { namespace drivers { namespace display {
+
+#ifdef RP_USBDISP_SIMD_AVX2
+    /**
+     * \brief Check if both the CPU and the OS support AVX2
+     */
+    inline bool cpuSupportsAvx2() {
+#if defined(_MSC_VER)
+        int info[4];
+        
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+        
+        // AVX2 needs the OS to save the YMM registers on context switches
+        __cpuid(info, 1);
+        if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 0x6) != 0x6)
+            return false;
+        
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+#endif
+    }
+#endif
+
+}}}
@@ -0,0 +1,100 @@
+//
+//  surface.h
+//  Damage tracking framebuffer of RoboPeak Mini USB Display
+//
+//  Copyright (c) 2013 RoboPeak.com. All rights reserved.
+//
+
+#pragma once
+
+#include <memory>
+#include <rp/util/noncopyable.h>
+#include <rp/util/int_types.h>
+
+namespace rp { namespace drivers { namespace display {
+
+    class RoboPeakUsbDisplayDevice;
+    class RoboPeakUsbDisplaySurfaceImpl;
+    
+    /**
+     * \brief A local framebuffer which sends only what has changed to the display
+     *
+     * The surface keeps a B5G6R5 shadow copy of the screen. Drawing methods update the shadow copy and remember which
+     * areas have been damaged, pixels written through getPixels() should be reported with markDirty(). present() brings
+     * the display up to date with the fewest commands it can: solid fills and copies are replayed with fillrect and copyArea,
+     * and the other damaged areas are merged into a few rectangles sent with bitblt.
+     *
+     * All coordinates are clipped to the screen.
+     */
+    class RoboPeakUsbDisplaySurface : public rp::util::noncopyable {
+    public:
+        /**
+         * \brief Create a surface covering the whole screen of a display
+         *
+         * The shadow copy is zero filled (black) and completely damaged, so the first present() draws the whole screen
+         */
+        RoboPeakUsbDisplaySurface(std::shared_ptr<RoboPeakUsbDisplayDevice> device);
+        ~RoboPeakUsbDisplaySurface();
+        
+        int getWidth() const;
+        int getHeight() const;
+        
+        /**
+         * \brief The first pixel of the shadow copy, each pixel is in B5G6R5 format
+         */
+        uint16_t* getPixels();
+        
+        /**
+         * \brief Bytes between the beginnings of two adjacent rows of the shadow copy
+         */
+        size_t getStride() const;
+        
+        /**
+         * \brief Report an area changed through getPixels()
+         */
+        void markDirty(int x, int y, int width, int height);
+        
+        /**
+         * \brief Report that the whole screen should be redrawn, e.g. after the display has been reconnected
+         */
+        void markAllDirty();
+        
+        /**
+         * \brief Fill a rectangle with a solid color
+         */
+        void fillRect(int x, int y, int width, int height, uint16_t color);
+        
+        /**
+         * \brief Copy an image into the surface
+         *
+         * \param pixels The image, each pixel should be in B5G6R5 format and the rows should be adjacent in memory
+         */
+        void drawImage(int x, int y, int width, int height, const void* pixels);
+        
+        /**
+         * \brief Replace the whole surface with a new frame, only the areas that differ from the previous frame get damaged
+         *
+         * Suited to clients which render complete frames, a frame where only a few digits have changed results in a few
+         * small bitblts instead of a full screen one. The frame is compared with the shadow copy in 32x16 tiles, the changed
+         * tiles are joined into rectangles and each rectangle is shrunk to the pixels actually changed.
+         *
+         * \param pixels The first pixel of the frame, each pixel should be in B5G6R5 format
+         * \param stride Bytes between the beginnings of two adjacent rows of the frame, 0 if the rows are adjacent in memory
+         */
+        void drawFrame(const void* pixels, size_t stride = 0);
+        
+        /**
+         * \brief Copy a part of the surface to another position, the two areas may overlap
+         */
+        void copyArea(int srcX, int srcY, int destX, int destY, int width, int height);
+        
+        /**
+         * \brief Send the changes made since the last present() to the display
+         */
+        void present();
+    
+    private:
+        std::unique_ptr<RoboPeakUsbDisplaySurfaceImpl> impl_;
+    };
+
+}}}
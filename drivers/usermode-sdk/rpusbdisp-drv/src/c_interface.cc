@@ -9,6 +9,7 @@
 #include <rp/drivers/display/rpusbdisp/c_interface.h>
 #include <rp/deps/libusbx_wrap/libusbx_wrap.h>
 #include <rp/drivers/display/rpusbdisp/rpusbdisp.h>
+#include <rp/drivers/display/rpusbdisp/surface.h>
 #include <functional>
 
 using namespace std;
@@ -25,6 +26,10 @@ static inline shared_ptr<RoboPeakUsbDisplayDevice>& getDevice(RoboPeakUsbDisplay
     return *castDevice(ref);
 }
 
+static inline RoboPeakUsbDisplaySurface* getSurface(RoboPeakUsbDisplaySurfaceRef ref) {
+    return reinterpret_cast<RoboPeakUsbDisplaySurface*>(ref);
+}
+
 #define RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN try {
 #define RPUSBDISP_HANDLE_EXCEPTIONS_END \
         return 0; \
@@ -88,6 +93,30 @@ RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayCopyArea(RoboPeakUsbDisplayDevi
     RPUSBDISP_HANDLE_EXCEPTIONS_END
 }
 
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySetRleMode(RoboPeakUsbDisplayDeviceRef device, RoboPeakUsbDisplayRleMode mode) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getDevice(device)->setRleMode(mode);
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySetAsyncMode(RoboPeakUsbDisplayDeviceRef device, bool enabled, int maxPendingCommands) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getDevice(device)->setAsyncMode(enabled, maxPendingCommands);
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySetBatchMode(RoboPeakUsbDisplayDeviceRef device, bool enabled, int maxDelayMs) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getDevice(device)->setBatchMode(enabled, maxDelayMs);
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayFlush(RoboPeakUsbDisplayDeviceRef device) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getDevice(device)->flush();
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
 RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayEnable(RoboPeakUsbDisplayDeviceRef device) {
     RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
         getDevice(device)->enable();
@@ -107,3 +136,58 @@ RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayIsAlive(RoboPeakUsbDisplayDevic
     RPUSBDISP_HANDLE_EXCEPTIONS_END
 }
 
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayCreateSurface(RoboPeakUsbDisplayDeviceRef device, RoboPeakUsbDisplaySurfaceRef* outSurface) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        *outSurface = reinterpret_cast<RoboPeakUsbDisplaySurfaceRef>(new RoboPeakUsbDisplaySurface(getDevice(device)));
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplayDisposeSurface(RoboPeakUsbDisplaySurfaceRef surface) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        delete getSurface(surface);
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceGetPixels(RoboPeakUsbDisplaySurfaceRef surface, uint16_t** outPixels, size_t* outStride) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        *outPixels = getSurface(surface)->getPixels();
+        *outStride = getSurface(surface)->getStride();
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceMarkDirty(RoboPeakUsbDisplaySurfaceRef surface, int x, int y, int width, int height) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getSurface(surface)->markDirty(x, y, width, height);
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceFillRect(RoboPeakUsbDisplaySurfaceRef surface, int x, int y, int width, int height, uint16_t color) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getSurface(surface)->fillRect(x, y, width, height, color);
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceDrawImage(RoboPeakUsbDisplaySurfaceRef surface, int x, int y, int width, int height, const void* pixels) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getSurface(surface)->drawImage(x, y, width, height, pixels);
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceDrawFrame(RoboPeakUsbDisplaySurfaceRef surface, const void* pixels, size_t stride) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getSurface(surface)->drawFrame(pixels, stride);
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfaceCopyArea(RoboPeakUsbDisplaySurfaceRef surface, int srcX, int srcY, int destX, int destY, int width, int height) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getSurface(surface)->copyArea(srcX, srcY, destX, destY, width, height);
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
+RoboPeakUsbDisplayDriverResult RoboPeakUsbDisplaySurfacePresent(RoboPeakUsbDisplaySurfaceRef surface) {
+    RPUSBDISP_HANDLE_EXCEPTIONS_BEGIN
+        getSurface(surface)->present();
+    RPUSBDISP_HANDLE_EXCEPTIONS_END
+}
+
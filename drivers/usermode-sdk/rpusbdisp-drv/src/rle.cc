@@ -7,151 +7,560 @@
 //
 
 /*
-
+ RLE stream format
+ 
+ The pixel stream is split into sections, each section begins with a one byte header:
+ bit 7 (RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT) tells if it is a common section, bits 0-6 store the pixel count minus one.
+ A common section is followed by one pixel which is repeated, a raw section is followed by all its pixels.
  
+ The default encoder is greedy: each run of two or more equal pixels forms common sections, the remaining pixels are
+ packed into raw sections. A 2 pixel common section saves nothing over raw pixels while it may split a raw section, so
+ the optimal mode plans the sections for the smallest stream instead, at the cost of an extra pass over the image.
  
+ Finding where runs begin and end is the hot path, so it is done by a scanner which compares several pixels at once
+ with SSE2, AVX2 or NEON when available. The scanner only locates run boundaries, so all of them produce exactly the
+ same stream as the scalar one.
  */
 
-
 #include <rp/drivers/display/rpusbdisp/rle.h>
+#include <rp/drivers/display/rpusbdisp/simd.h>
+#include <rp/drivers/display/rpusbdisp/packet_writer.h>
+#include <rp/drivers/display/rpusbdisp/protocol.h>
 #include <rp/util/int_types.h>
 #include <rp/util/buffer.h>
 #include <rp/util/scopes.h>
 #include <rp/deps/libusbx_wrap/libusbx_wrap.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
 using namespace std;
 using namespace rp::deps::libusbx_wrap;
 using namespace rp::util;
 
+#define RLE_MAX_SECTION_SIZE (RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT + 1)
+
 namespace rp { namespace drivers { namespace display {
-    
 
-    shared_ptr<Buffer> rleCompress(shared_ptr<Buffer> buffer) {
-        if (buffer->size() & 0x1) {
-            throw Exception(-1, "Rle should align in 2 bytes");
+    namespace {
+        
+        /*
+         * Run boundary scanners
+         *
+         * scanRun: count the leading pixels which equal value
+         * scanDistinct: count the leading pixels which differ from their next pixel (the last pixel is never counted)
+         */
+        typedef size_t (*ScanRunFunc)(const _u16* pixels, size_t count, _u16 value);
+        typedef size_t (*ScanDistinctFunc)(const _u16* pixels, size_t count);
+        
+        struct RleScanner {
+            ScanRunFunc scanRun;
+            ScanDistinctFunc scanDistinct;
+        };
+        
+        static inline unsigned firstSetBit(_u32 mask) {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return (unsigned)index;
+#else
+            return (unsigned)__builtin_ctz(mask);
+#endif
         }
         
-        // estimate the buffer usage in the worst case
-        // the worst case is 1 extra byte with each 128 pixels (since the 7bit size block can represent 128 uints)
+        static size_t scanRunScalar(const _u16* pixels, size_t count, _u16 value) {
+            size_t pos = 0;
+            while (pos < count && pixels[pos] == value)
+                pos++;
+            return pos;
+        }
         
-        size_t estBufferSize = buffer->size() + (((buffer->size()>>1) + 0x7f)>>7);
-        _u8 *  outputBuffer = new _u8[estBufferSize];
+        static size_t scanDistinctScalar(const _u16* pixels, size_t count) {
+            size_t pos = 0;
+            while (pos + 1 < count && pixels[pos] != pixels[pos + 1])
+                pos++;
+            return pos;
+        }
         
-        BufferLockScope scope(buffer);
+#ifdef RP_USBDISP_SIMD_SSE2
+        static size_t scanRunSse2(const _u16* pixels, size_t count, _u16 value) {
+            const __m128i target = _mm_set1_epi16((short)value);
+            size_t pos = 0;
+            
+            for (; pos + 8 <= count; pos += 8) {
+                __m128i block = _mm_loadu_si128((const __m128i*)(pixels + pos));
+                _u32 mask = (_u32)_mm_movemask_epi8(_mm_cmpeq_epi16(block, target)) ^ 0xffffu;
+                
+                if (mask)
+                    return pos + (firstSetBit(mask) >> 1);
+            }
+            
+            return pos + scanRunScalar(pixels + pos, count - pos, value);
+        }
         
-        _u16 * pixelData = (_u16 *)scope.getBuffer();
+        static size_t scanDistinctSse2(const _u16* pixels, size_t count) {
+            size_t pos = 0;
+            
+            for (; pos + 9 <= count; pos += 8) {
+                __m128i current = _mm_loadu_si128((const __m128i*)(pixels + pos));
+                __m128i next = _mm_loadu_si128((const __m128i*)(pixels + pos + 1));
+                _u32 mask = (_u32)_mm_movemask_epi8(_mm_cmpeq_epi16(current, next));
+                
+                if (mask)
+                    return pos + (firstSetBit(mask) >> 1);
+            }
+            
+            return pos + scanDistinctScalar(pixels + pos, count - pos);
+        }
+#endif
         
+#ifdef RP_USBDISP_SIMD_AVX2
+        static RP_USBDISP_TARGET_AVX2 size_t scanRunAvx2(const _u16* pixels, size_t count, _u16 value) {
+            const __m256i target = _mm256_set1_epi16((short)value);
+            size_t pos = 0;
+            
+            for (; pos + 16 <= count; pos += 16) {
+                __m256i block = _mm256_loadu_si256((const __m256i*)(pixels + pos));
+                _u32 mask = ~(_u32)_mm256_movemask_epi8(_mm256_cmpeq_epi16(block, target));
+                
+                if (mask)
+                    return pos + (firstSetBit(mask) >> 1);
+            }
+            
+            return pos + scanRunSse2(pixels + pos, count - pos, value);
+        }
         
-        //FIXME: assumes the pixel data is 16bit is not always true for the future rpusbdisp products
-        size_t pixelPos = 0;
-        _u16 lastPixelValue;
-        _u8 * encodingPos    = outputBuffer;
-        _u8 * sectionHeader; //section header is used to store the section length and section type
-        const size_t totoalPixels = (buffer->size()>>1);
+        static RP_USBDISP_TARGET_AVX2 size_t scanDistinctAvx2(const _u16* pixels, size_t count) {
+            size_t pos = 0;
+            
+            for (; pos + 17 <= count; pos += 16) {
+                __m256i current = _mm256_loadu_si256((const __m256i*)(pixels + pos));
+                __m256i next = _mm256_loadu_si256((const __m256i*)(pixels + pos + 1));
+                _u32 mask = (_u32)_mm256_movemask_epi8(_mm256_cmpeq_epi16(current, next));
+                
+                if (mask)
+                    return pos + (firstSetBit(mask) >> 1);
+            }
+            
+            return pos + scanDistinctSse2(pixels + pos, count - pos);
+        }
+#endif
         
+#ifdef RP_USBDISP_SIMD_NEON
+        // NEON has no movemask, narrow the 16bit compare result to 8bit lanes and test it as a 64bit word
+        static inline _u64 neonMask(uint16x8_t equal) {
+            return vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(equal)), 0);
+        }
         
-        // initial setup...
-        sectionHeader = encodingPos++;
-        *sectionHeader = 0; //set the initial section length to 1 (zero section length is not allowed, so 0 actually means 1)
-        lastPixelValue = pixelData[pixelPos++];
-        *((_u16 *)encodingPos) = lastPixelValue; //copy the first pixel into it
-        encodingPos +=2;
-    
-        while (pixelPos < totoalPixels) {
-        
-            bool isCommonSection = *sectionHeader & 0x80;
-            if (isCommonSection) {
-                while (pixelPos < totoalPixels) {
-                    _u16 currentPixel = pixelData[pixelPos++];
-                    
-                    if (currentPixel == lastPixelValue) {
-                        if (*sectionHeader == (0x7f | 0x80)) {
-                            // no room for the current section, create a new one
-                            sectionHeader = encodingPos;
-                            ++encodingPos;
-                            *sectionHeader = 0x80;
-                            *((_u16 *)encodingPos) = currentPixel;
-                            encodingPos+=2;
-                        } else {
-                            ++(*sectionHeader);
-                        }
-                        
+        static size_t scanRunNeon(const _u16* pixels, size_t count, _u16 value) {
+            const uint16x8_t target = vdupq_n_u16(value);
+            size_t pos = 0;
+            
+            for (; pos + 8 <= count; pos += 8) {
+                _u64 mask = ~neonMask(vceqq_u16(vld1q_u16(pixels + pos), target));
+                
+                if (mask)
+                    return pos + ((size_t)__builtin_ctzll(mask) >> 3);
+            }
+            
+            return pos + scanRunScalar(pixels + pos, count - pos, value);
+        }
+        
+        static size_t scanDistinctNeon(const _u16* pixels, size_t count) {
+            size_t pos = 0;
+            
+            for (; pos + 9 <= count; pos += 8) {
+                _u64 mask = neonMask(vceqq_u16(vld1q_u16(pixels + pos), vld1q_u16(pixels + pos + 1)));
+                
+                if (mask)
+                    return pos + ((size_t)__builtin_ctzll(mask) >> 3);
+            }
+            
+            return pos + scanDistinctScalar(pixels + pos, count - pos);
+        }
+#endif
+        
+        static RleScanner selectScanner() {
+            RleScanner scanner = { &scanRunScalar, &scanDistinctScalar };
+            
+#if defined(RP_USBDISP_SIMD_NEON)
+            scanner.scanRun = &scanRunNeon;
+            scanner.scanDistinct = &scanDistinctNeon;
+#elif defined(RP_USBDISP_SIMD_SSE2)
+            scanner.scanRun = &scanRunSse2;
+            scanner.scanDistinct = &scanDistinctSse2;
+#   ifdef RP_USBDISP_SIMD_AVX2
+            if (cpuSupportsAvx2()) {
+                scanner.scanRun = &scanRunAvx2;
+                scanner.scanDistinct = &scanDistinctAvx2;
+            }
+#   endif
+#endif
+            
+            return scanner;
+        }
+        
+        static const RleScanner& getScanner() {
+            static const RleScanner scanner = selectScanner();
+            return scanner;
+        }
+        
+        // Writes a plain byte stream, used by the buffer based rleCompress
+        class LinearWriter {
+        public:
+            LinearWriter(void* buffer) : begin_((_u8*)buffer), pos_((_u8*)buffer) {}
+            
+            void put(_u8 data) {
+                *pos_++ = data;
+            }
+            
+            _u8* reserve() {
+                return pos_++;
+            }
+            
+            void write(const void* data, size_t size) {
+                memcpy(pos_, data, size);
+                pos_ += size;
+            }
+            
+            size_t size() const {
+                return (size_t)(pos_ - begin_);
+            }
+        
+        private:
+            _u8* begin_;
+            _u8* pos_;
+        };
+        
+        // Only counts the bytes, used to estimate the compressed size
+        class CountingWriter {
+        public:
+            CountingWriter() : size_(0) {}
+            
+            void put(_u8) {
+                size_++;
+            }
+            
+            _u8* reserve() {
+                size_++;
+                return &discarded_;
+            }
+            
+            void write(const void*, size_t size) {
+                size_ += size;
+            }
+            
+            size_t size() const {
+                return size_;
+            }
+        
+        private:
+            size_t size_;
+            _u8 discarded_;
+        };
+        
+        template<typename WriterT>
+        class RleEncoder {
+        public:
+            RleEncoder(WriterT& writer) : writer_(writer), scanner_(getScanner()), rawHeader_(nullptr), rawCount_(0), runValue_(0), runLength_(0) {}
+            
+            // Feed one row of pixels, runs are allowed to continue into the next row
+            void feed(const _u16* pixels, size_t count) {
+                size_t pos = 0;
+                
+                if (runLength_) {
+                    // try to extend the run left by the previous row
+                    pos = scanner_.scanRun(pixels, count, runValue_);
+                    
+                    runLength_ += pos;
+                    if (pos == count)
+                        return;
+                    
+                    flushRun_();
+                }
+                
+                while (pos < count) {
+                    _u16 value = pixels[pos];
+                    size_t end = pos + 1 + scanner_.scanRun(pixels + pos + 1, count - pos - 1, value);
+                    
+                    if (end == count) {
+                        // the run reaches the end of the row, it may continue in the next row
+                        runValue_ = value;
+                        runLength_ = end - pos;
+                        return;
+                    }
+                    
+                    if (end - pos > 1) {
+                        writeCommon_(value, end - pos);
+                        pos = end;
                     } else {
-                        // create a new section
-                        sectionHeader = encodingPos;
-                        ++encodingPos;
-                        *sectionHeader = 0;
-                        *((_u16 *)encodingPos) = currentPixel;
-                        encodingPos+=2;
+                        // pixels which differ from both neighbours go to raw sections,
+                        // the last pixel of the row is left for the next row to decide
+                        end = pos + 1 + scanner_.scanDistinct(pixels + pos + 1, count - pos - 1);
                         
-                        lastPixelValue = currentPixel;
-                        break;
+                        writeRaw_(pixels + pos, end - pos);
+                        pos = end;
                     }
                 }
+            }
+            
+            void finish() {
+                flushRun_();
+                closeRaw_();
+            }
+        
+        private:
+            void flushRun_() {
+                if (runLength_ == 1) {
+                    writeRaw_(&runValue_, 1);
+                } else if (runLength_) {
+                    writeCommon_(runValue_, runLength_);
+                }
+                runLength_ = 0;
+            }
+            
+            void writeCommon_(_u16 value, size_t count) {
+                closeRaw_();
                 
+                while (count) {
+                    size_t sectionSize = count > RLE_MAX_SECTION_SIZE ? RLE_MAX_SECTION_SIZE : count;
+                    
+                    writer_.put((_u8)(RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT | (sectionSize - 1)));
+                    writer_.write(&value, sizeof(_u16));
+                    count -= sectionSize;
+                }
+            }
+            
+            void writeRaw_(const _u16* pixels, size_t count) {
+                while (count) {
+                    if (rawCount_ == RLE_MAX_SECTION_SIZE) {
+                        closeRaw_();
+                    }
+                    
+                    if (!rawCount_) {
+                        rawHeader_ = writer_.reserve();
+                    }
+                    
+                    size_t room = RLE_MAX_SECTION_SIZE - rawCount_;
+                    size_t chunk = count > room ? room : count;
+                    
+                    writer_.write(pixels, chunk * sizeof(_u16));
+                    rawCount_ += chunk;
+                    pixels += chunk;
+                    count -= chunk;
+                }
+            }
+            
+            void closeRaw_() {
+                if (rawCount_) {
+                    *rawHeader_ = (_u8)(rawCount_ - 1);
+                    rawCount_ = 0;
+                }
+            }
+            
+            WriterT& writer_;
+            const RleScanner& scanner_;
+            _u8* rawHeader_;
+            size_t rawCount_;
+            _u16 runValue_;
+            size_t runLength_;
+        };
+        
+        template<typename WriterT>
+        void rleEncodeImage(const void* pixels, size_t width, size_t height, size_t stride, WriterT& writer) {
+            //FIXME: assumes the pixel data is 16bit is not always true for the future rpusbdisp products
+            RleEncoder<WriterT> encoder(writer);
+            const _u8* row = (const _u8*)pixels;
+            
+            for (size_t y = 0; y < height; y++, row += stride) {
+                encoder.feed((const _u16*)row, width);
+            }
+            
+            encoder.finish();
+        }
+    
+        // Must be a power of 2 larger than RLE_MAX_SECTION_SIZE
+        static const size_t RLE_PLANNER_WINDOW_SIZE = 256;
+        static const size_t RLE_PLANNER_WINDOW_MASK = RLE_PLANNER_WINDOW_SIZE - 1;
+        
+        static const _u32 RLE_COMMON_SECTION_COST = sizeof(_u8) + sizeof(_u16);
+        
+        /*
+         * Minimum size encoder
+         *
+         * cost[i] is the least bytes needed by the first i pixels. The last section of that encoding is either a raw
+         * section (1 + 2 * length bytes) or a common section within the run pixel i-1 belongs to (3 bytes). Since
+         * cost[i] never decreases with i, the longest common section is always the best one, and the best raw section
+         * starts at the minimum of cost[j] - 2j over the last RLE_MAX_SECTION_SIZE positions, kept in a monotonic queue.
+         *
+         * plan[i-1] records the header of the last section chosen for the first i pixels. Walking these headers back
+         * from the end moves the header of every chosen section to its first pixel, then the sections are written out.
+         * The plan is kept by the caller and only grows, so encoding an image usually allocates nothing.
+         */
+        template<typename WriterT>
+        void rleEncodeImageOptimal(const void* pixels, size_t width, size_t height, size_t stride, WriterT& writer, vector<_u8>& plan) {
+            size_t pixelCount = width * height;
+            
+            if (!pixelCount)
+                return;
+            
+            if (plan.size() < pixelCount) {
+                plan.resize(pixelCount);
+            }
+            
+            _u32 cost[RLE_PLANNER_WINDOW_SIZE];
+            size_t rawStarts[RLE_PLANNER_WINDOW_SIZE];
+            size_t rawStartsHead = 0, rawStartsTail = 0;
+            
+            cost[0] = 0;
+            rawStarts[rawStartsTail++ & RLE_PLANNER_WINDOW_MASK] = 0;
+            
+            size_t i = 0, runStart = 0;
+            _u16 runValue = 0;
+            const _u8* row = (const _u8*)pixels;
+            
+            for (size_t y = 0; y < height; y++, row += stride) {
+                const _u16* line = (const _u16*)row;
                 
-            } else {
-                while (pixelPos < totoalPixels) {
-                    _u16 currentPixel = pixelData[pixelPos++];
-                    
-                    if (currentPixel == lastPixelValue) {
-                        // find two common pixels
-                        if (* sectionHeader == 0) {
-                            // change the current section into a common section directly...
-                            ++(*sectionHeader);
-                            *sectionHeader |= 0x80;
-                        } else {
-                            // form a new section
-                            
-                            //remove the prevous pixel data from the current section
-                            (*sectionHeader)--;
-                            encodingPos-=2;
-                            
-                            
-                            // init the new section
-                            sectionHeader = encodingPos;
-                            encodingPos ++;
-            
-                            *sectionHeader = 0x80 + 1;
-                            *(_u16 *)encodingPos = currentPixel;
-                            encodingPos+=2;
-                            
-                        }
-                        break;
+                for (size_t x = 0; x < width; x++) {
+                    if (!i || line[x] != runValue) {
+                        runStart = i;
+                        runValue = line[x];
+                    }
+                    
+                    i++;
+                    
+                    while (rawStarts[rawStartsHead & RLE_PLANNER_WINDOW_MASK] + RLE_MAX_SECTION_SIZE < i)
+                        rawStartsHead++;
+                    
+                    size_t rawStart = rawStarts[rawStartsHead & RLE_PLANNER_WINDOW_MASK];
+                    _u32 rawCost = cost[rawStart & RLE_PLANNER_WINDOW_MASK] + sizeof(_u8) + (_u32)((i - rawStart) * sizeof(_u16));
+                    
+                    size_t commonStart = i - runStart > RLE_MAX_SECTION_SIZE ? i - RLE_MAX_SECTION_SIZE : runStart;
+                    _u32 commonCost = cost[commonStart & RLE_PLANNER_WINDOW_MASK] + RLE_COMMON_SECTION_COST;
+                    
+                    _u32 bestCost;
+                    if (commonCost <= rawCost) {
+                        bestCost = commonCost;
+                        plan[i - 1] = (_u8)(RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT | (i - commonStart - 1));
                     } else {
-                        if (*sectionHeader == 0x7f) {
-                            // no more space in current header, create a new one...
-                            sectionHeader = encodingPos;
-                            ++encodingPos;
-                            *sectionHeader = 0;
-                        } else {
-                            ++(*sectionHeader);
-                        }
-                        
-                        // push the current pixel data to the section
-                        *(_u16 *)encodingPos = currentPixel;
-                        encodingPos+=2;
-                        lastPixelValue = currentPixel;
+                        bestCost = rawCost;
+                        plan[i - 1] = (_u8)(i - rawStart - 1);
                     }
                     
+                    cost[i & RLE_PLANNER_WINDOW_MASK] = bestCost;
+                    
+                    // i becomes a candidate start of raw sections, drop the candidates it beats
+                    while (rawStartsTail != rawStartsHead) {
+                        size_t candidate = rawStarts[(rawStartsTail - 1) & RLE_PLANNER_WINDOW_MASK];
+                        
+                        if (cost[candidate & RLE_PLANNER_WINDOW_MASK] + (i - candidate) * sizeof(_u16) <= bestCost)
+                            break;
+                        
+                        rawStartsTail--;
+                    }
+                    rawStarts[rawStartsTail++ & RLE_PLANNER_WINDOW_MASK] = i;
                 }
+            }
+            
+            for (size_t end = pixelCount; end; ) {
+                _u8 header = plan[end - 1];
                 
+                end -= (header & RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT) + 1;
+                plan[end] = header;
             }
             
+            row = (const _u8*)pixels;
+            
+            for (size_t pos = 0, x = 0; pos < pixelCount; ) {
+                _u8 header = plan[pos];
+                size_t length = (header & RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT) + 1;
+                bool common = (header & RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT) != 0;
+                
+                writer.put(header);
+                if (common) {
+                    writer.write((const _u16*)row + x, sizeof(_u16));
+                }
+                
+                pos += length;
+                
+                // step over the pixels of the section, raw pixels are copied on the way
+                while (length) {
+                    size_t chunk = length > width - x ? width - x : length;
+                    
+                    if (!common) {
+                        writer.write((const _u16*)row + x, chunk * sizeof(_u16));
+                    }
+                    
+                    x += chunk;
+                    length -= chunk;
+                    
+                    if (x == width) {
+                        x = 0;
+                        row += stride;
+                    }
+                }
+            }
+        }
+        
+        template<typename WriterT>
+        void rleEncode(const void* pixels, size_t width, size_t height, size_t stride, WriterT& writer, RoboPeakUsbDisplayRleMode mode, vector<_u8>* plan) {
+            if (mode == RoboPeakUsbDisplayRleModeOptimal) {
+                vector<_u8> temporaryPlan;
+                rleEncodeImageOptimal(pixels, width, height, stride, writer, plan ? *plan : temporaryPlan);
+            } else {
+                rleEncodeImage(pixels, width, height, stride, writer);
+            }
+        }
+    
+    }
+    
+    size_t rleEstimateCompressedSize(size_t pixelCount) {
+        return pixelCount * sizeof(_u16) + ((pixelCount + 0x7f) >> 7);
+    }
+    
+    size_t rleEstimateSampledSize(const void* pixels, size_t width, size_t height, size_t stride, size_t sampleRows) {
+        if (!width || !height)
+            return 0;
+        
+        size_t step = sampleRows ? (height + sampleRows - 1) / sampleRows : 1;
+        size_t sampledRows = 0;
+        CountingWriter writer;
+        
+        for (size_t y = 0; y < height; y += step, sampledRows++) {
+            RleEncoder<CountingWriter> encoder(writer);
             
+            encoder.feed((const _u16*)((const _u8*)pixels + y * stride), width);
+            encoder.finish();
         }
         
-        size_t outputBufferSize = encodingPos - outputBuffer;
+        return writer.size() * height / sampledRows;
+    }
     
+    void rleCompress(const void* pixels, size_t width, size_t height, size_t stride, PacketWriter& writer, RoboPeakUsbDisplayRleMode mode, vector<_u8>* plan) {
+        rleEncode(pixels, width, height, stride, writer, mode, plan);
+    }
+    
+    shared_ptr<Buffer> rleCompress(shared_ptr<Buffer> buffer, RoboPeakUsbDisplayRleMode mode) {
+        if (buffer->size() & 0x1) {
+            throw Exception(-1, "Rle should align in 2 bytes");
+        }
         
-        shared_ptr<Buffer> outputTransferBuffer(new Buffer(outputBufferSize));
+        size_t pixelCount = buffer->size() >> 1;
+        size_t estBufferSize = rleEstimateCompressedSize(pixelCount);
+        unique_ptr<_u8[]> outputBuffer(new _u8[estBufferSize]);
+        LinearWriter writer(outputBuffer.get());
+        
+        {
+            BufferLockScope scope(buffer);
+            rleEncode(scope.getBuffer(), pixelCount, 1, buffer->size(), writer, mode, nullptr);
+        }
+        
+        shared_ptr<Buffer> outputTransferBuffer(new Buffer(writer.size()));
         
         BufferLockScope outputScope(outputTransferBuffer);
-        memcpy(outputScope.getBuffer(), outputBuffer, outputBufferSize);
-        delete [] outputBuffer;
+        memcpy(outputScope.getBuffer(), outputBuffer.get(), writer.size());
         return outputTransferBuffer;
     }
-    
+
 }}}
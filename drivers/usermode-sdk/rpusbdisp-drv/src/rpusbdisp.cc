@@ -9,10 +9,17 @@
 #include <rp/drivers/display/rpusbdisp/rpusbdisp.h>
 #include <rp/deps/libusbx_wrap/libusbx_wrap.h>
 #include <rp/drivers/display/rpusbdisp/rle.h>
+#include <rp/drivers/display/rpusbdisp/packet_writer.h>
 #include <rp/util/endian.h>
 #include <rp/util/buffer.h>
 #include <stdio.h>
 #include <memory.h>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
 
 #define RP_USB_DISPLAY_VID    0xFCCFu
 #define RP_USB_DISPLAY_PID    0xA001u
@@ -27,9 +34,16 @@
 #define RP_USB_DISPLAY_MIN_VERSION_BITBLT_RLE 0x0104u
 #define RP_USB_DISPLAY_MIN_VERSION_COPY_AREA_BUG_FIX 0x0104u
 
+#define RP_USB_DISPLAY_RLE_SAMPLE_ROWS 16
+
+#define RP_USB_DISPLAY_DEFAULT_MAX_PENDING_COMMANDS 4
+#define RP_USB_DISPLAY_TRANSFER_BUFFER_ALIGNMENT 4096
+#define RP_USB_DISPLAY_DEFAULT_BATCH_DELAY_MS 5
+
 using namespace std;
 using namespace rp::util;
 using namespace rp::deps::libusbx_wrap;
+using namespace std::placeholders;
 
 namespace rp { namespace drivers { namespace display {
     
@@ -42,6 +56,17 @@ namespace rp { namespace drivers { namespace display {
     const int RoboPeakUsbDisplayDevice::ScreenWidth = RP_USB_DISPLAY_WIDTH;
     const int RoboPeakUsbDisplayDevice::ScreenHeight = RP_USB_DISPLAY_HEIGHT;
 
+    // A pre-allocated transfer and its buffer, recycled once the command sent with it is completed
+    struct CommandSlot {
+        shared_ptr<Buffer> buffer;
+        void* data;
+        shared_ptr<Transfer> transfer;
+        bool pending;
+        TransferStatus status;
+        bool async;
+        promise<void> completion;
+    };
+    
     class RoboPeakUsbDisplayDeviceImpl : public enable_shared_from_this<RoboPeakUsbDisplayDeviceImpl>, public noncopyable {
     public:
         RoboPeakUsbDisplayDeviceImpl(shared_ptr<DeviceHandle> device) : device_(device), interfaceScope_(device, 0) {
@@ -51,10 +76,53 @@ namespace rp { namespace drivers { namespace display {
             status_.touch_y = 0;
             
             working_.store(false);
+            currentSlot_ = nullptr;
+            commandOffset_ = 0;
+            asyncMode_ = false;
+            batchMode_ = false;
+            batchDelay_ = chrono::milliseconds(RP_USB_DISPLAY_DEFAULT_BATCH_DELAY_MS);
+            batchSlot_ = nullptr;
+            batchSize_ = 0;
+            batchFlushing_ = false;
+            rleMode_ = RoboPeakUsbDisplayRleModeGreedy;
+            rleBitbltCount_.store(0);
+            rawBitbltCount_.store(0);
+            bytesSaved_.store(0);
             
             maxPacketSize_ = device->getDevice()->getMaxPacketSize(RoboPeakUsbDisplayDevice::UsbDeviceDisplayEndpoint);
+            
+            // the largest command is a full screen bitblt which does not compress at all
+            size_t maxPixelCount = (size_t)RoboPeakUsbDisplayDevice::ScreenWidth * RoboPeakUsbDisplayDevice::ScreenHeight;
+            maxTransferSize_ = PacketWriter::estimateTransferSize(sizeof(rpusbdisp_disp_bitblt_packet_t) - sizeof(rpusbdisp_disp_packet_header_t) + rleEstimateCompressedSize(maxPixelCount), maxPacketSize_);
+            resizeSlots_(1);
+            
+            // commands in synchronous mode are already completed when they return
+            promise<void> completed;
+            completed.set_value();
+            completedCommand_ = completed.get_future().share();
+            
+            // command completions are delivered by the libusb event thread
+            pipeline_ = Context::defaultContext()->summonPipeline();
+            pipeline_->start();
         }
         ~RoboPeakUsbDisplayDeviceImpl() {
+            {
+                lock_guard<mutex> guard(displayLock_);
+                batchFlushing_ = false;
+                
+                if (batchSlot_) {
+                    submitBatch_();
+                }
+            }
+            batchCondition_.notify_all();
+            
+            if (batchFlushThread_.joinable()) {
+                batchFlushThread_.join();
+            }
+            
+            // the completion callbacks of the pending commands refer to this object
+            waitForPendingCommands_();
+            
             working_.store(false);
             if (statusFetchingThread_.joinable()) {
                 statusFetchingThread_.join();
@@ -96,109 +164,72 @@ namespace rp { namespace drivers { namespace display {
         }
         
         template<typename PacketT>
-        void sendCommandToDisplayEndpoint(PacketT& packet, shared_ptr<Buffer> payload=nullptr) {
-            size_t totalSize = sizeof(PacketT);
-            if (payload) {
-                totalSize += payload->size();
-            }
-            size_t packetCount = (totalSize-1+maxPacketSize_-1)/(maxPacketSize_-1);
-            
-            shared_ptr<Buffer> overallBuffer(new Buffer(totalSize));
-            
-            BufferLockScope scope(overallBuffer);
-            _u8* scopeNakedBuffer = (_u8*)scope.getBuffer();
-            memcpy(scopeNakedBuffer, &packet, sizeof(PacketT));
-            if (payload) {
-                BufferLockScope payloadScope(payload);
-                memcpy(scopeNakedBuffer+sizeof(PacketT), payloadScope.getBuffer(), payload->size());
-            }
+        shared_future<void> sendCommandToDisplayEndpoint(PacketT& packet, const void* payload=nullptr, size_t payloadSize=0) {
+            lock_guard<mutex> guard(displayLock_);
+            PacketWriter writer = beginCommand_(packet, payloadSize);
             
-            size_t transferBufferSize = totalSize + packetCount - 1; // every extra packet cost one more byte to store command
-            shared_ptr<Buffer> transferBuffer(new Buffer(transferBufferSize));
-            
-            {
-                BufferLockScope transferBufferLockScope(transferBuffer);
-                _u8* nakedTransferBuffer = (_u8*)transferBufferLockScope.getBuffer();
-                
-                for (size_t packetIndex = 0; packetIndex < packetCount; packetIndex++) {
-                    size_t packetOffset = packetIndex * (maxPacketSize_ - 1) + 1;
-                    size_t payloadSize = maxPacketSize_ - 1;
-                    if (payloadSize > totalSize - packetOffset)
-                        payloadSize = totalSize - packetOffset;
-                    
-                    size_t transferBufferOffset = packetIndex * maxPacketSize_;
-                    nakedTransferBuffer[transferBufferOffset] = scopeNakedBuffer[0];
-                    if (packetIndex == 0) {
-                        nakedTransferBuffer[transferBufferOffset] |= RPUSBDISP_CMD_FLAG_START;
-                        {
-                            lock_guard<mutex> guard(statusLock_);
-                            if (status_.display_status & RPUSBDISP_DISPLAY_STATUS_DIRTY_FLAG) {
-                                nakedTransferBuffer[transferBufferOffset] |= RPUSBDISP_CMD_FLAG_CLEARDITY;
-                            }
-                        }
-                    }
-                    
-                    memcpy(nakedTransferBuffer+transferBufferOffset+1, scopeNakedBuffer+packetOffset, payloadSize);
-                }
-            }
-            
-            shared_ptr<Transfer> transfer = device_->allocTransfer(EndpointDirectionOut, EndpointTransferTypeBulk, RoboPeakUsbDisplayDevice::UsbDeviceDisplayEndpoint);
-            transfer->setTransferBuffer(transferBuffer);
-            transfer->submit();
-            
-            transfer->waitForCompletion();
-
-            switch (transfer->getStatus()) {
-                case deps::libusbx_wrap::TransferStatusCompleted:
-                    return;
-                default:
-                    throw Exception(transfer->getStatus());
-            }
+            writer.write(payload, payloadSize);
+            return submitCommand_(writer);
         }
         
-        void fill(uint16_t color) {
+        shared_future<void> fill(uint16_t color) {
             if (device_->getDevice()->getFirmwareVersion() < RP_USB_DISPLAY_MIN_VERSION_FILL) {
                 int width = getWidth(), height = getHeight();
-                fillrect(0, 0, width-1, height-1, color, RoboPeakUsbDisplayBitOperationCopy);
+                return fillrect(0, 0, width-1, height-1, color, RoboPeakUsbDisplayBitOperationCopy);
             } else {
                 rpusbdisp_disp_fill_packet_t fillPacket;
                 
                 fillPacket.header.cmd_flag = RPUSBDISP_DISPCMD_FILL;
                 fillPacket.color_565 = cpu_to_le16(color);
                 
-                sendCommandToDisplayEndpoint(fillPacket);
+                return sendCommandToDisplayEndpoint(fillPacket);
             }
         }
         
-        void bitblt(uint16_t x, uint16_t y, uint16_t width, uint16_t height, RoboPeakUsbDisplayBitOperation bitOperation, void* buffer) {
-            size_t payloadSize = (size_t)(width * height * 2);
-            
-            shared_ptr<Buffer> payload(new Buffer(payloadSize));
-            
-            {
-                BufferLockScope scope(payload);
-                memcpy(scope.getBuffer(), buffer, payloadSize);
-            }
+        shared_future<void> bitblt(uint16_t x, uint16_t y, uint16_t width, uint16_t height, RoboPeakUsbDisplayBitOperation bitOperation, const void* buffer, size_t stride) {
+            size_t pixelCount = (size_t)width * height;
             
             rpusbdisp_disp_bitblt_packet_t packet;
+            bool rle = device_->getDevice()->getFirmwareVersion() >= RP_USB_DISPLAY_MIN_VERSION_BITBLT_RLE;
             
-            if (device_->getDevice()->getFirmwareVersion() < RP_USB_DISPLAY_MIN_VERSION_BITBLT_RLE) {
-                packet.header.cmd_flag = RPUSBDISP_DISPCMD_BITBLT;
-            } else {
-                packet.header.cmd_flag = RPUSBDISP_DISPCMD_BITBLT_RLE;
-                payload = rleCompress(payload);
+            // images which do not compress (photos, videos...) would grow with RLE, send them uncompressed instead
+            if (rle && rleEstimateSampledSize(buffer, width, height, stride, RP_USB_DISPLAY_RLE_SAMPLE_ROWS) >= pixelCount * 2) {
+                rle = false;
             }
             
+            packet.header.cmd_flag = rle ? RPUSBDISP_DISPCMD_BITBLT_RLE : RPUSBDISP_DISPCMD_BITBLT;
             packet.x = cpu_to_le16(x);
             packet.y = cpu_to_le16(y);
             packet.width = cpu_to_le16(width);
             packet.height = cpu_to_le16(height);
             packet.operation = (_u8)bitOperation;
             
-            sendCommandToDisplayEndpoint(packet, payload);
+            lock_guard<mutex> guard(displayLock_);
+            
+            if (rle) {
+                // pixels are compressed straight into the transfer buffer
+                PacketWriter writer = beginCommand_(packet, rleEstimateCompressedSize(pixelCount));
+                rleCompress(buffer, width, height, stride, writer, rleMode_, &rlePlan_);
+                
+                size_t rawTransferSize = PacketWriter::estimateTransferSize(sizeof(packet) - sizeof(rpusbdisp_disp_packet_header_t) + pixelCount * 2, maxPacketSize_);
+                bytesSaved_ += (int64_t)rawTransferSize - (int64_t)writer.size();
+                rleBitbltCount_++;
+                
+                return submitCommand_(writer);
+            } else {
+                PacketWriter writer = beginCommand_(packet, pixelCount * 2);
+                
+                for (uint16_t row = 0; row < height; row++) {
+                    writer.write((const _u8*)buffer + row * stride, (size_t)width * 2);
+                }
+                
+                rawBitbltCount_++;
+                
+                return submitCommand_(writer);
+            }
         }
         
-        void fillrect(uint16_t left, uint16_t top, uint16_t right, uint16_t bottom, uint16_t color, RoboPeakUsbDisplayBitOperation bitOperation) {
+        shared_future<void> fillrect(uint16_t left, uint16_t top, uint16_t right, uint16_t bottom, uint16_t color, RoboPeakUsbDisplayBitOperation bitOperation) {
             rpusbdisp_disp_fillrect_packet_t fillRectPacket;
             
             fillRectPacket.header.cmd_flag = RPUSBDISP_DISPCMD_RECT;
@@ -209,10 +240,10 @@ namespace rp { namespace drivers { namespace display {
             fillRectPacket.color_565 = color;
             fillRectPacket.operation = (_u8)bitOperation;
             
-            sendCommandToDisplayEndpoint(fillRectPacket);
+            return sendCommandToDisplayEndpoint(fillRectPacket);
         }
         
-        void copyArea(uint16_t srcX, uint16_t srcY, uint16_t destX, uint16_t destY, uint16_t width, uint16_t height) {
+        shared_future<void> copyArea(uint16_t srcX, uint16_t srcY, uint16_t destX, uint16_t destY, uint16_t width, uint16_t height) {
             rpusbdisp_disp_copyarea_packet_t packet;
             
             packet.header.cmd_flag = RPUSBDISP_DISPCMD_COPY_AREA;
@@ -224,16 +255,88 @@ namespace rp { namespace drivers { namespace display {
             packet.height = cpu_to_le16(height);
             
             if (device_->getDevice()->getFirmwareVersion() < RP_USB_DISPLAY_MIN_VERSION_COPY_AREA_BUG_FIX) {
-            sendCommandToDisplayEndpoint(packet, shared_ptr<Buffer>(new Buffer(1)));
+                static const _u8 padding = 0;
+                return sendCommandToDisplayEndpoint(packet, &padding, sizeof(padding));
             } else {
-                sendCommandToDisplayEndpoint(packet);
+                return sendCommandToDisplayEndpoint(packet);
+            }
+        }
+        
+        void setAsyncMode(bool enabled, int maxPendingCommands) {
+            if (maxPendingCommands < 1) {
+                throw Exception(-1, "At least 1 pending command is required");
+            }
+            
+            lock_guard<mutex> guard(displayLock_);
+            if (batchSlot_) {
+                submitBatch_();
+            }
+            waitForPendingCommands_();
+            
+            lock_guard<mutex> slotGuard(slotLock_);
+            resizeSlots_(enabled ? (size_t)maxPendingCommands : 1);
+            asyncMode_ = enabled;
+        }
+        
+        void setBatchMode(bool enabled, int maxDelayMs) {
+            if (maxDelayMs < 0) {
+                throw Exception(-1, "The batch delay should not be negative");
+            }
+            
+            {
+                lock_guard<mutex> guard(displayLock_);
+                if (batchSlot_) {
+                    submitBatch_();
+                }
+                
+                batchMode_ = enabled;
+                batchDelay_ = chrono::milliseconds(maxDelayMs);
+                
+                // the flushing thread is started on demand and lives as long as the device
+                if (enabled && !batchFlushing_) {
+                    batchFlushing_ = true;
+                    batchFlushThread_ = move(thread(bind(&RoboPeakUsbDisplayDeviceImpl::batchFlushWorker_, this)));
+                }
+            }
+            batchCondition_.notify_all();
+        }
+        
+        void flush() {
+            lock_guard<mutex> guard(displayLock_);
+            if (batchSlot_) {
+                submitBatch_();
             }
+            waitForPendingCommands_();
+            
+            exception_ptr error;
+            {
+                lock_guard<mutex> slotGuard(slotLock_);
+                swap(error, pendingError_);
+            }
+            
+            if (error) {
+                rethrow_exception(error);
+            }
+        }
+        
+        void setRleMode(RoboPeakUsbDisplayRleMode mode) {
+            lock_guard<mutex> guard(displayLock_);
+            rleMode_ = mode;
+        }
+        
+        RoboPeakUsbDisplayBitbltStatistics getBitbltStatistics() const {
+            RoboPeakUsbDisplayBitbltStatistics statistics;
+            
+            statistics.rleBitbltCount = rleBitbltCount_.load();
+            statistics.rawBitbltCount = rawBitbltCount_.load();
+            statistics.bytesSaved = bytesSaved_.load();
+            return statistics;
         }
         
         void enable() {
             call_once(statusThreadOnceFlag_, bind(&RoboPeakUsbDisplayDeviceImpl::doEnable_, this));
             
-            this->fill(0xcb20u);
+            this->fill(0xcb20u).wait();
             this_thread::sleep_for(chrono::milliseconds(200));
             this->fill(0xcb20u);
         }
@@ -286,6 +389,262 @@ namespace rp { namespace drivers { namespace display {
         }
         
     private:
+        // Prepare a transfer buffer for a command whose payload is at most payloadSize bytes, and write the command packet into it
+        // Blocks while too many commands are pending, displayLock_ should be held until the command is submitted
+        template<typename PacketT>
+        PacketWriter beginCommand_(PacketT& packet, size_t payloadSize) {
+            size_t bodySize = sizeof(PacketT) - sizeof(rpusbdisp_disp_packet_header_t) + payloadSize;
+            size_t transferSize = PacketWriter::estimateTransferSize(bodySize, maxPacketSize_);
+            
+            if (batchSlot_) {
+                // every command starts with a new packet, the rest of the packet the previous command ends with is zero filled
+                size_t offset = (batchSize_ + maxPacketSize_ - 1) / maxPacketSize_ * maxPacketSize_;
+                
+                if (offset + transferSize <= batchSlot_->buffer->size()) {
+                    memset((_u8*)batchSlot_->data + batchSize_, 0, offset - batchSize_);
+                    
+                    currentSlot_ = batchSlot_;
+                    commandOffset_ = offset;
+                    
+                    PacketWriter writer((_u8*)currentSlot_->data + commandOffset_, maxPacketSize_, packet.header.cmd_flag);
+                    writer.writeCommand(packet);
+                    return writer;
+                }
+                
+                // the batch is full
+                submitBatch_();
+            }
+            
+            currentSlot_ = acquireSlot_();
+            commandOffset_ = 0;
+                
+            if (currentSlot_->buffer->size() < transferSize) {
+                // only images larger than the screen get here
+                try {
+                    allocSlotBuffer_(currentSlot_, transferSize);
+                } catch (...) {
+                    releaseSlot_(currentSlot_);
+                    throw;
+                }
+            }
+            
+            if (batchMode_) {
+                // the following commands are appended to this slot until the batch is flushed
+                batchSlot_ = currentSlot_;
+                batchSlot_->async = true;
+                batchSlot_->completion = promise<void>();
+                batchCompletion_ = batchSlot_->completion.get_future().share();
+                batchSize_ = 0;
+                batchDeadline_ = chrono::steady_clock::now() + batchDelay_;
+                batchCondition_.notify_all();
+            }
+            
+            PacketWriter writer(currentSlot_->data, maxPacketSize_, packet.header.cmd_flag);
+            writer.writeCommand(packet);
+            return writer;
+        }
+        
+        // Submit the command prepared by beginCommand_, the command is completed in the background in async mode
+        shared_future<void> submitCommand_(PacketWriter& writer) {
+            CommandSlot* slot = currentSlot_;
+            currentSlot_ = nullptr;
+            
+            {
+                lock_guard<mutex> guard(statusLock_);
+                if (status_.display_status & RPUSBDISP_DISPLAY_STATUS_DIRTY_FLAG) {
+                    writer.firstHeader() |= RPUSBDISP_CMD_FLAG_CLEARDITY;
+                }
+            }
+            
+            if (slot == batchSlot_) {
+                batchSize_ = commandOffset_ + writer.size();
+                return batchCompletion_;
+            }
+            
+            // only asynchronous commands need a future, which costs an allocation for its shared state
+            shared_future<void> completion = completedCommand_;
+            
+            slot->async = asyncMode_;
+            if (slot->async) {
+                slot->completion = promise<void>();
+                completion = slot->completion.get_future().share();
+            }
+            
+            submitSlot_(slot, writer.size());
+            
+            if (!slot->async) {
+                TransferStatus status;
+                {
+                    unique_lock<mutex> lock(slotLock_);
+                    slotCondition_.wait(lock, bind(&RoboPeakUsbDisplayDeviceImpl::isSlotCompleted_, this, slot));
+                    status = slot->status;
+                }
+                
+                if (status != deps::libusbx_wrap::TransferStatusCompleted) {
+                    throw Exception(status);
+                }
+            }
+            
+            return completion;
+        }
+        
+        // Submit the transfer of a slot, the slot is released if the transfer cannot be submitted
+        void submitSlot_(CommandSlot* slot, size_t transferSize) {
+            slot->pending = true;
+            
+            try {
+                slot->transfer->setTransferBuffer(slot->buffer, transferSize);
+                slot->transfer->submit();
+            } catch (...) {
+                releaseSlot_(slot);
+                throw;
+            }
+        }
+        
+        // Submit the commands queued in the current batch, displayLock_ should be held
+        void submitBatch_() {
+            CommandSlot* slot = batchSlot_;
+            batchSlot_ = nullptr;
+            
+            try {
+                submitSlot_(slot, batchSize_);
+            } catch (...) {
+                // the callers of the queued commands have returned, so the error is reported like a failed transfer
+                exception_ptr error = current_exception();
+                {
+                    lock_guard<mutex> guard(slotLock_);
+                    if (!pendingError_) {
+                        pendingError_ = error;
+                    }
+                }
+                
+                // the slot is free, but cannot be acquired again before displayLock_ is released
+                slot->completion.set_exception(error);
+            }
+        }
+        
+        void batchFlushWorker_() {
+            unique_lock<mutex> lock(displayLock_);
+            
+            while (batchFlushing_) {
+                if (!batchSlot_) {
+                    batchCondition_.wait(lock);
+                } else if (chrono::steady_clock::now() < batchDeadline_) {
+                    batchCondition_.wait_until(lock, batchDeadline_);
+                } else {
+                    submitBatch_();
+                }
+            }
+        }
+        
+        // Invoked by the libusb event thread
+        void onCommandCompleted_(CommandSlot* slot, TransferStatus status) {
+            if (!slot->async) {
+                // the caller is waiting for the slot and reports the error itself
+                releaseSlot_(slot, status);
+                return;
+            }
+            
+            exception_ptr error;
+            
+            if (status != deps::libusbx_wrap::TransferStatusCompleted) {
+                error = make_exception_ptr(Exception(status));
+            }
+            
+            // the slot should be back before the waiters of the command wake up
+            promise<void> completion = move(slot->completion);
+            releaseSlot_(slot, status, error);
+            
+            if (error) {
+                completion.set_exception(error);
+            } else {
+                completion.set_value();
+            }
+        }
+        
+        // Drop or pre-allocate slots so there are exactly count of them, no command should be pending
+        void resizeSlots_(size_t count) {
+            // freeSlots_ never grows beyond its capacity, so releasing a slot does not allocate
+            slots_.reserve(count);
+            freeSlots_.reserve(count);
+            
+            if (slots_.size() > count) {
+                slots_.resize(count);
+            }
+            
+            freeSlots_.clear();
+            for (auto& slot : slots_) {
+                freeSlots_.push_back(slot.get());
+            }
+            
+            while (slots_.size() < count) {
+                slots_.push_back(allocSlot_());
+                freeSlots_.push_back(slots_.back().get());
+            }
+        }
+        
+        unique_ptr<CommandSlot> allocSlot_() {
+            unique_ptr<CommandSlot> slot(new CommandSlot());
+            
+            slot->pending = false;
+            slot->status = deps::libusbx_wrap::TransferStatusCompleted;
+            slot->async = false;
+            allocSlotBuffer_(slot.get(), maxTransferSize_);
+            
+            // the transfer and its callback live as long as the slot, they are reused by every command sent with the slot
+            slot->transfer = device_->allocTransfer(EndpointDirectionOut, EndpointTransferTypeBulk, RoboPeakUsbDisplayDevice::UsbDeviceDisplayEndpoint);
+            slot->transfer->setCompletionCallback(bind(&RoboPeakUsbDisplayDeviceImpl::onCommandCompleted_, this, slot.get(), _1));
+            return slot;
+        }
+        
+        void allocSlotBuffer_(CommandSlot* slot, size_t size) {
+            slot->buffer = shared_ptr<Buffer>(new Buffer(size, RP_USB_DISPLAY_TRANSFER_BUFFER_ALIGNMENT));
+            
+            // a slot buffer is only touched by the command owning the slot, so its address is cached instead of locking it for every command
+            slot->data = slot->buffer->lock();
+            slot->buffer->unlock(slot->data);
+        }
+        
+        CommandSlot* acquireSlot_() {
+            unique_lock<mutex> lock(slotLock_);
+            slotCondition_.wait(lock, bind(&RoboPeakUsbDisplayDeviceImpl::isSlotAvailable_, this));
+            
+            CommandSlot* slot = freeSlots_.back();
+            freeSlots_.pop_back();
+            return slot;
+        }
+        
+        void releaseSlot_(CommandSlot* slot, TransferStatus status = deps::libusbx_wrap::TransferStatusCompleted, exception_ptr error = nullptr) {
+            {
+                lock_guard<mutex> guard(slotLock_);
+                if (error && !pendingError_) {
+                    pendingError_ = error;
+                }
+                
+                slot->status = status;
+                slot->pending = false;
+                freeSlots_.push_back(slot);
+            }
+            slotCondition_.notify_all();
+        }
+        
+        void waitForPendingCommands_() {
+            unique_lock<mutex> lock(slotLock_);
+            slotCondition_.wait(lock, bind(&RoboPeakUsbDisplayDeviceImpl::isIdle_, this));
+        }
+        
+        bool isSlotAvailable_() {
+            return !freeSlots_.empty();
+        }
+        
+        bool isSlotCompleted_(CommandSlot* slot) {
+            return !slot->pending;
+        }
+        
+        bool isIdle_() {
+            return freeSlots_.size() == slots_.size();
+        }
+        
         void statusFetchingWorker_() {
             shared_ptr<Transfer> transfer = device_->allocTransfer(EndpointDirectionIn, EndpointTransferTypeInterrupt, RoboPeakUsbDisplayDevice::UsbDeviceStatusEndpoint);
             transfer->setTransferBuffer(shared_ptr<Buffer>(new Buffer(32)));
@@ -349,6 +708,35 @@ namespace rp { namespace drivers { namespace display {
         InterfaceScope interfaceScope_;
         shared_ptr<Pipeline> pipeline_;
         
+        mutex displayLock_;
+        CommandSlot* currentSlot_;
+        size_t commandOffset_;
+        bool asyncMode_;
+        shared_future<void> completedCommand_;
+        RoboPeakUsbDisplayRleMode rleMode_;
+        vector<_u8> rlePlan_;
+        
+        bool batchMode_;
+        chrono::milliseconds batchDelay_;
+        CommandSlot* batchSlot_;
+        size_t batchSize_;
+        shared_future<void> batchCompletion_;
+        chrono::steady_clock::time_point batchDeadline_;
+        condition_variable batchCondition_;
+        bool batchFlushing_;
+        thread batchFlushThread_;
+        
+        mutex slotLock_;
+        condition_variable slotCondition_;
+        vector<unique_ptr<CommandSlot>> slots_;
+        vector<CommandSlot*> freeSlots_;
+        size_t maxTransferSize_;
+        exception_ptr pendingError_;
+        
+        atomic<uint64_t> rleBitbltCount_;
+        atomic<uint64_t> rawBitbltCount_;
+        atomic<int64_t> bytesSaved_;
+        
         int maxPacketSize_;
     };
     
@@ -363,20 +751,44 @@ namespace rp { namespace drivers { namespace display {
         return impl_->getStatus();
     }
     
-    void RoboPeakUsbDisplayDevice::fill(uint16_t color) {
-        impl_->fill(color);
+    shared_future<void> RoboPeakUsbDisplayDevice::fill(uint16_t color) {
+        return impl_->fill(color);
+    }
+    
+    shared_future<void> RoboPeakUsbDisplayDevice::bitblt(uint16_t x, uint16_t y, uint16_t width, uint16_t height, RoboPeakUsbDisplayBitOperation bitOperation, void *buffer) {
+        return impl_->bitblt(x, y, width, height, bitOperation, buffer, (size_t)width * 2);
+    }
+    
+    shared_future<void> RoboPeakUsbDisplayDevice::bitblt(uint16_t x, uint16_t y, uint16_t width, uint16_t height, RoboPeakUsbDisplayBitOperation bitOperation, const void *buffer, size_t stride) {
+        return impl_->bitblt(x, y, width, height, bitOperation, buffer, stride);
+    }
+    
+    shared_future<void> RoboPeakUsbDisplayDevice::fillrect(uint16_t left, uint16_t top, uint16_t right, uint16_t bottom, uint16_t color, RoboPeakUsbDisplayBitOperation bitOperation) {
+        return impl_->fillrect(left, top, right, bottom, color, bitOperation);
+    }
+    
+    shared_future<void> RoboPeakUsbDisplayDevice::copyArea(uint16_t srcX, uint16_t srcY, uint16_t destX, uint16_t destY, uint16_t width, uint16_t height) {
+        return impl_->copyArea(srcX, srcY, destX, destY, width, height);
+    }
+    
+    void RoboPeakUsbDisplayDevice::setAsyncMode(bool enabled, int maxPendingCommands) {
+        impl_->setAsyncMode(enabled, maxPendingCommands);
+    }
+    
+    void RoboPeakUsbDisplayDevice::setBatchMode(bool enabled, int maxDelayMs) {
+        impl_->setBatchMode(enabled, maxDelayMs);
     }
     
-    void RoboPeakUsbDisplayDevice::bitblt(uint16_t x, uint16_t y, uint16_t width, uint16_t height, RoboPeakUsbDisplayBitOperation bitOperation, void *buffer) {
-        impl_->bitblt(x, y, width, height, bitOperation, buffer);
+    void RoboPeakUsbDisplayDevice::flush() {
+        impl_->flush();
     }
     
-    void RoboPeakUsbDisplayDevice::fillrect(uint16_t left, uint16_t top, uint16_t right, uint16_t bottom, uint16_t color, RoboPeakUsbDisplayBitOperation bitOperation) {
-        impl_->fillrect(left, top, right, bottom, color, bitOperation);
+    void RoboPeakUsbDisplayDevice::setRleMode(RoboPeakUsbDisplayRleMode mode) {
+        impl_->setRleMode(mode);
     }
     
-    void RoboPeakUsbDisplayDevice::copyArea(uint16_t srcX, uint16_t srcY, uint16_t destX, uint16_t destY, uint16_t width, uint16_t height) {
-        impl_->copyArea(srcX, srcY, destX, destY, width, height);
+    RoboPeakUsbDisplayBitbltStatistics RoboPeakUsbDisplayDevice::getBitbltStatistics() const {
+        return impl_->getBitbltStatistics();
     }
     
     void RoboPeakUsbDisplayDevice::enable() {
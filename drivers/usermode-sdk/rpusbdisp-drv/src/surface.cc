@@ -0,0 +1,565 @@
+//
+//  surface.cc
+//  Damage tracking framebuffer of RoboPeak Mini USB Display
+//
+//  Copyright (c) 2013 RoboPeak.com. All rights reserved.
+//
+
+#include <rp/drivers/display/rpusbdisp/surface.h>
+#include <rp/drivers/display/rpusbdisp/rpusbdisp.h>
+#include <rp/drivers/display/rpusbdisp/simd.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// Bytes a command costs besides its pixels (header, packet padding and the transfer round trip), used to decide whether two damaged areas should be sent together
+#define RP_USB_DISPLAY_SURFACE_COMMAND_COST 256
+
+// Beyond these limits pending changes are merged as they come, so drawing a lot between two presents does not take unbounded memory
+#define RP_USB_DISPLAY_SURFACE_MAX_DAMAGE_RECTS 32
+#define RP_USB_DISPLAY_SURFACE_MAX_OPERATIONS 64
+
+// drawFrame compares frames in tiles, a tile row is 64 bytes so it can be compared with a few wide loads
+#define RP_USB_DISPLAY_SURFACE_TILE_WIDTH 32
+#define RP_USB_DISPLAY_SURFACE_TILE_HEIGHT 16
+
+using namespace std;
+using namespace rp::util;
+
+namespace rp { namespace drivers { namespace display {
+
+    // right and bottom are exclusive
+    struct SurfaceRect {
+        int left;
+        int top;
+        int right;
+        int bottom;
+    };
+    
+    enum SurfaceOperationType {
+        SurfaceOperationTypeFill,
+        SurfaceOperationTypeCopy
+    };
+    
+    // A drawing operation the display can replay by itself
+    struct SurfaceOperation {
+        SurfaceOperationType type;
+        SurfaceRect dest;
+        int srcX;
+        int srcY;
+        uint16_t color;
+    };
+    
+    static inline size_t rectArea(const SurfaceRect& rect) {
+        return (size_t)(rect.right - rect.left) * (rect.bottom - rect.top);
+    }
+    
+    static inline SurfaceRect rectUnion(const SurfaceRect& a, const SurfaceRect& b) {
+        SurfaceRect rect;
+        
+        rect.left = min(a.left, b.left);
+        rect.top = min(a.top, b.top);
+        rect.right = max(a.right, b.right);
+        rect.bottom = max(a.bottom, b.bottom);
+        return rect;
+    }
+    
+    static inline bool rectIntersects(const SurfaceRect& a, const SurfaceRect& b) {
+        return a.left < b.right && b.left < a.right && a.top < b.bottom && b.top < a.bottom;
+    }
+    
+    static inline bool rectContains(const SurfaceRect& outer, const SurfaceRect& inner) {
+        return outer.left <= inner.left && outer.top <= inner.top && outer.right >= inner.right && outer.bottom >= inner.bottom;
+    }
+    
+    // Changed tiles next to each other in a tile row, and the rectangle they have been added to
+    struct SurfaceTileRun {
+        int left;
+        int right;
+        size_t rect;
+    };
+    
+    /*
+     * 64 byte block compares, a tile row of drawFrame
+     *
+     * The vector versions are picked the same way as the RLE scanners: NEON or SSE2 at compile time, AVX2 when
+     * the CPU supports it.
+     */
+    typedef bool (*BlockEqualsFunc)(const uint8_t* a, const uint8_t* b);
+    
+    static bool blockEquals64Scalar(const uint8_t* a, const uint8_t* b) {
+        uint64_t wordsA[8], wordsB[8];
+        uint64_t diff = 0;
+        
+        memcpy(wordsA, a, sizeof(wordsA));
+        memcpy(wordsB, b, sizeof(wordsB));
+        
+        for (int i = 0; i < 8; i++) {
+            diff |= wordsA[i] ^ wordsB[i];
+        }
+        
+        return !diff;
+    }
+    
+#ifdef RP_USBDISP_SIMD_SSE2
+    static bool blockEquals64Sse2(const uint8_t* a, const uint8_t* b) {
+        __m128i diff = _mm_setzero_si128();
+        
+        for (int i = 0; i < 4; i++) {
+            diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128((const __m128i*)a + i), _mm_loadu_si128((const __m128i*)b + i)));
+        }
+        
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xFFFF;
+    }
+#endif
+    
+#ifdef RP_USBDISP_SIMD_AVX2
+    static RP_USBDISP_TARGET_AVX2 bool blockEquals64Avx2(const uint8_t* a, const uint8_t* b) {
+        __m256i diff = _mm256_or_si256(
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)a), _mm256_loadu_si256((const __m256i*)b)),
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)a + 1), _mm256_loadu_si256((const __m256i*)b + 1)));
+        
+        return _mm256_testz_si256(diff, diff) != 0;
+    }
+#endif
+    
+#ifdef RP_USBDISP_SIMD_NEON
+    static bool blockEquals64Neon(const uint8_t* a, const uint8_t* b) {
+        uint8x16_t diff = veorq_u8(vld1q_u8(a), vld1q_u8(b));
+        
+        for (int i = 1; i < 4; i++) {
+            diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i * 16), vld1q_u8(b + i * 16)));
+        }
+        
+        uint64x2_t words = vreinterpretq_u64_u8(diff);
+        return !(vgetq_lane_u64(words, 0) | vgetq_lane_u64(words, 1));
+    }
+#endif
+    
+    static BlockEqualsFunc selectBlockEquals64() {
+        BlockEqualsFunc blockEquals = &blockEquals64Scalar;
+        
+#if defined(RP_USBDISP_SIMD_NEON)
+        blockEquals = &blockEquals64Neon;
+#elif defined(RP_USBDISP_SIMD_SSE2)
+        blockEquals = &blockEquals64Sse2;
+#   ifdef RP_USBDISP_SIMD_AVX2
+        if (cpuSupportsAvx2()) {
+            blockEquals = &blockEquals64Avx2;
+        }
+#   endif
+#endif
+        
+        return blockEquals;
+    }
+    
+    static BlockEqualsFunc getBlockEquals64() {
+        static const BlockEqualsFunc blockEquals = selectBlockEquals64();
+        return blockEquals;
+    }
+    
+    class RoboPeakUsbDisplaySurfaceImpl : public noncopyable {
+    public:
+        RoboPeakUsbDisplaySurfaceImpl(shared_ptr<RoboPeakUsbDisplayDevice> device)
+        : device_(device), width_(device->getWidth()), height_(device->getHeight()), pixels_((size_t)width_ * height_, 0)
+        {
+            markAllDirty();
+        }
+        
+        int getWidth() const {
+            return width_;
+        }
+        
+        int getHeight() const {
+            return height_;
+        }
+        
+        uint16_t* getPixels() {
+            return &pixels_[0];
+        }
+        
+        size_t getStride() const {
+            return (size_t)width_ * 2;
+        }
+        
+        void markDirty(int x, int y, int width, int height) {
+            SurfaceRect rect;
+            
+            if (clip_(x, y, width, height, rect)) {
+                addDamage_(rect);
+            }
+        }
+        
+        void markAllDirty() {
+            SurfaceRect screen = {0, 0, width_, height_};
+            
+            // whatever was pending is covered by a full redraw
+            operations_.clear();
+            damage_.clear();
+            damage_.push_back(screen);
+        }
+        
+        void fillRect(int x, int y, int width, int height, uint16_t color) {
+            SurfaceRect rect;
+            
+            if (!clip_(x, y, width, height, rect))
+                return;
+            
+            for (int row = rect.top; row < rect.bottom; row++) {
+                fill_n(pixelAt_(rect.left, row), rect.right - rect.left, color);
+            }
+            
+            SurfaceOperation operation;
+            
+            operation.type = SurfaceOperationTypeFill;
+            operation.dest = rect;
+            operation.srcX = 0;
+            operation.srcY = 0;
+            operation.color = color;
+            addOperation_(operation);
+        }
+        
+        void drawImage(int x, int y, int width, int height, const void* pixels) {
+            SurfaceRect rect;
+            
+            if (!clip_(x, y, width, height, rect))
+                return;
+            
+            const uint16_t* src = (const uint16_t*)pixels + (size_t)(rect.top - y) * width + (rect.left - x);
+            
+            for (int row = rect.top; row < rect.bottom; row++, src += width) {
+                memcpy(pixelAt_(rect.left, row), src, (size_t)(rect.right - rect.left) * 2);
+            }
+            
+            addDamage_(rect);
+        }
+        
+        void drawFrame(const void* pixels, size_t stride) {
+            const uint8_t* frame = (const uint8_t*)pixels;
+            int tileColumns = (width_ + RP_USB_DISPLAY_SURFACE_TILE_WIDTH - 1) / RP_USB_DISPLAY_SURFACE_TILE_WIDTH;
+            vector<SurfaceRect> rects;
+            vector<SurfaceTileRun> previousRuns;
+            vector<SurfaceTileRun> runs;
+            
+            if (!stride)
+                stride = getStride();
+            
+            for (int tileTop = 0; tileTop < height_; tileTop += RP_USB_DISPLAY_SURFACE_TILE_HEIGHT) {
+                int tileBottom = min(tileTop + RP_USB_DISPLAY_SURFACE_TILE_HEIGHT, height_);
+                
+                // join the changed tiles of this tile row into horizontal runs
+                runs.clear();
+                for (int column = 0; column < tileColumns; column++) {
+                    int tileLeft = column * RP_USB_DISPLAY_SURFACE_TILE_WIDTH;
+                    int tileRight = min(tileLeft + RP_USB_DISPLAY_SURFACE_TILE_WIDTH, width_);
+                    
+                    if (!tileChanged_(frame, stride, tileLeft, tileTop, tileRight, tileBottom))
+                        continue;
+                    
+                    if (!runs.empty() && runs.back().right == tileLeft) {
+                        runs.back().right = tileRight;
+                    } else {
+                        SurfaceTileRun run = {tileLeft, tileRight, 0};
+                        runs.push_back(run);
+                    }
+                }
+                
+                // a run spanning the same columns as a run right above it extends that rectangle downwards
+                for (auto& run : runs) {
+                    auto previous = find_if(previousRuns.begin(), previousRuns.end(), [&run](const SurfaceTileRun& candidate) {
+                        return candidate.left == run.left && candidate.right == run.right;
+                    });
+                    
+                    if (previous != previousRuns.end()) {
+                        run.rect = previous->rect;
+                        rects[run.rect].bottom = tileBottom;
+                    } else {
+                        SurfaceRect rect = {run.left, tileTop, run.right, tileBottom};
+                        
+                        run.rect = rects.size();
+                        rects.push_back(rect);
+                    }
+                }
+                
+                swap(previousRuns, runs);
+            }
+            
+            for (auto& rect : rects) {
+                trimUnchanged_(frame, stride, rect);
+                
+                for (int row = rect.top; row < rect.bottom; row++) {
+                    memcpy(pixelAt_(rect.left, row), frame + row * stride + rect.left * 2, (size_t)(rect.right - rect.left) * 2);
+                }
+                
+                addDamage_(rect);
+            }
+        }
+        
+        void copyArea(int srcX, int srcY, int destX, int destY, int width, int height) {
+            // clip the source and the destination area alike
+            int offsetX = max(max(0, -srcX), -destX);
+            int offsetY = max(max(0, -srcY), -destY);
+            
+            srcX += offsetX; destX += offsetX; width -= offsetX;
+            srcY += offsetY; destY += offsetY; height -= offsetY;
+            width = min(width, min(width_ - srcX, width_ - destX));
+            height = min(height, min(height_ - srcY, height_ - destY));
+            
+            if (width <= 0 || height <= 0)
+                return;
+            
+            // rows are walked away from the overlapping part, memmove takes care of the overlap within a row
+            if (destY > srcY) {
+                for (int row = height - 1; row >= 0; row--) {
+                    memmove(pixelAt_(destX, destY + row), pixelAt_(srcX, srcY + row), (size_t)width * 2);
+                }
+            } else {
+                for (int row = 0; row < height; row++) {
+                    memmove(pixelAt_(destX, destY + row), pixelAt_(srcX, srcY + row), (size_t)width * 2);
+                }
+            }
+            
+            SurfaceRect src = {srcX, srcY, srcX + width, srcY + height};
+            SurfaceRect dest = {destX, destY, destX + width, destY + height};
+            
+            // the display can only copy what it already shows
+            for (auto& rect : damage_) {
+                if (rectIntersects(rect, src)) {
+                    addDamage_(dest);
+                    return;
+                }
+            }
+            
+            SurfaceOperation operation;
+            
+            operation.type = SurfaceOperationTypeCopy;
+            operation.dest = dest;
+            operation.srcX = srcX;
+            operation.srcY = srcY;
+            operation.color = 0;
+            addOperation_(operation);
+        }
+        
+        void present() {
+            try {
+                for (auto& operation : operations_) {
+                    replay_(operation);
+                }
+                
+                mergeDamage_(RP_USB_DISPLAY_SURFACE_MAX_DAMAGE_RECTS);
+                
+                for (auto& rect : damage_) {
+                    device_->bitblt(rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top, RoboPeakUsbDisplayBitOperationCopy, pixelAt_(rect.left, rect.top), getStride());
+                }
+            } catch (...) {
+                // it is unknown how much has reached the display
+                markAllDirty();
+                throw;
+            }
+            
+            operations_.clear();
+            damage_.clear();
+        }
+    
+    private:
+        bool clip_(int x, int y, int width, int height, SurfaceRect& rect) const {
+            rect.left = max(x, 0);
+            rect.top = max(y, 0);
+            rect.right = min(x + width, width_);
+            rect.bottom = min(y + height, height_);
+            
+            return rect.left < rect.right && rect.top < rect.bottom;
+        }
+        
+        uint16_t* pixelAt_(int x, int y) {
+            return &pixels_[(size_t)y * width_ + x];
+        }
+        
+        bool tileChanged_(const uint8_t* frame, size_t stride, int left, int top, int right, int bottom) {
+            size_t bytes = (size_t)(right - left) * 2;
+            const BlockEqualsFunc blockEquals64 = getBlockEquals64();
+            
+            for (int row = top; row < bottom; row++) {
+                const uint8_t* framePixels = frame + row * stride + left * 2;
+                const uint8_t* shadowPixels = (const uint8_t*)pixelAt_(left, row);
+                
+                if (bytes == 64) {
+                    if (!blockEquals64(framePixels, shadowPixels))
+                        return true;
+                } else if (memcmp(framePixels, shadowPixels, bytes)) {
+                    return true;
+                }
+            }
+            
+            return false;
+        }
+        
+        bool pixelChanged_(const uint8_t* frame, size_t stride, int x, int y) {
+            return memcmp(frame + y * stride + x * 2, pixelAt_(x, y), 2) != 0;
+        }
+        
+        bool columnChanged_(const uint8_t* frame, size_t stride, const SurfaceRect& rect, int x) {
+            for (int row = rect.top; row < rect.bottom; row++) {
+                if (pixelChanged_(frame, stride, x, row))
+                    return true;
+            }
+            
+            return false;
+        }
+        
+        // Shrink a rectangle of changed tiles to the bounding box of the pixels actually changed
+        void trimUnchanged_(const uint8_t* frame, size_t stride, SurfaceRect& rect) {
+            size_t bytes = (size_t)(rect.right - rect.left) * 2;
+            
+            while (!memcmp(frame + rect.top * stride + rect.left * 2, pixelAt_(rect.left, rect.top), bytes)) {
+                rect.top++;
+            }
+            
+            while (!memcmp(frame + (rect.bottom - 1) * stride + rect.left * 2, pixelAt_(rect.left, rect.bottom - 1), bytes)) {
+                rect.bottom--;
+            }
+            
+            while (!columnChanged_(frame, stride, rect, rect.left)) {
+                rect.left++;
+            }
+            
+            while (!columnChanged_(frame, stride, rect, rect.right - 1)) {
+                rect.right--;
+            }
+        }
+        
+        void addDamage_(const SurfaceRect& rect) {
+            damage_.push_back(rect);
+            
+            if (damage_.size() > RP_USB_DISPLAY_SURFACE_MAX_DAMAGE_RECTS) {
+                mergeDamage_(RP_USB_DISPLAY_SURFACE_MAX_DAMAGE_RECTS / 2);
+            }
+        }
+        
+        // Operations are replayed by the display before the damaged areas are sent, so an operation covering a damaged area makes it clean
+        void addOperation_(const SurfaceOperation& operation) {
+            damage_.erase(remove_if(damage_.begin(), damage_.end(), [&operation](const SurfaceRect& rect) {
+                return rectContains(operation.dest, rect);
+            }), damage_.end());
+            
+            if (operations_.size() >= RP_USB_DISPLAY_SURFACE_MAX_OPERATIONS) {
+                // resend the result of the pending operations as pixels instead
+                vector<SurfaceOperation> operations;
+                swap(operations, operations_);
+                
+                for (auto& pending : operations) {
+                    addDamage_(pending.dest);
+                }
+                addDamage_(operation.dest);
+                return;
+            }
+            
+            operations_.push_back(operation);
+        }
+        
+        void replay_(const SurfaceOperation& operation) {
+            const SurfaceRect& dest = operation.dest;
+            
+            switch (operation.type) {
+                case SurfaceOperationTypeFill:
+                    if (dest.left == 0 && dest.top == 0 && dest.right == width_ && dest.bottom == height_) {
+                        device_->fill(operation.color);
+                    } else {
+                        device_->fillrect(dest.left, dest.top, dest.right - 1, dest.bottom - 1, operation.color, RoboPeakUsbDisplayBitOperationCopy);
+                    }
+                    break;
+                case SurfaceOperationTypeCopy:
+                    device_->copyArea(operation.srcX, operation.srcY, dest.left, dest.top, dest.right - dest.left, dest.bottom - dest.top);
+                    break;
+            }
+        }
+        
+        // Merge damaged areas whenever sending them together is cheaper than sending them one by one, then keep merging the
+        // cheapest pairs until at most maxRects are left
+        void mergeDamage_(size_t maxRects) {
+            while (damage_.size() > 1) {
+                size_t bestA = 0, bestB = 0;
+                long long bestGain = 0;
+                bool found = false;
+                
+                for (size_t a = 0; a < damage_.size(); a++) {
+                    for (size_t b = a + 1; b < damage_.size(); b++) {
+                        SurfaceRect merged = rectUnion(damage_[a], damage_[b]);
+                        long long separateCost = (long long)(rectArea(damage_[a]) + rectArea(damage_[b])) * 2 + 2 * RP_USB_DISPLAY_SURFACE_COMMAND_COST;
+                        long long mergedCost = (long long)rectArea(merged) * 2 + RP_USB_DISPLAY_SURFACE_COMMAND_COST;
+                        long long gain = separateCost - mergedCost;
+                        
+                        if (!found || gain > bestGain) {
+                            bestA = a;
+                            bestB = b;
+                            bestGain = gain;
+                            found = true;
+                        }
+                    }
+                }
+                
+                if (bestGain < 0 && damage_.size() <= maxRects)
+                    break;
+                
+                damage_[bestA] = rectUnion(damage_[bestA], damage_[bestB]);
+                damage_.erase(damage_.begin() + bestB);
+            }
+        }
+        
+        shared_ptr<RoboPeakUsbDisplayDevice> device_;
+        int width_;
+        int height_;
+        vector<uint16_t> pixels_;
+        
+        vector<SurfaceRect> damage_;
+        vector<SurfaceOperation> operations_;
+    };
+    
+    RoboPeakUsbDisplaySurface::RoboPeakUsbDisplaySurface(shared_ptr<RoboPeakUsbDisplayDevice> device) : impl_(new RoboPeakUsbDisplaySurfaceImpl(device)) {}
+    RoboPeakUsbDisplaySurface::~RoboPeakUsbDisplaySurface() {}
+    
+    int RoboPeakUsbDisplaySurface::getWidth() const {
+        return impl_->getWidth();
+    }
+    
+    int RoboPeakUsbDisplaySurface::getHeight() const {
+        return impl_->getHeight();
+    }
+    
+    uint16_t* RoboPeakUsbDisplaySurface::getPixels() {
+        return impl_->getPixels();
+    }
+    
+    size_t RoboPeakUsbDisplaySurface::getStride() const {
+        return impl_->getStride();
+    }
+    
+    void RoboPeakUsbDisplaySurface::markDirty(int x, int y, int width, int height) {
+        impl_->markDirty(x, y, width, height);
+    }
+    
+    void RoboPeakUsbDisplaySurface::markAllDirty() {
+        impl_->markAllDirty();
+    }
+    
+    void RoboPeakUsbDisplaySurface::fillRect(int x, int y, int width, int height, uint16_t color) {
+        impl_->fillRect(x, y, width, height, color);
+    }
+    
+    void RoboPeakUsbDisplaySurface::drawImage(int x, int y, int width, int height, const void* pixels) {
+        impl_->drawImage(x, y, width, height, pixels);
+    }
+    
+    void RoboPeakUsbDisplaySurface::drawFrame(const void* pixels, size_t stride) {
+        impl_->drawFrame(pixels, stride);
+    }
+    
+    void RoboPeakUsbDisplaySurface::copyArea(int srcX, int srcY, int destX, int destY, int width, int height) {
+        impl_->copyArea(srcX, srcY, destX, destY, width, height);
+    }
+    
+    void RoboPeakUsbDisplaySurface::present() {
+        impl_->present();
+    }
+
+}}}